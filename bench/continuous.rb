@@ -0,0 +1,49 @@
+#!/usr/bin/env ruby
+
+# Measures the cost of always-on profiling with RubyProf::Continuous:
+# the overhead on a call heavy workload, the time taken to end each
+# window and the memory the kept windows use.  Windows are short here
+# so that the run covers several of them.
+#
+#   ruby -Ilib -Iext bench/continuous.rb [seconds] [window]
+
+require 'benchmark'
+require 'ruby-prof'
+
+def fib(n)
+  n < 2 ? n : fib(n - 1) + fib(n - 2)
+end
+
+def workload(rounds)
+  rounds.times { fib(20) }
+end
+
+seconds = (ARGV[0] || 2).to_f
+window = (ARGV[1] || 0.25).to_f
+
+def profile(rounds, window)
+  profiler = RubyProf::Continuous.new(:window => window, :windows => 1000,
+                                      :trace => !RubyProf.respond_to?(:sampling=))
+  profiler.start
+  time = Benchmark.realtime { workload(rounds) }
+  rotate = Benchmark.realtime { profiler.rotate }
+  profiler.stop
+  [profiler, time, rotate]
+end
+
+# Size the workload to take about the requested time while profiled,
+# tracing is much slower than sampling
+rounds = 1
+rounds *= 2 while profile(rounds, 1000)[1] < seconds / 10
+rounds *= 10
+
+plain = Benchmark.realtime { workload(rounds) }
+profiler, profiled, rotate = profile(rounds, window)
+windows = profiler.windows
+
+puts "mode:            #{RubyProf.respond_to?(:sampling=) ? 'sampling' : 'tracing'}"
+puts "plain:           %.3fs" % plain
+puts "profiled:        %.3fs (%.1f%% overhead)" % [profiled, (profiled - plain) / plain * 100]
+puts "windows:         %d of %.3fs" % [windows.length, profiler.window]
+puts "rotate:          %.3fms" % (rotate * 1000)
+puts "memory:          %dKB" % (profiler.bytes / 1024)
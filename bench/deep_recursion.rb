@@ -0,0 +1,39 @@
+#!/usr/bin/env ruby
+
+# Compares the memory a profile of deeply recursive code uses with and
+# without RubyProf.recursion_limit, like a recursive descent parser
+# working through a deeply nested document.  Each recursion depth is
+# normally a method of its own, so memory grows with the depth.
+#
+#   ruby -Ilib -Iext bench/deep_recursion.rb [depth] [descents]
+
+require 'benchmark'
+require 'ruby-prof'
+
+def parse_value(depth)
+  parse_list(depth)
+end
+
+def parse_list(depth)
+  return if depth == 0
+  depth.to_s
+  parse_value(depth - 1)
+end
+
+depth = (ARGV[0] || 2_000).to_i
+descents = (ARGV[1] || 20).to_i
+
+[nil, 10, 0].each do |limit|
+  RubyProf.recursion_limit = limit
+  result = nil
+  time = Benchmark.realtime do
+    result = RubyProf.profile { descents.times { parse_value(depth) } }
+  end
+  methods = result.threads.values.inject(0) { |sum, methods| sum + methods.length }
+  stats = result.allocation_stats
+
+  puts "recursion_limit: #{limit.inspect}"
+  puts "  methods:       #{methods}"
+  puts "  arena used:    #{stats[:used] / 1024}KB"
+  puts "  time:          %.3fs" % time
+end
@@ -0,0 +1,36 @@
+#!/usr/bin/env ruby
+
+# Times writing a large profile with RubyProf::Result#dump and reading
+# it back with RubyProf::Result.load, and the size of the file.
+#
+#   ruby -Ilib -Iext bench/dump_load.rb [methods] [path]
+
+require 'ruby-prof'
+require 'benchmark'
+require 'tmpdir'
+
+class Workload
+end
+
+method_count = (ARGV[0] || 50_000).to_i
+path = ARGV[1] || File.join(Dir.tmpdir, 'ruby_prof_bench.prof')
+
+names = (0...method_count).map { |i| "method_#{i}" }
+names.each { |name| Workload.class_eval("def #{name}; end") }
+
+workload = Workload.new
+result = RubyProf.profile do
+  names.each { |name| workload.send(name) }
+end
+
+dump = Benchmark.realtime { result.dump(path) }
+loaded = nil
+load = Benchmark.realtime { loaded = RubyProf::Result.load(path) }
+threads = Benchmark.realtime { loaded.threads }
+
+puts "methods:        #{method_count}"
+puts "file size:      #{File.size(path) / 1024}KB"
+puts "dump:           %.3fs" % dump
+puts "load:           %.3fs" % load
+puts "threads:        %.3fs" % threads
+File.delete(path) unless ARGV[1]
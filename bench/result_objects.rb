@@ -0,0 +1,54 @@
+#!/usr/bin/env ruby
+
+# Counts the Ruby objects created when a large profile is stopped and
+# when it is walked twice, the way the graph printers do.  MethodInfo and CallInfo objects are only
+# created when they are asked for, once per method and call, so
+# stopping costs nothing and printing again reuses them.
+#
+#   ruby -Ilib -Iext bench/result_objects.rb [methods]
+
+require 'ruby-prof'
+
+class Workload
+end
+
+method_count = (ARGV[0] || 5_000).to_i
+
+names = (0...method_count).map { |i| "method_#{i}" }
+names.each { |name| Workload.class_eval("def #{name}; end") }
+names.each_slice(500) { |slice| Workload.class_eval("def run_#{slice.first}; #{slice.join('; ')}; end") }
+
+def allocated
+  GC.stat(:total_allocated_objects)
+end
+
+def walk(result)
+  result.threads.each do |thread_id, methods|
+    methods.each do |method|
+      method.full_name
+      method.parents.each { |call_info| call_info.target.full_name }
+      method.children.each { |call_info| call_info.target.full_name }
+    end
+  end
+end
+
+workload = Workload.new
+RubyProf.start
+names.each_slice(500) { |slice| workload.send("run_#{slice.first}") }
+
+before = allocated
+result = RubyProf.stop
+stop = allocated - before
+
+before = allocated
+walk(result)
+first = allocated - before
+
+before = allocated
+walk(result)
+second = allocated - before
+
+puts "methods:            #{result.threads.values.first.length}"
+puts "objects to stop:    #{stop}"
+puts "objects to walk:    #{first}"
+puts "objects to rewalk:  #{second}"
@@ -0,0 +1,52 @@
+#!/usr/bin/env ruby
+
+# Compares the overhead of tracing every call with sampling the
+# stack.  The workload is call heavy, which is the worst case for
+# tracing and makes no difference to sampling.
+#
+#   ruby -Ilib -Iext bench/sampling.rb [seconds] [interval]
+
+require 'benchmark'
+require 'ruby-prof'
+
+unless RubyProf.respond_to?(:sampling=)
+  puts "Sampling is not supported on this platform"
+  exit
+end
+
+def fib(n)
+  n < 2 ? n : fib(n - 1) + fib(n - 2)
+end
+
+def workload(rounds)
+  rounds.times { fib(20) }
+end
+
+seconds = (ARGV[0] || 2).to_f
+RubyProf.sample_interval = (ARGV[1] || 1000).to_i
+
+# Size the workload to take about the requested time
+rounds = 1
+rounds *= 2 while Benchmark.realtime { workload(rounds) } < seconds / 10
+rounds *= 10
+
+plain = Benchmark.realtime { workload(rounds) }
+
+traced = Benchmark.realtime do
+  RubyProf.profile { workload(rounds) }
+end
+
+RubyProf.sampling = true
+result = nil
+sampled = Benchmark.realtime do
+  result = RubyProf.profile { workload(rounds) }
+end
+RubyProf.sampling = false
+
+fib = result.threads.values.first.detect {|method| method.full_name == 'Object#fib'}
+
+puts "interval:        #{RubyProf.sample_interval}us"
+puts "plain:           %.3fs" % plain
+puts "traced:          %.3fs (%.1f%% overhead)" % [traced, (traced - plain) / plain * 100]
+puts "sampled:         %.3fs (%.1f%% overhead)" % [sampled, (sampled - plain) / plain * 100]
+puts "fib sampled:     %.3fs" % (fib ? fib.total_time : 0)
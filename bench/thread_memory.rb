@@ -0,0 +1,44 @@
+#!/usr/bin/env ruby
+
+# Measures the memory a profile uses when many threads call the same
+# methods, like the worker threads of an application server.  Each
+# thread keeps its own counters for every method it calls while what
+# is known about the methods themselves is shared.
+#
+#   ruby -Ilib -Iext bench/thread_memory.rb [threads] [methods]
+#
+# Ruby 3.3.0 on a one cpu Xeon VM, defaults (64 threads, 2009 methods,
+# 128263 records): 33281KB, 265.7 bytes per record, with the metadata
+# in each method record; 29273KB plus an 80KB registry, 234.3 bytes
+# per record, with it in the registry.
+
+require 'ruby-prof'
+
+class Workload
+end
+
+count = (ARGV[0] || 64).to_i
+method_count = (ARGV[1] || 2_000).to_i
+
+names = (0...method_count).map { |i| "method_#{i}" }
+names.each { |name| Workload.class_eval("def #{name}; end") }
+
+result = RubyProf.profile do
+  threads = (1..count).map do
+    Thread.new do
+      workload = Workload.new
+      names.each { |name| workload.send(name) }
+    end
+  end
+  threads.each { |thread| thread.join }
+end
+
+stats = result.allocation_stats
+records = result.threads.values.inject(0) { |sum, methods| sum + methods.length }
+
+puts "threads:            #{count}"
+puts "methods:            #{stats[:methods]}"
+puts "method records:     #{records}"
+puts "arena used:         #{stats[:used] / 1024}KB"
+puts "registry:           #{stats[:registry] / 1024}KB"
+puts "bytes per record:   %.1f" % ((stats[:used] + stats[:registry]).to_f / records)
@@ -17,6 +17,42 @@ end
 
 have_header("sys/times.h")
 
+# Used to calibrate the cpu frequency for CPU_TIME and by the
+# MONOTONIC_TIME and THREAD_TIME modes
+have_library("rt", "clock_gettime")
+have_func("clock_gettime", "time.h")
+
+# Thread local storage, used to find the current thread's profiling data
+checking_for("__thread") do
+  if try_compile("__thread int x;\nint main() { return x; }")
+    $defs << "-DHAVE_TLS"
+    true
+  end
+end
+
+# Linux perf event counters
+if have_header("linux/perf_event.h") && have_header("sys/mman.h")
+  # cap_user_rdpmc is a bit field, which have_struct_member can't check
+  checking_for("struct perf_event_mmap_page.cap_user_rdpmc") do
+    if try_compile("#include <linux/perf_event.h>\nint main() { struct perf_event_mmap_page p; return p.cap_user_rdpmc; }")
+      $defs << "-DHAVE_PERF_CAP_USER_RDPMC"
+      true
+    end
+  end
+end
+
+# Sampling walks ruby 1.8's frames from a SIGPROF handler
+have_header("env.h")
+have_func("setitimer")
+have_struct_member("struct FRAME", "uniq", "env.h")
+
+# Ruby 1.9 fibers, which get stacks of their own
+have_func("rb_fiber_current")
+
+# RubyProf::Result.load maps profiles into memory
+have_func("mmap", "sys/mman.h")
+have_header("unistd.h")
+
 # Stefan Kaes / Alexander Dymo GC patch
 have_func("rb_os_allocated_objects")
 have_func("rb_gc_allocated_size")
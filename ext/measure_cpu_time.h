@@ -26,10 +26,11 @@
 
 #include <ruby.h>
 
-#if defined(_WIN32) || (defined(__GNUC__) && (defined(__i386__) || defined(__powerpc__) || defined(__ppc__)))
+#if defined(_WIN32) || (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__) || defined(__powerpc__) || defined(__ppc__)))
 #define MEASURE_CPU_TIME 2
 
 static unsigned long long cpu_frequency;
+static double cpu_frequency_error = -1;  /* Relative error of cpu_frequency, or -1 if unknown */
 
 #if defined(__GNUC__)
 
@@ -40,6 +41,11 @@ measure_cpu_time()
     unsigned long long x;
     __asm__ __volatile__ ("rdtsc" : "=A" (x));
     return x;
+#elif defined(__x86_64__)
+    /* "=A" means rax, not edx:eax, on x86_64 */
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((prof_measure_t) hi << 32) | lo;
 #elif defined(__powerpc__) || defined(__ppc__)
     unsigned long long x, y;
 
@@ -73,8 +79,176 @@ measure_cpu_time()
 #endif
 
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+
+static void
+cpu_cpuid(unsigned int leaf, unsigned int *a, unsigned int *b, unsigned int *c, unsigned int *d)
+{
+#if defined(__i386__) && defined(__PIC__)
+    /* ebx holds the GOT pointer in position independent code */
+    __asm__ __volatile__ ("xchgl %%ebx, %1\n\tcpuid\n\txchgl %%ebx, %1"
+                          : "=a" (*a), "=r" (*b), "=c" (*c), "=d" (*d)
+                          : "0" (leaf), "2" (0));
+#else
+    __asm__ __volatile__ ("cpuid"
+                          : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+                          : "0" (leaf), "2" (0));
+#endif
+}
+
+/* Does the cpu support the extended cpuid leaf? */
+static int
+cpu_has_leaf(unsigned int leaf)
+{
+    unsigned int a, b, c, d;
+    cpu_cpuid(0x80000000, &a, &b, &c, &d);
+    return a >= leaf;
+}
+
+/* An invariant time stamp counter ticks at a constant rate in all
+   power states, so it can be used as a clock. */
+static int
+cpu_clock_invariant()
+{
+    static int invariant = -1;
+
+    if (invariant < 0)
+    {
+        unsigned int a, b, c, d;
+        invariant = 0;
+        if (cpu_has_leaf(0x80000007))
+        {
+            cpu_cpuid(0x80000007, &a, &b, &c, &d);
+            invariant = (d >> 8) & 1;
+        }
+    }
+    return invariant;
+}
+
+/* Reads the time stamp counter after all previous instructions have
+   completed, using rdtscp if the cpu has it.  This is slower than
+   rdtsc so it is only used for calibration. */
+static prof_measure_t
+measure_cpu_time_ordered()
+{
+    static int rdtscp = -1;
+    unsigned int lo, hi, aux;
+
+    if (rdtscp < 0)
+    {
+        unsigned int a, b, c, d;
+        rdtscp = 0;
+        if (cpu_has_leaf(0x80000001))
+        {
+            cpu_cpuid(0x80000001, &a, &b, &c, &d);
+            rdtscp = (d >> 27) & 1;
+        }
+    }
+
+    if (!rdtscp)
+        return measure_cpu_time();
+
+    /* rdtscp, spelled out for older assemblers */
+    __asm__ __volatile__ (".byte 0x0f, 0x01, 0xf9" : "=a" (lo), "=d" (hi), "=c" (aux));
+    return ((prof_measure_t) hi << 32) | lo;
+}
+
+#elif defined(__GNUC__)
+
+/* The powerpc time base runs at a constant rate */
+static int
+cpu_clock_invariant()
+{
+    return 1;
+}
+
+#define measure_cpu_time_ordered measure_cpu_time
+
+#elif defined(_WIN32)
+
+static int
+cpu_clock_invariant()
+{
+    return 0;
+}
+
+#endif
+
+
 /* The _WIN32 check is needed for msys (and maybe cygwin?) */
-#if defined(__GNUC__) && !defined(_WIN32)
+#if defined(__GNUC__) && !defined(_WIN32) && defined(HAVE_CLOCK_GETTIME) && \
+    (defined(CLOCK_MONOTONIC_RAW) || defined(CLOCK_MONOTONIC))
+
+/* The frequency is calibrated against a monotonic clock that isn't
+   adjusted by NTP, over a short interval.  Both ends of the interval
+   are read with the counter on either side of the clock, so how
+   precisely the counter and clock were read together is known. */
+#ifdef CLOCK_MONOTONIC_RAW
+#define CPU_CALIBRATION_CLOCK CLOCK_MONOTONIC_RAW
+#else
+#define CPU_CALIBRATION_CLOCK CLOCK_MONOTONIC
+#endif
+
+#define CPU_CALIBRATION_NSEC 20000000
+#define CPU_CALIBRATION_TRIES 8
+
+/* Reads the counter and the clock together.  Returns the counter
+   at the time the clock was read and sets uncertainty to how far
+   that may be out, in cycles. */
+static prof_measure_t
+cpu_clock_pair(double *nsec, prof_measure_t *uncertainty)
+{
+    prof_measure_t result = 0;
+    int i;
+
+    for (i = 0; i < CPU_CALIBRATION_TRIES; i++)
+    {
+        struct timespec ts;
+        prof_measure_t before = measure_cpu_time_ordered();
+        clock_gettime(CPU_CALIBRATION_CLOCK, &ts);
+        prof_measure_t after = measure_cpu_time_ordered();
+
+        /* Keep the read that took the least time */
+        if (i == 0 || (after - before) / 2 < *uncertainty)
+        {
+            result = before + (after - before) / 2;
+            *uncertainty = (after - before) / 2;
+            *nsec = ts.tv_sec * 1e9 + ts.tv_nsec;
+        }
+    }
+    return result;
+}
+
+unsigned long long get_cpu_frequency()
+{
+    struct timespec ts, resolution;
+    prof_measure_t start, end, start_uncertainty, end_uncertainty;
+    double start_nsec, end_nsec, cycles, elapsed;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = CPU_CALIBRATION_NSEC;
+
+    start = cpu_clock_pair(&start_nsec, &start_uncertainty);
+    nanosleep(&ts, NULL);
+    end = cpu_clock_pair(&end_nsec, &end_uncertainty);
+
+    cycles = (double) (end - start);
+    elapsed = end_nsec - start_nsec;
+
+    /* The error from reading the counter at each end, plus
+       the clock's resolution at each end. */
+    if (clock_getres(CPU_CALIBRATION_CLOCK, &resolution) != 0)
+    {
+        resolution.tv_sec = 0;
+        resolution.tv_nsec = 1;
+    }
+    cpu_frequency_error = (start_uncertainty + end_uncertainty) / cycles +
+                          2 * (resolution.tv_sec * 1e9 + resolution.tv_nsec) / elapsed;
+
+    return (unsigned long long) (cycles * 1e9 / elapsed + 0.5);
+}
+
+#elif defined(__GNUC__) && !defined(_WIN32)
 
 unsigned long long get_cpu_frequency()
 {
@@ -86,6 +260,7 @@ unsigned long long get_cpu_frequency()
     x = measure_cpu_time();
     nanosleep(&ts, NULL);
     y = measure_cpu_time();
+    cpu_frequency_error = -1;
     return (y - x) * 2;
 }
 
@@ -101,6 +276,7 @@ unsigned long long get_cpu_frequency()
     Sleep(500);
     y = measure_cpu_time();
     frequency = 2*(y-x);
+    cpu_frequency_error = -1;
     return frequency;
 }
 #endif
@@ -127,10 +303,13 @@ prof_measure_cpu_time(VALUE self)
      cpu_frequency -> int
 
 Returns the cpu's frequency.  This value is needed when 
-RubyProf::measure_mode is set to CPU_TIME. */
+RubyProf::measure_mode is set to CPU_TIME.  It is measured
+the first time it is needed unless it has been set. */
 static VALUE
 prof_get_cpu_frequency(VALUE self)
 {
+    if (cpu_frequency == 0)
+        cpu_frequency = get_cpu_frequency();
     return ULL2NUM(cpu_frequency);
 }
 
@@ -144,7 +323,35 @@ static VALUE
 prof_set_cpu_frequency(VALUE self, VALUE val)
 {
     cpu_frequency = NUM2LL(val);
+    cpu_frequency_error = -1;
     return val;
 }
 
+/* Document-method: prof_get_cpu_frequency_error
+   call-seq:
+     cpu_frequency_error -> float
+
+Returns the estimated relative error of the measured cpu frequency,
+or nil if it isn't known, for example because cpu_frequency was set. */
+static VALUE
+prof_get_cpu_frequency_error(VALUE self)
+{
+    if (cpu_frequency == 0)
+        cpu_frequency = get_cpu_frequency();
+    return cpu_frequency_error < 0 ? Qnil : rb_float_new(cpu_frequency_error);
+}
+
+/* Document-method: prof_get_cpu_clock_invariant
+   call-seq:
+     cpu_clock_invariant? -> boolean
+
+Returns whether the cpu's clock counter is known to tick at a constant
+rate regardless of frequency scaling and sleep states.  If it isn't,
+CPU_TIME measurements are unreliable. */
+static VALUE
+prof_get_cpu_clock_invariant(VALUE self)
+{
+    return cpu_clock_invariant() ? Qtrue : Qfalse;
+}
+
 #endif
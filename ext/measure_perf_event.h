@@ -0,0 +1,372 @@
+/* :nodoc: 
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* Measure modes that count events with Linux's perf_event_open.
+   Software events (task clock, page faults and context switches)
+   are usually available to unprivileged processes, hardware events
+   (instructions, cycles, cache misses and branch misses) need a pmu
+   that isn't hidden by a virtual machine and a permissive
+   perf_event_paranoid setting.
+
+   Counters count the thread that opened them, so each native thread
+   opens its own counter before the event hook first measures it.  When
+   the kernel allows it, counters are read without a system call using
+   rdpmc and the counter's mmap'd page.  Every counter is closed when
+   profiling stops, so threads that have exited don't keep theirs.
+
+   When there are more hardware events than the pmu has counters the
+   kernel multiplexes them, and each counts only part of the time.
+   Such counts are scaled by the time the counter was enabled over the
+   time it actually ran, so they are estimates. */
+
+#if defined(__linux__) && defined(HAVE_LINUX_PERF_EVENT_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_TLS)
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__NR_perf_event_open)
+#define MEASURE_PERF_EVENTS
+
+#define MEASURE_TASK_CLOCK 9
+#define MEASURE_PAGE_FAULTS 10
+#define MEASURE_CONTEXT_SWITCHES 11
+#define MEASURE_INSTRUCTIONS 12
+#define MEASURE_CPU_CYCLES 13
+#define MEASURE_CACHE_MISSES 14
+#define MEASURE_BRANCH_MISSES 15
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    defined(HAVE_PERF_CAP_USER_RDPMC)
+#define PERF_RDPMC
+#endif
+
+typedef struct perf_counter_t {
+    int fd;
+    struct perf_event_mmap_page *page;  /* NULL if it couldn't be mapped */
+    long long last;                     /* The last count read */
+    struct perf_counter_t *next;
+} perf_counter_t;
+
+/* The event counted by each mode, starting at MEASURE_TASK_CLOCK */
+static const struct {
+    unsigned int type;
+    unsigned long long config;
+} perf_events[] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+#define PERF_MODE(mode) ((mode) >= MEASURE_TASK_CLOCK && (mode) <= MEASURE_BRANCH_MISSES)
+
+static int perf_mode = -1;                  /* The mode being counted, or -1 */
+static perf_counter_t *perf_counters = NULL; /* Every thread's counter */
+static unsigned long perf_generation = 1;   /* Incremented when counters are closed */
+static unsigned long perf_open_failures = 0; /* Threads that couldn't open a counter */
+static int perf_open_errno = 0;
+static unsigned long perf_read_failures = 0; /* Reads that failed */
+static int perf_read_errno = 0;
+
+/* The current thread's counter, valid if perf_thread_generation
+   matches perf_generation.  NULL if the thread couldn't open one. */
+static __thread perf_counter_t *perf_thread_counter = NULL;
+static __thread unsigned long perf_thread_generation = 0;
+
+/* Opens a counter for the current thread.  Returns NULL and
+   sets errno if the event can't be counted. */
+static perf_counter_t *
+perf_counter_open(int mode)
+{
+    struct perf_event_attr attr;
+    perf_counter_t *counter;
+    void *page;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[mode - MEASURE_TASK_CLOCK].type;
+    attr.config = perf_events[mode - MEASURE_TASK_CLOCK].config;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+    /* Unprivileged processes may only count user space */
+    if (fd < 0 && (errno == EACCES || errno == EPERM))
+    {
+        attr.exclude_kernel = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fd < 0)
+        return NULL;
+
+    page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+
+    counter = ALLOC(perf_counter_t);
+    counter->fd = fd;
+    counter->page = (page == MAP_FAILED) ? NULL : (struct perf_event_mmap_page *) page;
+    counter->last = 0;
+    counter->next = NULL;
+    return counter;
+}
+
+static void
+perf_counter_close(perf_counter_t *counter)
+{
+    if (counter->page)
+        munmap(counter->page, sysconf(_SC_PAGESIZE));
+    close(counter->fd);
+    xfree(counter);
+}
+
+static void
+perf_counter_add(perf_counter_t *counter)
+{
+    counter->next = perf_counters;
+    perf_counters = counter;
+    perf_thread_counter = counter;
+    perf_thread_generation = perf_generation;
+}
+
+/* Closes every thread's counter.  Threads open a new one the next
+   time they take a measurement. */
+static void
+perf_release_counters()
+{
+    perf_counter_t *counter = perf_counters;
+    while (counter)
+    {
+        perf_counter_t *next = counter->next;
+        perf_counter_close(counter);
+        counter = next;
+    }
+    perf_counters = NULL;
+    perf_open_failures = 0;
+    perf_read_failures = 0;
+    perf_generation++;
+}
+
+/* Stops counting */
+static void
+perf_close_counters()
+{
+    perf_release_counters();
+    perf_mode = -1;
+}
+
+/* Called when profiling stops.  Warns if some threads measured
+   nothing because their counter couldn't be opened, or if counters
+   couldn't be read. */
+static void
+perf_stop()
+{
+    if (perf_open_failures > 0)
+        rb_warn("ruby-prof couldn't count perf events in %lu thread(s), which measured 0: %s",
+                perf_open_failures, strerror(perf_open_errno));
+    if (perf_read_failures > 0)
+        rb_warn("ruby-prof couldn't read perf event counters %lu time(s), the counts are too low: %s",
+                perf_read_failures, strerror(perf_read_errno));
+    perf_release_counters();
+}
+
+/* Starts counting mode's event, raising an error if it can't be
+   counted.  Any other counters are closed. */
+static void
+perf_select(int mode)
+{
+    perf_counter_t *counter = perf_counter_open(mode);
+
+    if (!counter)
+        rb_raise(rb_eRuntimeError, "can't count perf event: %s", strerror(errno));
+
+    perf_close_counters();
+    perf_mode = mode;
+    perf_counter_add(counter);
+}
+
+#if defined(PERF_RDPMC)
+static inline unsigned long long
+perf_rdpmc(unsigned int index)
+{
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (index));
+    return ((unsigned long long) hi << 32) | lo;
+}
+#endif
+
+/* Returns the counter's count.  Counts never go backwards: a failed
+   read, or a scaled estimate lower than the last, returns the last
+   count so the next interval isn't measured from a wrong start. */
+static inline long long
+perf_counter_read(perf_counter_t *counter)
+{
+    struct {
+        unsigned long long value;
+        unsigned long long enabled;
+        unsigned long long running;
+    } data;
+    long long count = 0;
+
+#if defined(PERF_RDPMC)
+    struct perf_event_mmap_page *page = counter->page;
+
+    /* The kernel updates the page under a sequence lock.  Hardware
+       counters on the current cpu have a non zero index and can be
+       read directly, unless they've been multiplexed and need scaling.
+       Software counters always need a read. */
+    if (page)
+    {
+        unsigned int seq, index;
+        unsigned long long enabled, running;
+        do
+        {
+            seq = page->lock;
+            __asm__ __volatile__ ("" ::: "memory");
+            index = page->index;
+            count = page->offset;
+            enabled = page->time_enabled;
+            running = page->time_running;
+            if (page->cap_user_rdpmc && index)
+            {
+                unsigned int shift = 64 - page->pmc_width;
+                long long pmc = (long long) perf_rdpmc(index - 1);
+                count += (pmc << shift) >> shift;
+            }
+            __asm__ __volatile__ ("" ::: "memory");
+        } while (page->lock != seq);
+
+        if (page->cap_user_rdpmc && index && enabled == running)
+        {
+            if (count > counter->last)
+                counter->last = count;
+            return counter->last;
+        }
+    }
+#endif
+
+    if (read(counter->fd, &data, sizeof(data)) != sizeof(data))
+    {
+        perf_read_failures++;
+        perf_read_errno = errno;
+        return counter->last;
+    }
+
+    /* A counter that hasn't run yet has nothing to scale */
+    if (data.running == 0)
+        return counter->last;
+    count = (long long) data.value;
+    if (data.running < data.enabled)
+        count = (long long) ((double) data.value * data.enabled / data.running);
+
+    if (count > counter->last)
+        counter->last = count;
+    return counter->last;
+}
+
+/* Opens the current thread's counter if it hasn't one yet.  The event
+   hook calls this before it takes any measurements, so the system
+   calls aren't charged to the method that is running.  Errors can't
+   be raised from the event hook, so a thread whose counter can't be
+   opened measures nothing, and perf_stop warns about it. */
+static inline void
+perf_thread_open()
+{
+    perf_counter_t *counter;
+
+    if (perf_mode < 0 || perf_thread_generation == perf_generation)
+        return;
+
+    counter = perf_counter_open(perf_mode);
+    if (!counter)
+    {
+        perf_open_failures++;
+        perf_open_errno = errno;
+        perf_thread_counter = NULL;
+        perf_thread_generation = perf_generation;
+        return;
+    }
+    perf_counter_add(counter);
+}
+
+static prof_measure_t
+measure_perf_event()
+{
+    /* Measurements taken outside the event hook */
+    if (perf_thread_generation != perf_generation)
+        perf_thread_open();
+
+    if (perf_thread_generation != perf_generation || !perf_thread_counter)
+        return 0;
+    return perf_counter_read(perf_thread_counter);
+}
+
+static double
+convert_perf_count(prof_measure_t c)
+{
+    return (double) c;
+}
+
+/* The task clock counts nanoseconds */
+static double
+convert_perf_time(prof_measure_t c)
+{
+    return (double) c / 1000000000;
+}
+
+/* Document-method: prof_perf_event_supported
+   call-seq:
+     perf_event_supported?(mode) -> boolean
+
+Returns whether the events counted by a perf event measure mode,
+such as RubyProf::INSTRUCTIONS, can be counted.  Hardware events
+usually can't be counted in virtual machines or when
+/proc/sys/kernel/perf_event_paranoid forbids it.*/
+static VALUE
+prof_perf_event_supported(VALUE self, VALUE val)
+{
+    int mode = NUM2INT(val);
+    perf_counter_t *counter;
+
+    if (!PERF_MODE(mode))
+        rb_raise(rb_eArgError, "not a perf event mode: %d", mode);
+
+    counter = perf_counter_open(mode);
+    if (!counter)
+        return Qfalse;
+    perf_counter_close(counter);
+    return Qtrue;
+}
+
+#endif
+#endif
@@ -0,0 +1,140 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* A simple arena allocator.  Memory is handed out from large
+   chunks by bumping a pointer and is only released all at
+   once, when the arena is freed.  A profile allocates its
+   threads, methods and call infos this way - they live exactly
+   as long as the profile's result, so there is no point in
+   tracking and freeing them one by one. */
+
+#include <ruby.h>
+
+#define PROF_ARENA_CHUNK_SIZE (64 * 1024)
+#define PROF_ARENA_ALIGN 8
+
+typedef struct prof_arena_chunk_t {
+    struct prof_arena_chunk_t *next;
+    size_t size;                /* Usable bytes, which follow the header */
+    size_t used;
+    double align;               /* Pads the header so the usable bytes are aligned */
+} prof_arena_chunk_t;
+
+typedef struct {
+    prof_arena_chunk_t *chunks; /* The chunk being allocated from is first */
+    size_t chunk_count;
+    size_t reserved;            /* Bytes allocated for chunks */
+    size_t used;                /* Bytes handed out */
+    size_t allocations;         /* Number of allocations */
+} prof_arena_t;
+
+static prof_arena_t *
+prof_arena_create()
+{
+    prof_arena_t *arena = ALLOC(prof_arena_t);
+    arena->chunks = NULL;
+    arena->chunk_count = 0;
+    arena->reserved = 0;
+    arena->used = 0;
+    arena->allocations = 0;
+    return arena;
+}
+
+static void
+prof_arena_free(prof_arena_t *arena)
+{
+    prof_arena_chunk_t *chunk = arena->chunks;
+    while (chunk)
+    {
+        prof_arena_chunk_t *next = chunk->next;
+        xfree(chunk);
+        chunk = next;
+    }
+    xfree(arena);
+}
+
+static prof_arena_chunk_t *
+prof_arena_add_chunk(prof_arena_t *arena, size_t size)
+{
+    prof_arena_chunk_t *chunk;
+
+    if (size < PROF_ARENA_CHUNK_SIZE)
+        size = PROF_ARENA_CHUNK_SIZE;
+
+    chunk = (prof_arena_chunk_t *) xmalloc(sizeof(prof_arena_chunk_t) + size);
+    chunk->size = size;
+    chunk->used = 0;
+
+    /* Oversized requests get a chunk of their own - put it behind
+       the current chunk so that it keeps being used. */
+    if (arena->chunks && size > PROF_ARENA_CHUNK_SIZE)
+    {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    }
+    else
+    {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    arena->chunk_count++;
+    arena->reserved += size;
+    return chunk;
+}
+
+static inline void *
+prof_arena_alloc(prof_arena_t *arena, size_t size)
+{
+    prof_arena_chunk_t *chunk = arena->chunks;
+    void *result;
+
+    size = (size + PROF_ARENA_ALIGN - 1) & ~((size_t) PROF_ARENA_ALIGN - 1);
+
+    if (!chunk || chunk->size - chunk->used < size)
+        chunk = prof_arena_add_chunk(arena, size);
+
+    result = (char *) (chunk + 1) + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    arena->allocations++;
+    return result;
+}
+
+#define PROF_ARENA_ALLOC(arena, type) ((type *) prof_arena_alloc((arena), sizeof(type)))
+#define PROF_ARENA_ALLOC_N(arena, type, n) ((type *) prof_arena_alloc((arena), sizeof(type) * (n)))
+
+/* Returns a hash describing the memory used by the arena. */
+static VALUE
+prof_arena_stats(prof_arena_t *arena)
+{
+    VALUE result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("chunks")), ULONG2NUM(arena->chunk_count));
+    rb_hash_aset(result, ID2SYM(rb_intern("reserved")), ULONG2NUM(arena->reserved));
+    rb_hash_aset(result, ID2SYM(rb_intern("used")), ULONG2NUM(arena->used));
+    rb_hash_aset(result, ID2SYM(rb_intern("allocations")), ULONG2NUM(arena->allocations));
+    return result;
+}
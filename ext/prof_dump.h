@@ -0,0 +1,239 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* The file format written by RubyProf::Result#dump and read back by
+   RubyProf::Result.load.  A file is laid out as:
+
+     header
+     string table    - names and source files, each terminated by a NUL
+     method table    - a prof_dump_method_t per method, indexed by the
+                       method's number in the registry
+     threads         - for each thread, a prof_dump_thread_t followed by
+                       its methods (prof_dump_record_t) and the calls
+                       between them (prof_dump_call_t)
+
+   All counters are fixed width and are written in the byte order of
+   the machine that wrote the file, which is recorded in the header so
+   that a file from a different machine is rejected instead of being
+   misread.  The loader maps the file into memory (reads it where mmap
+   isn't available) and parses it in one pass, copying the method and
+   call records into the result's arena.  Only the names and source
+   files are used in place from the mapping.
+
+   Times are kept in the units they were measured in, along with the
+   factor that converts them for each measure mode.  The format's
+   version is bumped whenever the layout changes. */
+
+#include <ruby.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define PROF_DUMP_MAGIC "RUBYPROF"
+#define PROF_DUMP_VERSION 1
+#define PROF_DUMP_BYTE_ORDER 0x01020304
+
+/* Offset of a missing string, such as a c function's source file */
+#define PROF_DUMP_NONE (~(unsigned LONG_LONG) 0)
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int byte_order;
+    unsigned int measurement_count;
+    unsigned int method_count;
+    unsigned int thread_count;
+    unsigned int reserved;
+    int modes[PROF_MAX_MEASUREMENTS];
+    double scales[PROF_MAX_MEASUREMENTS];  /* Converts each measurement */
+    double event_overhead;
+    unsigned LONG_LONG strings_offset;
+    unsigned LONG_LONG strings_size;
+    unsigned LONG_LONG methods_offset;
+    unsigned LONG_LONG threads_offset;
+} prof_dump_header_t;
+
+/* What the registry knows about a method.  Names are offsets into
+   the string table. */
+typedef struct {
+    unsigned LONG_LONG klass_name;
+    unsigned LONG_LONG method_name;
+    unsigned LONG_LONG source_file;
+    LONG_LONG line;
+} prof_dump_method_t;
+
+typedef struct {
+    unsigned LONG_LONG thread_id;
+    unsigned LONG_LONG method_count;
+    unsigned LONG_LONG call_count;
+} prof_dump_thread_t;
+
+/* Total, self and wait time for one measurement */
+typedef unsigned LONG_LONG prof_dump_times_t[3];
+
+/* A thread's record of a method */
+typedef struct {
+    unsigned int id;            /* The method's number */
+    int depth;
+    unsigned LONG_LONG called;
+    unsigned LONG_LONG base;    /* Index of the base method in the thread */
+    unsigned LONG_LONG total_overhead;
+    unsigned LONG_LONG self_overhead;
+    prof_dump_times_t times[PROF_MAX_MEASUREMENTS];
+} prof_dump_record_t;
+
+/* A call between two of a thread's methods */
+typedef struct {
+    unsigned LONG_LONG parent;  /* Indexes of the methods in the thread */
+    unsigned LONG_LONG child;
+    unsigned LONG_LONG called;
+    LONG_LONG line;
+    prof_dump_times_t times[PROF_MAX_MEASUREMENTS];
+} prof_dump_call_t;
+
+/* Maps the file at path into memory, raising a SystemCallError
+   if it can't be read. */
+static void *
+prof_dump_map(const char *path, size_t *size)
+{
+    struct stat st;
+    void *result;
+    int fd = open(path, O_RDONLY | O_BINARY);
+
+    if (fd < 0)
+      rb_sys_fail(path);
+
+    if (fstat(fd, &st) < 0)
+    {
+      close(fd);
+      rb_sys_fail(path);
+    }
+    *size = (size_t) st.st_size;
+
+#ifdef HAVE_MMAP
+    result = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (result == MAP_FAILED)
+      rb_sys_fail(path);
+#else
+    result = xmalloc(*size ? *size : 1);
+    if (read(fd, result, *size) != (long) *size)
+    {
+      close(fd);
+      xfree(result);
+      rb_sys_fail(path);
+    }
+    close(fd);
+#endif
+    return result;
+}
+
+static void
+prof_dump_unmap(void *data, size_t size)
+{
+#ifdef HAVE_MMAP
+    if (data)
+      munmap(data, size);
+#else
+    xfree(data);
+#endif
+}
+
+/* Strings written to a dump, each stored once.  The table maps
+   each string to its offset. */
+typedef struct {
+    st_table *offsets;
+    char *data;
+    size_t size;
+    size_t capacity;
+} prof_dump_strings_t;
+
+static void
+prof_dump_strings_init(prof_dump_strings_t *strings)
+{
+    strings->offsets = st_init_strtable();
+    strings->capacity = 4096;
+    strings->data = ALLOC_N(char, strings->capacity);
+    strings->size = 0;
+}
+
+static int
+prof_dump_free_string(st_data_t key, st_data_t value, st_data_t dummy)
+{
+    xfree((char *) key);
+    return ST_CONTINUE;
+}
+
+static void
+prof_dump_strings_free(prof_dump_strings_t *strings)
+{
+    st_foreach(strings->offsets, prof_dump_free_string, 0);
+    st_free_table(strings->offsets);
+    xfree(strings->data);
+}
+
+static unsigned LONG_LONG
+prof_dump_string(prof_dump_strings_t *strings, const char *string)
+{
+    size_t length;
+    st_data_t offset;
+    char *copy;
+
+    if (!string)
+      return PROF_DUMP_NONE;
+
+    if (st_lookup(strings->offsets, (st_data_t) string, &offset))
+      return offset;
+
+    length = strlen(string) + 1;
+    while (strings->size + length > strings->capacity)
+    {
+      strings->capacity *= 2;
+      REALLOC_N(strings->data, char, strings->capacity);
+    }
+
+    offset = strings->size;
+    memcpy(strings->data + offset, string, length);
+    strings->size += length;
+
+    /* The table keeps its own copy of the key */
+    copy = ALLOC_N(char, length);
+    memcpy(copy, string, length);
+    st_insert(strings->offsets, (st_data_t) copy, offset);
+    return offset;
+}
@@ -0,0 +1,411 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* Filters that restrict profiling to some classes and threads.
+   The rules are given as arrays of classes, modules and regular
+   expressions that are matched against class names.  Evaluating
+   them is much too slow to do for every event, so decisions are
+   kept in a cache keyed on class.  When profiling starts the classes
+   and modules named in the rules are decided.  Other classes only
+   match regular expressions, and are decided by the event hook the
+   first time it sees them.  The cache marks its classes, so a class
+   can't be freed and its address reused by another while profiling.
+
+   Methods of excluded classes are skipped by the event hook, so
+   the time spent in them is counted as their caller's self time
+   and methods they call are attached to their caller.
+
+   Evaluating a rule runs ruby code - a class's name may come from
+   inspect and regular expressions are matched with Regexp#=~ - and
+   that code fires events of its own.  The event hook ignores events
+   while filter_evaluating is set, so they don't show up in the
+   profile.  The code may raise too, and an error can't escape the
+   event hook, so a class whose rules raise is excluded. */
+
+#include <ruby.h>
+
+#ifndef RARRAY_LEN
+#define RARRAY_LEN(a) (RARRAY(a)->len)
+#endif
+
+/* Values stored in the decision cache */
+#define FILTER_INCLUDE 1
+#define FILTER_EXCLUDE 2
+
+static VALUE include_classes = Qnil;
+static VALUE exclude_classes = Qnil;
+static VALUE include_threads = Qnil;
+static VALUE exclude_threads = Qnil;
+
+static st_table *filter_cache = NULL;  /* Decisions keyed on class */
+static VALUE filter_cache_marker = Qnil; /* Marks the cache's classes */
+static VALUE filter_last_klass = Qundef;
+static int filter_last_result = 1;
+static int filter_evaluating = 0;
+
+/* Class methods are filtered like the methods of their class. */
+static VALUE
+filter_klass(VALUE klass)
+{
+    if (klass != 0 && !SPECIAL_CONST_P(klass) &&
+        BUILTIN_TYPE(klass) == T_CLASS && FL_TEST(klass, FL_SINGLETON))
+    {
+        VALUE attached = rb_iv_get(klass, "__attached__");
+        if (!SPECIAL_CONST_P(attached) &&
+            (BUILTIN_TYPE(attached) == T_CLASS || BUILTIN_TYPE(attached) == T_MODULE))
+            return attached;
+    }
+    return klass;
+}
+
+static int
+filter_match(VALUE rules, VALUE klass, VALUE name)
+{
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(rules); i++)
+    {
+        VALUE rule = rb_ary_entry(rules, i);
+
+        if (TYPE(rule) == T_REGEXP)
+        {
+            if (rb_reg_match(rule, name) != Qnil)
+                return 1;
+        }
+        else if (rule == klass)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static VALUE
+filter_evaluate_rules(VALUE klass)
+{
+    VALUE name;
+
+    klass = filter_klass(klass);
+    name = klass_name(klass);
+
+    if (!NIL_P(include_classes) && !filter_match(include_classes, klass, name))
+        return Qfalse;
+    if (!NIL_P(exclude_classes) && filter_match(exclude_classes, klass, name))
+        return Qfalse;
+    return Qtrue;
+}
+
+static VALUE
+filter_evaluate_done(VALUE ignored)
+{
+    filter_evaluating = 0;
+    return Qnil;
+}
+
+static int
+filter_evaluate(VALUE klass)
+{
+    filter_evaluating = 1;
+    return RTEST(rb_ensure(filter_evaluate_rules, klass, filter_evaluate_done, Qnil));
+}
+
+/* Evaluates the rules from the event hook, excluding the class if
+   they raise. */
+static int
+filter_evaluate_protected(VALUE klass)
+{
+    int state = 0;
+    VALUE result;
+
+    filter_evaluating = 1;
+    result = rb_protect(filter_evaluate_rules, klass, &state);
+    filter_evaluating = 0;
+    if (state)
+    {
+#ifdef RUBY_VM
+        rb_set_errinfo(Qnil);
+#else
+        ruby_errinfo = Qnil;
+#endif
+        return 0;
+    }
+    return RTEST(result);
+}
+
+/* Should methods of this class be profiled?  */
+static inline int
+filter_include_klass(VALUE klass)
+{
+    st_data_t decision;
+
+    if (!filter_cache)
+        return 1;
+
+    if (klass != 0)
+        klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
+
+    /* Consecutive events are often for the same class */
+    if (klass == filter_last_klass)
+        return filter_last_result;
+
+    if (!st_lookup(filter_cache, (st_data_t) klass, &decision))
+    {
+        decision = filter_evaluate_protected(klass) ? FILTER_INCLUDE : FILTER_EXCLUDE;
+        st_insert(filter_cache, (st_data_t) klass, decision);
+    }
+
+    filter_last_klass = klass;
+    filter_last_result = (decision == FILTER_INCLUDE);
+    return filter_last_result;
+}
+
+/* Should this thread be profiled?  Only called once per thread. */
+static int
+filter_include_thread(unsigned long thread_id)
+{
+    long i;
+
+    if (!NIL_P(include_threads))
+    {
+        for (i = 0; i < RARRAY_LEN(include_threads); i++)
+        {
+            if ((unsigned long) get_thread_id(rb_ary_entry(include_threads, i)) == thread_id)
+                break;
+        }
+        if (i == RARRAY_LEN(include_threads))
+            return 0;
+    }
+
+    if (!NIL_P(exclude_threads))
+    {
+        for (i = 0; i < RARRAY_LEN(exclude_threads); i++)
+        {
+            if ((unsigned long) get_thread_id(rb_ary_entry(exclude_threads, i)) == thread_id)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+filter_mark_klass(st_data_t key, st_data_t value, st_data_t dummy)
+{
+    rb_gc_mark((VALUE) key);
+    return ST_CONTINUE;
+}
+
+static void
+filter_cache_mark(void *data)
+{
+    if (filter_cache)
+        st_foreach(filter_cache, filter_mark_klass, 0);
+}
+
+static void
+filter_free()
+{
+    if (filter_cache)
+        st_free_table(filter_cache);
+    filter_cache = NULL;
+    filter_cache_marker = Qnil;
+    filter_last_klass = Qundef;
+}
+
+/* Decides the classes and modules named in rules */
+static void
+filter_compile_rules(VALUE rules)
+{
+    long i;
+
+    if (NIL_P(rules))
+        return;
+
+    for (i = 0; i < RARRAY_LEN(rules); i++)
+    {
+        VALUE rule = rb_ary_entry(rules, i);
+
+        if (TYPE(rule) != T_REGEXP)
+            st_insert(filter_cache, (st_data_t) rule,
+                      filter_evaluate(rule) ? FILTER_INCLUDE : FILTER_EXCLUDE);
+    }
+}
+
+/* Creates the decision cache if there are class rules, and decides
+   the classes they name.  Called before profiling starts, so errors
+   are raised as usual. */
+static void
+filter_compile()
+{
+    filter_free();
+    if (NIL_P(include_classes) && NIL_P(exclude_classes))
+        return;
+
+    filter_cache = st_init_numtable();
+    filter_cache_marker = Data_Wrap_Struct(0, filter_cache_mark, 0, filter_cache);
+    filter_compile_rules(include_classes);
+    filter_compile_rules(exclude_classes);
+}
+
+/* Checks and copies the rules given to one of the setters below. */
+static VALUE
+filter_rules(VALUE val, VALUE type)
+{
+    VALUE rules;
+    long i;
+
+    if (threads_tbl)
+    {
+        rb_raise(rb_eRuntimeError, "can't change filters while profiling");
+    }
+
+    if (NIL_P(val))
+        return Qnil;
+
+    rules = rb_Array(val);
+    for (i = 0; i < RARRAY_LEN(rules); i++)
+    {
+        VALUE rule = rb_ary_entry(rules, i);
+
+        if (type == rb_cThread)
+        {
+            if (!rb_obj_is_kind_of(rule, rb_cThread))
+                rb_raise(rb_eTypeError, "expected a Thread, got %s", rb_obj_classname(rule));
+        }
+        else if (TYPE(rule) != T_REGEXP && TYPE(rule) != T_CLASS && TYPE(rule) != T_MODULE)
+        {
+            rb_raise(rb_eTypeError, "expected a Class, Module or Regexp, got %s", rb_obj_classname(rule));
+        }
+    }
+
+    if (RARRAY_LEN(rules) == 0)
+        return Qnil;
+
+    rules = rb_ary_dup(rules);
+    OBJ_FREEZE(rules);
+    return rules;
+}
+
+static VALUE
+filter_get(VALUE rules)
+{
+    return NIL_P(rules) ? rb_ary_new() : rb_ary_dup(rules);
+}
+
+/* call-seq:
+   include_classes -> array
+
+Returns the classes, modules and regular expressions that
+methods must match to be profiled. */
+static VALUE
+prof_get_include_classes(VALUE self)
+{
+    return filter_get(include_classes);
+}
+
+/* call-seq:
+   include_classes=rules -> void
+
+Only profiles the methods of the given classes and modules, and of
+classes whose names match the given regular expressions.  The methods
+of other classes are not recorded - their time is counted as the self
+time of their caller, and the methods they call appear as children of
+their caller.  Class methods are filtered with their class.
+
+  RubyProf.include_classes = [MyApp, /^MyApp::/] */
+static VALUE
+prof_set_include_classes(VALUE self, VALUE val)
+{
+    include_classes = filter_rules(val, rb_cModule);
+    return val;
+}
+
+/* call-seq:
+   exclude_classes -> array
+
+Returns the classes, modules and regular expressions whose methods
+are not profiled. */
+static VALUE
+prof_get_exclude_classes(VALUE self)
+{
+    return filter_get(exclude_classes);
+}
+
+/* call-seq:
+   exclude_classes=rules -> void
+
+Does not profile the methods of the given classes and modules, or of
+classes whose names match the given regular expressions.  Exclusions
+take precedence over include_classes.
+
+  RubyProf.exclude_classes = [Kernel, Integer, /^ActiveSupport::/] */
+static VALUE
+prof_set_exclude_classes(VALUE self, VALUE val)
+{
+    exclude_classes = filter_rules(val, rb_cModule);
+    return val;
+}
+
+/* call-seq:
+   include_threads -> array
+
+Returns the threads that are profiled, or an empty array if all threads are. */
+static VALUE
+prof_get_include_threads(VALUE self)
+{
+    return filter_get(include_threads);
+}
+
+/* call-seq:
+   include_threads=threads -> void
+
+Only profiles the given threads. */
+static VALUE
+prof_set_include_threads(VALUE self, VALUE val)
+{
+    include_threads = filter_rules(val, rb_cThread);
+    return val;
+}
+
+/* call-seq:
+   exclude_threads -> array
+
+Returns the threads that are not profiled. */
+static VALUE
+prof_get_exclude_threads(VALUE self)
+{
+    return filter_get(exclude_threads);
+}
+
+/* call-seq:
+   exclude_threads=threads -> void
+
+Does not profile the given threads.  They don't appear in the result. */
+static VALUE
+prof_set_exclude_threads(VALUE self, VALUE val)
+{
+    exclude_threads = filter_rules(val, rb_cThread);
+    return val;
+}
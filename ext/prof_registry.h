@@ -0,0 +1,236 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* The methods seen while profiling, numbered in the order they are
+   first seen.  Every thread keeps its methods in an array indexed by
+   the method's number, so once the registry has interned a class and
+   method id, finding a thread's method is an array index.
+
+   The registry also holds what is known about each method - its class,
+   id, source file and line - so threads only keep their counters.  It
+   is shared by all threads and is only changed by the event hook, which
+   holds the interpreter lock.  The result takes it over when profiling
+   stops. */
+
+#include <ruby.h>
+
+#define PROF_REGISTRY_INITIAL_SIZE 64
+
+typedef struct {
+    VALUE klass;
+    ID mid;
+    const char *source_file;    /* NULL for c functions */
+    int line;
+    VALUE klass_name;           /* Frozen names, built the first time a result */
+    VALUE method_names;         /* is asked for them.  The method and full names */
+    VALUE full_names;           /* are arrays indexed by recursion depth. */
+    const char *klass_text;     /* The names of a method loaded from a file, */
+    const char *method_text;    /* which has no class or id, otherwise NULL */
+} prof_registry_entry_t;
+
+typedef struct {
+    unsigned int *slots;        /* Open addressing, the method's number + 1, or 0 if empty */
+    unsigned long mask;         /* Number of slots - 1, a power of two */
+    prof_registry_entry_t *entries; /* Indexed by method number */
+    unsigned int count;
+    unsigned int capacity;      /* Size of entries */
+} prof_registry_t;
+
+static prof_registry_t *
+prof_registry_create()
+{
+    prof_registry_t *registry = ALLOC(prof_registry_t);
+    registry->slots = ALLOC_N(unsigned int, PROF_REGISTRY_INITIAL_SIZE * 2);
+    MEMZERO(registry->slots, unsigned int, PROF_REGISTRY_INITIAL_SIZE * 2);
+    registry->mask = PROF_REGISTRY_INITIAL_SIZE * 2 - 1;
+    registry->entries = ALLOC_N(prof_registry_entry_t, PROF_REGISTRY_INITIAL_SIZE);
+    registry->count = 0;
+    registry->capacity = PROF_REGISTRY_INITIAL_SIZE;
+    return registry;
+}
+
+/* Returns a copy of the registry, in which every method has
+   the same number. */
+static prof_registry_t *
+prof_registry_copy(prof_registry_t *registry)
+{
+    prof_registry_t *result = ALLOC(prof_registry_t);
+    *result = *registry;
+    result->slots = ALLOC_N(unsigned int, registry->mask + 1);
+    MEMCPY(result->slots, registry->slots, unsigned int, registry->mask + 1);
+    result->entries = ALLOC_N(prof_registry_entry_t, registry->capacity);
+    MEMCPY(result->entries, registry->entries, prof_registry_entry_t, registry->count);
+    return result;
+}
+
+static void
+prof_registry_free(prof_registry_t *registry)
+{
+    xfree(registry->slots);
+    xfree(registry->entries);
+    xfree(registry);
+}
+
+static inline unsigned long
+prof_registry_hash(VALUE klass, ID mid)
+{
+    /* See prof_table_hash */
+    unsigned long hash = (unsigned long) klass >> 3;
+    hash = hash * 31 + (unsigned long) mid;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bUL;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline unsigned int *
+prof_registry_probe(prof_registry_t *registry, VALUE klass, ID mid)
+{
+    unsigned long i = prof_registry_hash(klass, mid) & registry->mask;
+
+    while (registry->slots[i])
+    {
+        prof_registry_entry_t *entry = &registry->entries[registry->slots[i] - 1];
+        if (entry->klass == klass && entry->mid == mid)
+            break;
+        i = (i + 1) & registry->mask;
+    }
+    return &registry->slots[i];
+}
+
+static void
+prof_registry_grow(prof_registry_t *registry)
+{
+    unsigned long size = (registry->mask + 1) * 2;
+    unsigned int i;
+
+    xfree(registry->slots);
+    registry->slots = ALLOC_N(unsigned int, size);
+    MEMZERO(registry->slots, unsigned int, size);
+    registry->mask = size - 1;
+
+    for (i = 0; i < registry->count; i++)
+    {
+        prof_registry_entry_t *entry = &registry->entries[i];
+        *prof_registry_probe(registry, entry->klass, entry->mid) = i + 1;
+    }
+}
+
+/* Returns the number of a class's method, numbering it the first
+   time it is seen.  The source file and line of the first call are
+   kept as the method's. */
+static inline unsigned int
+prof_registry_intern(prof_registry_t *registry, VALUE klass, ID mid,
+                     const char *source_file, int line)
+{
+    unsigned int *slot = prof_registry_probe(registry, klass, mid);
+    unsigned int id;
+
+    if (*slot)
+        return *slot - 1;
+
+    if (registry->count == registry->capacity)
+    {
+        registry->capacity *= 2;
+        REALLOC_N(registry->entries, prof_registry_entry_t, registry->capacity);
+    }
+
+    id = registry->count++;
+    registry->entries[id].klass = klass;
+    registry->entries[id].mid = mid;
+    registry->entries[id].source_file = source_file;
+    registry->entries[id].line = line;
+    registry->entries[id].klass_name = Qnil;
+    registry->entries[id].method_names = Qnil;
+    registry->entries[id].full_names = Qnil;
+    registry->entries[id].klass_text = NULL;
+    registry->entries[id].method_text = NULL;
+    *slot = id + 1;
+
+    /* Keep the load factor under 1/2 so probe sequences stay short. */
+    if (registry->count * 2 > registry->mask + 1)
+        prof_registry_grow(registry);
+
+    return id;
+}
+
+/* Adds a method loaded from a file, which is only known by its names.
+   The names and source file must outlive the registry.  Loaded methods
+   aren't interned since there is no class or id to look them up by. */
+static unsigned int
+prof_registry_add(prof_registry_t *registry, const char *klass_text,
+                  const char *method_text, const char *source_file, int line)
+{
+    unsigned int id;
+
+    if (registry->count == registry->capacity)
+    {
+        registry->capacity *= 2;
+        REALLOC_N(registry->entries, prof_registry_entry_t, registry->capacity);
+    }
+
+    id = registry->count++;
+    registry->entries[id].klass = Qnil;
+    registry->entries[id].mid = 0;
+    registry->entries[id].source_file = source_file;
+    registry->entries[id].line = line;
+    registry->entries[id].klass_name = Qnil;
+    registry->entries[id].method_names = Qnil;
+    registry->entries[id].full_names = Qnil;
+    registry->entries[id].klass_text = klass_text;
+    registry->entries[id].method_text = method_text;
+    return id;
+}
+
+static inline prof_registry_entry_t *
+prof_registry_entry(prof_registry_t *registry, unsigned int id)
+{
+    return &registry->entries[id];
+}
+
+static void
+prof_registry_mark(prof_registry_t *registry)
+{
+    unsigned int i;
+
+    for (i = 0; i < registry->count; i++)
+    {
+        prof_registry_entry_t *entry = &registry->entries[i];
+        rb_gc_mark(entry->klass);
+        rb_gc_mark(entry->klass_name);
+        rb_gc_mark(entry->method_names);
+        rb_gc_mark(entry->full_names);
+    }
+}
+
+/* Bytes allocated for the registry */
+static size_t
+prof_registry_size(prof_registry_t *registry)
+{
+    return sizeof(prof_registry_t) +
+           (registry->mask + 1) * sizeof(unsigned int) +
+           registry->capacity * sizeof(prof_registry_entry_t);
+}
@@ -0,0 +1,308 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* A statistical sampler.  Instead of hooking every call and return,
+   a SIGPROF timer periodically interrupts the program and the signal
+   handler records the Ruby stack of the running thread.  The samples
+   are turned into the usual methods and call infos when profiling
+   stops (see sampler_aggregate in ruby_prof.c).
+
+   The signal handler can't allocate memory or call into Ruby, so
+   samples are written to buffers allocated when profiling starts.
+   The handler doesn't look inside the objects a frame refers to,
+   since the frame may be only partly built when the signal arrives.
+   It stores each frame's class as it finds it, and include classes
+   are resolved to their modules when the samples are replayed.  Until
+   then the buffers mark the sampled classes, so a class that is freed
+   between samples can't be replaced by another at the same address.
+   Consecutive samples usually share most of their stack, so a sample
+   only stores the frames that differ from the previous one, and a
+   sample with the same stack as the previous one is merged into it.
+   Samples that don't fit in the buffers are dropped.
+
+   Walking the stack relies on ruby 1.8's ruby_frame, so sampling is
+   not available on ruby 1.9. */
+
+#if defined(HAVE_ENV_H) && defined(HAVE_SETITIMER) && !defined(RUBY_VM)
+#define PROF_SAMPLING
+
+#include <signal.h>
+#include <sys/time.h>
+
+#define SAMPLER_DEFAULT_INTERVAL 1000       /* Microseconds */
+#define SAMPLER_MAX_DEPTH 1024
+#define SAMPLER_SAMPLE_BUFFER_SIZE (64 * 1024)
+#define SAMPLER_FRAME_BUFFER_SIZE (256 * 1024)
+
+typedef struct {
+    VALUE klass;                /* The frame's class, possibly an include class */
+    ID mid;
+    const char* source_file;    /* The frame's current file and line */
+    int line;
+} prof_sample_frame_t;
+
+typedef struct {
+    unsigned long thread_id;
+    prof_measure_t weight;      /* Measurement since the previous sample */
+    unsigned int shared;        /* Number of outermost frames shared with
+                                   the previous sample */
+    unsigned int depth;         /* Number of frames */
+    size_t start;               /* Index of the first frame that isn't shared */
+} prof_sample_t;
+
+typedef struct {
+    prof_sample_t *samples;
+    size_t sample_count;
+    prof_sample_frame_t *frames;
+    size_t frame_count;
+    unsigned long dropped;
+    prof_measure_t last_time;
+
+    /* The stack of the last recorded sample, outermost frame first */
+    prof_sample_frame_t stack[SAMPLER_MAX_DEPTH];
+    unsigned int stack_depth;
+    unsigned long stack_thread_id;
+
+    /* Scratch space for the signal handler */
+    struct FRAME *walk[SAMPLER_MAX_DEPTH];
+    prof_sample_frame_t walk_lines[SAMPLER_MAX_DEPTH];
+    prof_sample_frame_t current[SAMPLER_MAX_DEPTH];
+
+    struct sigaction old_action;
+    struct itimerval old_timer;
+} prof_sampler_t;
+
+static prof_sampler_t sampler;
+static VALUE sampler_marker = Qnil;   /* Marks the sampled classes */
+
+/* A frame that was still being pushed may hold a value that isn't an
+   object, so the classes are marked conservatively. */
+static void
+sampler_mark(void *data)
+{
+    size_t i;
+
+    if (!sampler.frames)
+        return;
+    for (i = 0; i < sampler.frame_count; i++)
+      rb_gc_mark_maybe(sampler.frames[i].klass);
+    for (i = 0; i < sampler.stack_depth; i++)
+      rb_gc_mark_maybe(sampler.stack[i].klass);
+}
+
+static void
+sampler_create_buffers()
+{
+    sampler.samples = ALLOC_N(prof_sample_t, SAMPLER_SAMPLE_BUFFER_SIZE);
+    sampler.sample_count = 0;
+    sampler.frames = ALLOC_N(prof_sample_frame_t, SAMPLER_FRAME_BUFFER_SIZE);
+    sampler.frame_count = 0;
+    sampler.dropped = 0;
+    sampler.stack_depth = 0;
+    sampler.stack_thread_id = 0;
+    sampler_marker = Data_Wrap_Struct(0, sampler_mark, 0, &sampler);
+}
+
+static void
+sampler_free_buffers()
+{
+    xfree(sampler.samples);
+    sampler.samples = NULL;
+    xfree(sampler.frames);
+    sampler.frames = NULL;
+    sampler_marker = Qnil;
+}
+
+/* The module of an include class, which is what the event hook sees */
+static inline VALUE
+sampler_klass(VALUE klass)
+{
+    if (klass != 0 && !SPECIAL_CONST_P(klass) && BUILTIN_TYPE(klass) == T_ICLASS)
+      return RBASIC(klass)->klass;
+    return klass;
+}
+
+static inline int
+sampler_frame_equal(const prof_sample_frame_t *a, const prof_sample_frame_t *b)
+{
+    return a->klass == b->klass && a->mid == b->mid &&
+           a->line == b->line && a->source_file == b->source_file;
+}
+
+/* Is this frame a copy of an outer frame?  Ruby runs a block
+   with a copy of the frame of the method that created it, but
+   the tracing hook doesn't see blocks so leave them out. */
+static inline int
+sampler_block_frame(struct FRAME *frame, unsigned int index, unsigned int count)
+{
+#ifdef HAVE_ST_UNIQ
+    unsigned int i;
+    for (i = index + 1; i < count; i++)
+    {
+      if (sampler.walk[i]->uniq == frame->uniq &&
+          sampler.walk[i]->last_func == frame->last_func)
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static void
+sampler_handler(int sig)
+{
+    struct FRAME *frame;
+    const char* source_file = ruby_sourcefile;
+    int line = ruby_sourceline;
+    unsigned int count = 0;
+    unsigned int depth = 0;
+    unsigned int shared = 0;
+    unsigned int i;
+    unsigned long thread_id;
+    prof_measure_t now = get_measurement();
+    prof_measure_t weight = now - sampler.last_time;
+    prof_sample_t *sample;
+
+    sampler.last_time = now;
+
+    /* Walk the stack, innermost frame first.  A frame's current
+       line is the line its callee was called from. */
+    for (frame = ruby_frame; frame && count < SAMPLER_MAX_DEPTH; frame = frame->prev)
+    {
+      sampler.walk[count] = frame;
+      sampler.walk_lines[count].source_file = source_file;
+      sampler.walk_lines[count].line = line;
+      count++;
+
+      if (frame->node)
+      {
+        source_file = frame->node->nd_file;
+        line = nd_line(frame->node);
+      }
+    }
+
+    /* Keep the frames of methods, outermost first.  The top level
+       frame is kept too, it is the root of the call graph just as
+       it is for the tracing hook.  RubyProf's own methods are left
+       out for the same reason the event hook skips them. */
+    for (i = count; i-- > 0;)
+    {
+      frame = sampler.walk[i];
+
+      if ((frame->last_func == 0 && frame->prev) || frame->self == mProf ||
+          sampler_block_frame(frame, i, count))
+        continue;
+
+      sampler.current[depth].klass = frame->last_class;
+      sampler.current[depth].mid = frame->last_func;
+      sampler.current[depth].source_file = sampler.walk_lines[i].source_file;
+      sampler.current[depth].line = sampler.walk_lines[i].line;
+      depth++;
+    }
+
+    thread_id = get_thread_id(rb_thread_current());
+    if (thread_id == sampler.stack_thread_id)
+    {
+      while (shared < depth && shared < sampler.stack_depth &&
+             sampler_frame_equal(&sampler.stack[shared], &sampler.current[shared]))
+        shared++;
+
+      /* Same stack as last time? */
+      if (shared == depth && depth == sampler.stack_depth && sampler.sample_count > 0)
+      {
+        sampler.samples[sampler.sample_count - 1].weight += weight;
+        return;
+      }
+    }
+
+    if (sampler.sample_count == SAMPLER_SAMPLE_BUFFER_SIZE ||
+        sampler.frame_count + (depth - shared) > SAMPLER_FRAME_BUFFER_SIZE)
+    {
+      sampler.dropped++;
+      return;
+    }
+
+    sample = &sampler.samples[sampler.sample_count++];
+    sample->thread_id = thread_id;
+    sample->weight = weight;
+    sample->shared = shared;
+    sample->depth = depth;
+    sample->start = sampler.frame_count;
+
+    for (i = shared; i < depth; i++)
+    {
+      sampler.stack[i] = sampler.current[i];
+      sampler.frames[sampler.frame_count++] = sampler.current[i];
+    }
+    sampler.stack_depth = depth;
+    sampler.stack_thread_id = thread_id;
+}
+
+/* Starts a timer that sends SIGPROF every interval microseconds of
+   cpu time used by the process. */
+static void
+sampler_start(long interval)
+{
+    struct sigaction action;
+    struct itimerval timer;
+
+    sampler.last_time = get_measurement();
+
+    MEMZERO(&action, struct sigaction, 1);
+    action.sa_handler = sampler_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, &sampler.old_action);
+
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, &sampler.old_timer);
+}
+
+static void
+sampler_stop()
+{
+    setitimer(ITIMER_PROF, &sampler.old_timer, NULL);
+    sigaction(SIGPROF, &sampler.old_action, NULL);
+}
+
+/* Holds off the signal handler while the buffers are read */
+static void
+sampler_block(sigset_t *old_mask)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+static void
+sampler_unblock(sigset_t *old_mask)
+{
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
+}
+
+#endif
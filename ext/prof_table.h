@@ -0,0 +1,181 @@
+/* :nodoc:
+ * Copyright (C) 2007  Shugo Maeda <shugo@ruby-lang.org>
+ *                     Charlie Savage <cfis@savagexi.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. */
+
+/* An open-addressing hash table used by the event hook to find
+   methods and call infos.  st_table chains every entry through a
+   separately allocated bucket, which means a pointer chase (and
+   usually a cache miss) per lookup.  Here keys and values are
+   stored inline in a single array and collisions are resolved by
+   linear probing, so a lookup is normally a single memory access.
+
+   Entries are never deleted while profiling, which keeps probing
+   simple - a slot with a NULL value is empty. */
+
+#include <ruby.h>
+
+#define PROF_TABLE_INITIAL_SIZE 8
+
+/* A method is identified by its number in the registry (see
+   prof_registry.h) and the recursive depth it was called at. */
+typedef struct {
+    unsigned int id;
+    int depth;
+} prof_method_key_t;
+
+typedef struct {
+    prof_method_key_t key;
+    unsigned long hash;
+    void *value;
+} prof_table_entry_t;
+
+typedef struct {
+    prof_table_entry_t *entries;
+    unsigned long mask;         /* Capacity - 1, capacity is a power of two. */
+    unsigned long count;
+} prof_table_t;
+
+typedef int (*prof_table_foreach_func)(prof_method_key_t *key, void *value, void *data);
+
+static inline void
+prof_method_key_init(prof_method_key_t *key, unsigned int id, int depth)
+{
+    key->id = id;
+    key->depth = depth;
+}
+
+static inline unsigned long
+prof_table_hash(const prof_method_key_t *key)
+{
+    unsigned long hash = (unsigned long) key->id;
+    hash = hash * 31 + (unsigned long) key->depth;
+
+    /* Spread the bits so that the mask picks up all of them. */
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bUL;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline int
+prof_method_key_equal(const prof_method_key_t *a, const prof_method_key_t *b)
+{
+    return a->id == b->id && a->depth == b->depth;
+}
+
+static prof_table_t *
+prof_table_create()
+{
+    prof_table_t *table = ALLOC(prof_table_t);
+    table->entries = ALLOC_N(prof_table_entry_t, PROF_TABLE_INITIAL_SIZE);
+    MEMZERO(table->entries, prof_table_entry_t, PROF_TABLE_INITIAL_SIZE);
+    table->mask = PROF_TABLE_INITIAL_SIZE - 1;
+    table->count = 0;
+    return table;
+}
+
+static void
+prof_table_free(prof_table_t *table)
+{
+    /* Values are owned by the caller. */
+    xfree(table->entries);
+    xfree(table);
+}
+
+static inline prof_table_entry_t *
+prof_table_probe(prof_table_entry_t *entries, unsigned long mask,
+                 const prof_method_key_t *key, unsigned long hash)
+{
+    unsigned long i = hash & mask;
+
+    while (entries[i].value)
+    {
+        if (entries[i].hash == hash && prof_method_key_equal(&entries[i].key, key))
+            break;
+        i = (i + 1) & mask;
+    }
+    return &entries[i];
+}
+
+static void
+prof_table_grow(prof_table_t *table)
+{
+    unsigned long old_size = table->mask + 1;
+    unsigned long new_size = old_size * 2;
+    prof_table_entry_t *old_entries = table->entries;
+    unsigned long i;
+
+    table->entries = ALLOC_N(prof_table_entry_t, new_size);
+    MEMZERO(table->entries, prof_table_entry_t, new_size);
+    table->mask = new_size - 1;
+
+    for (i = 0; i < old_size; i++)
+    {
+        prof_table_entry_t *entry = &old_entries[i];
+        if (entry->value)
+            *prof_table_probe(table->entries, table->mask, &entry->key, entry->hash) = *entry;
+    }
+    xfree(old_entries);
+}
+
+static inline void *
+prof_table_lookup(prof_table_t *table, const prof_method_key_t *key)
+{
+    return prof_table_probe(table->entries, table->mask, key, prof_table_hash(key))->value;
+}
+
+static inline void
+prof_table_insert(prof_table_t *table, const prof_method_key_t *key, void *value)
+{
+    unsigned long hash = prof_table_hash(key);
+    prof_table_entry_t *entry = prof_table_probe(table->entries, table->mask, key, hash);
+
+    if (!entry->value)
+    {
+        /* Keep the load factor under 1/2 so probe sequences stay short. */
+        if ((table->count + 1) * 2 > table->mask + 1)
+        {
+            prof_table_grow(table);
+            entry = prof_table_probe(table->entries, table->mask, key, hash);
+        }
+        table->count++;
+        entry->key = *key;
+        entry->hash = hash;
+    }
+    entry->value = value;
+}
+
+static void
+prof_table_foreach(prof_table_t *table, prof_table_foreach_func func, void *data)
+{
+    unsigned long i;
+
+    for (i = 0; i <= table->mask; i++)
+    {
+        prof_table_entry_t *entry = &table->entries[i];
+        if (entry->value && func(&entry->key, entry->value, data) != ST_CONTINUE)
+            break;
+    }
+}
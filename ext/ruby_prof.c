@@ -32,19 +32,29 @@
      thread_data_t     - Stores data about a single thread.  
      prof_stack_t      - The method call stack in a particular thread
      prof_method_t     - Profiling information for each method
-     prof_call_info_t  - Keeps track a method's callers and callees. 
+     prof_call_info_t  - Keeps track of calls from one method to another.
+     prof_call_ref_t   - Links a prof_call_info_t to a caller or callee.
 
   The final resulut is a hash table of thread_data_t, keyed on the thread
   id.  Each thread has an hash a table of prof_method_t, keyed on the
-  method id.  A hash table is used for quick look up when doing a profile.
-  However, it is exposed to Ruby as an array.
+  method's class, id and recursive depth (see prof_table.h).  A hash table
+  is used for quick look up when doing a profile.  However, it is exposed
+  to Ruby as an array.
   
-  Each prof_method_t has two hash tables, parent and children, of prof_call_info_t.
-  These objects keep track of a method's callers (who called the method) and its
-  callees (who the method called).  These are keyed the method id, but once again,
-  are exposed to Ruby as arrays.  Each prof_call_into_t maintains a pointer to the
-  caller or callee method, thereby making it easy to navigate through the call 
+  There is one prof_call_info_t per caller/callee pair, allocated in chunks
+  per thread.  While profiling, each prof_method_t has a hash table of
+  the prof_call_info_t objects for its callees, keyed on the callee's key.
+  When profiling stops the thread's call infos are compacted into a single
+  array of prof_call_ref_t (in compressed sparse row form) so that each
+  method's callers (who called the method) and callees (who the method called)
+  are contiguous.  Each prof_call_ref_t maintains a pointer to the caller or
+  callee method, thereby making it easy to navigate through the call 
   hierarchy in ruby - which is very helpful for creating call graphs.      
+
+  Threads, methods and call infos are allocated from an arena that belongs
+  to the profile (see prof_arena.h).  Once profiling stops, the
+  RubyProf::Result owns the arena and the thread data.  MethodInfo and
+  CallInfo objects just point into that data, so they keep the result alive.
 */
 
 
@@ -54,6 +64,9 @@
 #ifndef RUBY_VM
 #include <node.h>
 #include <st.h>
+#ifdef HAVE_ENV_H
+#include <env.h>
+#endif
 typedef rb_event_t rb_event_flag_t;
 #define rb_sourcefile() (node ? node->nd_file : 0)
 #define rb_sourceline() (node ? nd_line(node) : 0)
@@ -61,8 +74,24 @@ typedef rb_event_t rb_event_flag_t;
 
 #include "version.h"
 
+#if !defined(RUBY_VM) && defined(HAVE_ENV_H) && defined(HAVE_ST_UNIQ)
+/* Ruby 1.8 numbers its frames, so the event hook can find out which
+   of its frames an exception unwound. */
+#define PROF_FRAME_UNIQ
+#endif
+#include "prof_table.h"
+#include "prof_arena.h"
+#include "prof_registry.h"
+
 /* ================  Constants  =================*/
 #define INITIAL_STACK_SIZE 8
+#define CALL_INFO_CACHE_SIZE 2
+#define CALL_INFO_CHUNK_SIZE 256
+#define EVENT_BUFFER_SIZE 16384
+
+/* Event type used by deferred aggregation to record the
+   time a thread spent waiting for other threads. */
+#define EVENT_WAIT 0
 
 
 /* ================  Measurement  =================*/
@@ -74,6 +103,9 @@ typedef unsigned long prof_measure_t;
 
 #include "measure_process_time.h"
 #include "measure_wall_time.h"
+#include "measure_monotonic_time.h"
+#include "measure_thread_time.h"
+#include "measure_perf_event.h"
 #include "measure_cpu_time.h"
 #include "measure_allocations.h"
 #include "measure_memory.h"
@@ -83,44 +115,109 @@ typedef unsigned long prof_measure_t;
 static prof_measure_t (*get_measurement)() = measure_process_time;
 static double (*convert_measurement)(prof_measure_t) = convert_process_time;
 
+/* Several measure modes can be recorded in one run.  The first is
+   measure_mode, read with get_measurement and kept in the times' own
+   fields, the others are extra measurements. */
+#define PROF_MAX_MEASUREMENTS 4
+#define PROF_MAX_EXTRA_MEASUREMENTS (PROF_MAX_MEASUREMENTS - 1)
+
+typedef struct {
+    int mode;
+    prof_measure_t (*measure)();
+    double (*convert)(prof_measure_t);
+    int per_thread;             /* Is each thread measured with its own clock? */
+    double scale;               /* Converts the measurements of a loaded result,
+                                   which has no convert function. */
+} prof_measurement_t;
+
+static double
+measurement_convert(prof_measurement_t *measurement, prof_measure_t value)
+{
+    if (measurement->convert)
+      return measurement->convert(value);
+    return value * measurement->scale;
+}
+
+static prof_measurement_t extra_measurements[PROF_MAX_EXTRA_MEASUREMENTS];
+static int extra_measurement_count = 0;
+
 /* ================  DataTypes  =================*/
 static VALUE mProf;
 static VALUE cResult;
 static VALUE cMethodInfo;
 static VALUE cCallInfo;
 
+struct prof_call_ref_t;
+struct thread_data_t;
+
+/* The times of a method or call info for an extra measurement. */
+typedef struct {
+    prof_measure_t total_time;
+    prof_measure_t self_time;
+    prof_measure_t wait_time;
+} prof_times_t;
+
 /* Profiling information for each method. */
 typedef struct prof_method_t {
-    st_data_t key;              /* Cache hash value for speed reasons. */
-    VALUE name;                 /* Name of the method. */
-    VALUE klass;                /* The method's class. */
-    ID mid;                     /* The method id. */
-    int depth;                  /* The recursive depth this method was called at.*/
+    prof_method_key_t key;      /* The method's number in the registry, which
+                                   knows its class, id, source file and line,
+                                   and the recursive depth it was called at. */
     int called;                 /* Number of times called */
-    const char* source_file;    /* The method's source file */
-    int line;                   /* The method's line number. */
     prof_measure_t total_time;  /* Total time spent in this method and children. */
     prof_measure_t self_time;   /* Total time spent in this method. */
     prof_measure_t wait_time;   /* Total time this method spent waiting for other threads. */
-    st_table *parents;          /* The method's callers (prof_call_info_t). */
-    st_table *children;         /* The method's callees (prof_call_info_t). */
+    prof_measure_t total_overhead; /* Profiler overhead removed from total_time */
+    prof_measure_t self_overhead;  /* Profiler overhead removed from self_time */
+    prof_times_t *extra_times;  /* One per extra measurement, or NULL */
+    prof_table_t *call_infos;   /* The method's callees (prof_call_info_t), used
+                                   while profiling and freed when it stops. */
+    struct prof_call_ref_t *parents;  /* The method's callers. */
+    int parents_count;
+    struct prof_call_ref_t *children; /* The method's callees. */
+    int children_count;
+    struct thread_data_t *thread;     /* The thread this method was called in. */
     int active_frame;           /* # of active frames for this method.  Used to detect
                                    recursion.  Stashed here to avoid extra lookups in 
                                    the hook method - so a bit hackey. */
     struct prof_method_t *base;        /* For recursion - this is the parent method */
+    VALUE object;               /* The method's MethodInfo, or Qnil until it is asked for */
 } prof_method_t;
 
 
-/* Callers and callee information for a method. */
+/* Calls from one method to another.  The same object is
+   shared by the caller's children and the callee's parents. */
 typedef struct {
-    prof_method_t *target;
+    prof_method_t *parent;
+    prof_method_t *child;
     int called;
     prof_measure_t total_time;
     prof_measure_t self_time;
     prof_measure_t wait_time;
+    prof_times_t *extra_times;  /* One per extra measurement, or NULL */
     int line;  
 } prof_call_info_t;
 
+/* Call infos are allocated in chunks since there are many of them. */
+typedef struct prof_call_info_chunk_t {
+    struct prof_call_info_chunk_t *next;
+    int used;
+    prof_call_info_t call_infos[CALL_INFO_CHUNK_SIZE];
+} prof_call_info_chunk_t;
+
+/* An entry in a method's parents or children - the
+   method at the other end of the call and the call info. */
+typedef struct prof_call_ref_t {
+    prof_method_t *target;
+    prof_call_info_t *call_info;
+} prof_call_ref_t;
+
+
+/* A frame's inline cache entry - remembers the call info that
+   connects the frame's method to a child it has called. */
+typedef struct {
+    prof_method_t *child;
+    prof_call_info_t *call_info;
+} prof_call_info_cache_t;
 
 /* Temporary object that maintains profiling information
    for active methods - there is one per method.*/
@@ -131,9 +228,36 @@ typedef struct {
     prof_measure_t start_time;
     prof_measure_t wait_time;
     prof_measure_t child_time;
+    prof_measure_t child_overhead; /* Overhead removed from the children's times */
+    unsigned int events;        /* Events whose overhead falls in this frame's self time */
+    int collapsed;              /* Is the method's total time already counted by an
+                                   outer frame, see recursion_limit= */
+    prof_measure_t extra_start[PROF_MAX_EXTRA_MEASUREMENTS];
+    prof_measure_t extra_wait[PROF_MAX_EXTRA_MEASUREMENTS];
+    prof_measure_t extra_child[PROF_MAX_EXTRA_MEASUREMENTS];
     unsigned int line;
+#ifdef PROF_FRAME_UNIQ
+    unsigned long uniq;         /* The ruby frame's number, or 0 if unknown */
+#endif
+    /* Loops tend to call the same few methods over and over, so
+       keep the last children seen to avoid the table lookups. */
+    prof_call_info_cache_t call_info_cache[CALL_INFO_CACHE_SIZE];
+    unsigned int call_info_cache_next;
 } prof_frame_t;
 
+/* An event recorded by the event hook when aggregation is deferred. */
+typedef struct {
+    rb_event_flag_t event;
+    int line;                   /* Line number reported for the event */
+    int caller_line;            /* The caller's current line, or -1 if unchanged */
+    int lines;                  /* Line events in the caller since the previous event */
+    VALUE klass;                /* Class and method called or returning */
+    ID mid;
+    const char* source_file;
+    prof_measure_t time;        /* Time of the event, or the time spent
+                                   waiting for EVENT_WAIT. */
+} prof_event_t;
+
 /* Current stack of active methods.*/
 typedef struct {
     prof_frame_t *start;
@@ -142,25 +266,107 @@ typedef struct {
 } prof_stack_t;
 
 /* Profiling information for a thread. */
-typedef struct {
+typedef struct thread_data_t {
     unsigned long thread_id;                  /* Thread id */
-    st_table* method_info_table;     /* All called methods */
+    prof_arena_t* arena;             /* The profile's arena */
+    prof_registry_t* registry;       /* The profile's methods */
+    prof_table_t* method_info_table; /* All called methods */
+    prof_method_t **methods;         /* The methods called at depth 0, indexed by
+                                        their number in the registry.  Only
+                                        used while profiling. */
+    unsigned int methods_capacity;
     prof_stack_t* stack;             /* Active methods */
     prof_measure_t last_switch;      /* Point of last context switch */
+    prof_measure_t extra_last_switch[PROF_MAX_EXTRA_MEASUREMENTS];
+    prof_measure_t extra_now[PROF_MAX_EXTRA_MEASUREMENTS]; /* Taken for the current event */
+    prof_call_info_chunk_t *call_infos; /* All calls between methods */
+    size_t call_info_count;
+    prof_call_ref_t *call_refs;      /* Callers and callees of all methods,
+                                        built when profiling stops. */
+    VALUE *call_ref_objects;         /* The CallInfo of each call ref, or NULL
+                                        until the first is asked for. */
+    prof_event_t *events;            /* Events waiting to be aggregated, only
+                                        used for deferred aggregation. */
+    size_t event_count;
+    int event_depth;                 /* Number of calls recorded but not returned */
+    int event_line;                  /* The thread's current line */
+    int event_line_changed;          /* Has the line changed since the last call or return? */
+    int event_lines;                 /* Line events since the last call or return */
+    double overhead_carry;           /* Fraction of the overhead not yet removed */
+    int excluded;                    /* Is the thread excluded by a filter? */
+    VALUE fiber;                     /* The fiber this data records, on ruby 1.9 */
+    struct thread_data_t *owner;     /* The data whose methods the fiber's calls are
+                                        recorded in - itself, or its thread's data
+                                        when fibers are merged. */
+    struct thread_data_t *thread;    /* The data of the thread's first fiber -
+                                        itself, unless it records another fiber. */
+    int fibers;                      /* Has the thread switched fibers?  Until it
+                                        does its fiber isn't looked up. */
+    prof_measure_t sample_time;      /* Total weight of the thread's samples
+                                        aggregated so far, only used for sampling. */
+    int raised;                      /* Has an exception been raised since the
+                                        stack was last unwound? */
+    prof_measure_t raise_time;       /* When it was raised */
+    prof_measure_t raise_extra[PROF_MAX_EXTRA_MEASUREMENTS];
+    VALUE result;                    /* The RubyProf::Result that owns this data */
 } thread_data_t;
 
 typedef struct {
-    VALUE threads;
+    VALUE threads;              /* Built the first time it is asked for */
+    VALUE objects;              /* The MethodInfo and CallInfo objects handed
+                                   out, kept so that each record has one. */
+    st_table *threads_tbl;
+    prof_arena_t *arena;
+    prof_registry_t *registry;
+    void *mapping;              /* The file a loaded result was read from */
+    size_t mapping_size;
+    double event_overhead;
+    prof_measurement_t measurements[PROF_MAX_MEASUREMENTS]; /* measure_mode's is first */
+    int measurement_count;
+    int selected;               /* The measurement MethodInfo and CallInfo report */
 } prof_result_t;
 
 
 /* ================  Variables  =================*/
 static int measure_mode;
+/* Is each thread measured with its own clock? */
+static int measure_per_thread = 0;
 static st_table *threads_tbl = NULL;
-/* TODO - If Ruby become multi-threaded this has to turn into
-   a separate stack since this isn't thread safe! */
+static prof_arena_t *arena = NULL;
+static prof_registry_t *registry = NULL;
+static int deferred_aggregation = 0;
+static int trace_lines = 1;
+static int compensate_overhead = 0;
+/* The deepest recursion reported as a method of its own, or -1 */
+static int recursion_limit = -1;
+/* The cost of an event, in the units of the measure mode, when
+   compensating for the profiler's overhead */
+static double event_overhead = 0;
+/* The thread that raised the last event, used to detect context
+   switches.  This, the threads table and the arena are shared by all
+   threads, but are only used for a thread's first event and on context
+   switches, and rely on the interpreter lock.  Everything else the
+   event hook changes belongs to the current thread's thread_data. */
 static thread_data_t* last_thread_data = NULL;
 
+#if defined(RUBY_VM) && defined(HAVE_TLS)
+/* Ruby 1.9 runs each ruby thread on its own native thread, which
+   remembers its thread data.  Threads tables are numbered so that
+   thread data from an earlier profile is never used. */
+#define PROF_TLS_THREAD_DATA
+static unsigned long threads_tbl_serial = 0;
+static __thread thread_data_t *tls_thread_data = NULL;
+static __thread unsigned long tls_threads_tbl_serial = 0;
+#endif
+
+#if defined(RUBY_VM) && defined(HAVE_RB_FIBER_CURRENT)
+/* Each fiber has its own stack, so it gets its own thread data.  A
+   thread's data records the first fiber it ran, usually its root fiber. */
+#define PROF_FIBERS
+/* Are fibers reported as part of their thread? */
+static int merge_fibers = 0;
+#endif
+
 
 /* ================  Helper Functions  =================*/
 /* Helper method to get the id of a Ruby thread. */
@@ -254,52 +460,38 @@ klass_name(VALUE klass)
     return result;
 }
 
+/* Appends a recursive method's depth to its name */
 static VALUE
-method_name(ID mid, int depth)
+append_depth(VALUE name, int depth)
 {
-    VALUE result;
-
-    if (mid == ID_ALLOCATOR) 
-        result = rb_str_new2("allocate");
-    else if (mid == 0)
-        result = rb_str_new2("[No method]");
-    else
-        result = rb_String(ID2SYM(mid));
-    
     if (depth > 0)
     {
       char buffer[65];
       sprintf(buffer, "%i", depth);
-      rb_str_cat2(result, "-");
-      rb_str_cat2(result, buffer);
+      rb_str_cat2(name, "-");
+      rb_str_cat2(name, buffer);
     }
 
-    return result;
+    return name;
 }
 
 static VALUE
-full_name(VALUE klass, ID mid, int depth)
+method_name(ID mid, int depth)
 {
-  VALUE result = klass_name(klass);
-  rb_str_cat2(result, "#");
-  rb_str_append(result, method_name(mid, depth));
-  
-  return result;
-}
-
+    VALUE result;
 
-static inline st_data_t
-method_key(VALUE klass, ID mid, int depth)
-{
-  /* No idea if this is a unique key or not.  Would be
-     best to use the method name, but we can't, since
-     that calls internal ruby functions which would
-     cause the hook method to recursively call itself.
-     And that is too much of a bother to deal with.
-     Plus of course, this is faster. */
-  return (klass * 100) + (mid * 10) + depth;
+    if (mid == ID_ALLOCATOR) 
+        result = rb_str_new2("allocate");
+    else if (mid == 0)
+        result = rb_str_new2("[No method]");
+    else
+        result = rb_String(ID2SYM(mid));
+    
+    return append_depth(result, depth);
 }
 
+#include "prof_filter.h"
+
 /* ================  Stack Handling   =================*/
 
 /* Creates a stack of prof_frame_t to keep track
@@ -361,78 +553,100 @@ stack_size(prof_stack_t *stack)
     return stack->ptr - stack->start;
 }
 
+/* ================  Frame Handling   =================*/
+
+static inline void
+frame_call_info_cache_clear(prof_frame_t *frame)
+{
+    MEMZERO(frame->call_info_cache, prof_call_info_cache_t, CALL_INFO_CACHE_SIZE);
+    frame->call_info_cache_next = 0;
+}
+
+static inline prof_call_info_cache_t *
+frame_call_info_cache_lookup(prof_frame_t *frame, const prof_method_t *child)
+{
+    int i;
+    for (i = 0; i < CALL_INFO_CACHE_SIZE; i++)
+    {
+        if (frame->call_info_cache[i].child == child)
+            return &frame->call_info_cache[i];
+    }
+    return NULL;
+}
+
+static inline prof_call_info_cache_t *
+frame_call_info_cache_next(prof_frame_t *frame)
+{
+    /* Replace entries round robin. */
+    prof_call_info_cache_t *result = &frame->call_info_cache[frame->call_info_cache_next];
+    frame->call_info_cache_next = (frame->call_info_cache_next + 1) % CALL_INFO_CACHE_SIZE;
+    return result;
+}
+
 /* ================  Method Info Handling   =================*/
  
 /* --- Keeps track of the methods the current method calls */
-static st_table *
+static prof_table_t *
 method_info_table_create()
 {
-    return st_init_numtable();
+    return prof_table_create();
 }
 
-static inline size_t
-method_info_table_insert(st_table *table, st_data_t key, prof_method_t *val)
+static inline void
+method_info_table_insert(prof_table_t *table, const prof_method_key_t *key, prof_method_t *val)
 {
-    return st_insert(table, key, (st_data_t) val);
+    prof_table_insert(table, key, val);
 }
 
 static inline prof_method_t *
-method_info_table_lookup(st_table *table, st_data_t key)
+method_info_table_lookup(prof_table_t *table, const prof_method_key_t *key)
 {
-    st_data_t val;
-    if (st_lookup(table, key, &val))
-    {
-      return (prof_method_t *) val;
-    }
-    else 
-    {
-      return NULL;
-    }
+    return (prof_method_t *) prof_table_lookup(table, key);
 }
 
 
+static void prof_method_free(prof_method_t *method);
+
+static int
+free_methods(prof_method_key_t *key, void *value, void *data)
+{
+    prof_method_free((prof_method_t *) value);
+    return ST_CONTINUE;
+}
+
 static void
-method_info_table_free(st_table *table)
+method_info_table_free(prof_table_t *table)
 {
-    /* Don't free the contents since they are wrapped by
-       Ruby objects! */
-    st_free_table(table);
+    prof_table_foreach(table, free_methods, 0);
+    prof_table_free(table);
 }
 
 
 /* ================  Call Info Handling   =================*/
 
-/* ---- Hash, keyed on class/method_id, that holds call_info objects ---- */
-static st_table *
+/* ---- Hash, keyed on class/method_id/depth, that holds call_info objects ---- */
+static prof_table_t *
 caller_table_create()
 {
-    return st_init_numtable();
+    return prof_table_create();
 }
 
-static inline size_t
-caller_table_insert(st_table *table, st_data_t key, prof_call_info_t *val)
+static inline void
+caller_table_insert(prof_table_t *table, const prof_method_key_t *key, prof_call_info_t *val)
 {
-    return st_insert(table, key, (st_data_t) val);
+    prof_table_insert(table, key, val);
 }
 
 static inline prof_call_info_t *
-caller_table_lookup(st_table *table, st_data_t key)
+caller_table_lookup(prof_table_t *table, const prof_method_key_t *key)
 {
-    st_data_t val;
-    if (st_lookup(table, key, &val))
-    {
-      return (prof_call_info_t *) val;
-    }
-    else
-    {
-      return NULL;
-    }
+    return (prof_call_info_t *) prof_table_lookup(table, key);
 }
 
 static void
-caller_table_free(st_table *table)
+caller_table_free(prof_table_t *table)
 {
-    st_free_table(table);
+    prof_table_free(table);
 }
 
 /* Document-class: RubyProf::CallInfo
@@ -441,53 +655,145 @@ to keep track of which child methods were called and how long
 they took to execute. */
 
 /* :nodoc: */
+static prof_times_t *
+extra_times_create(thread_data_t *thread_data)
+{
+    prof_times_t *result;
+
+    if (extra_measurement_count == 0)
+      return NULL;
+
+    result = PROF_ARENA_ALLOC_N(thread_data->arena, prof_times_t, extra_measurement_count);
+    MEMZERO(result, prof_times_t, extra_measurement_count);
+    return result;
+}
+
 static prof_call_info_t *
-call_info_create(prof_method_t* method)
+call_info_create(thread_data_t *thread_data, prof_method_t *parent, prof_method_t *child)
 {
+    prof_call_info_chunk_t *chunk = thread_data->call_infos;
     prof_call_info_t *result;
 
-    result = ALLOC(prof_call_info_t);
-    result->target = method;
+    if (chunk == NULL || chunk->used == CALL_INFO_CHUNK_SIZE)
+    {
+        chunk = PROF_ARENA_ALLOC(thread_data->arena, prof_call_info_chunk_t);
+        chunk->next = thread_data->call_infos;
+        chunk->used = 0;
+        thread_data->call_infos = chunk;
+    }
+
+    result = &chunk->call_infos[chunk->used++];
+    thread_data->call_info_count++;
+
+    result->parent = parent;
+    result->child = child;
     result->called = 0;
     result->total_time = 0;
     result->self_time = 0;
     result->wait_time = 0;
+    result->extra_times = extra_times_create(thread_data);
+    result->line = 0;
     return result;
 }
 
-static void
-call_info_free(prof_call_info_t *call_info)
+/* The result that owns a thread's data */
+static prof_result_t *
+thread_data_result(struct thread_data_t *thread_data);
+
+/* Returns the times for the result's selected measurement. */
+static prof_times_t
+selected_times(struct thread_data_t *thread_data, prof_measure_t total_time,
+               prof_measure_t self_time, prof_measure_t wait_time,
+               prof_times_t *extra_times)
+{
+    prof_result_t *prof_result = thread_data_result(thread_data);
+    prof_times_t result;
+
+    if (prof_result->selected > 0)
+      return extra_times[prof_result->selected - 1];
+
+    result.total_time = total_time;
+    result.self_time = self_time;
+    result.wait_time = wait_time;
+    return result;
+}
+
+/* Converts a value of the result's selected measurement. */
+static double
+selected_convert(struct thread_data_t *thread_data, prof_measure_t value)
 {
-    xfree(call_info);
+    prof_result_t *prof_result = thread_data_result(thread_data);
+    return measurement_convert(&prof_result->measurements[prof_result->selected], value);
 }
 
-static int
-free_call_infos(st_data_t key, st_data_t value, st_data_t data)
+static prof_times_t
+call_info_times(prof_call_info_t *call_info)
 {
-    prof_call_info_t* call_info = (prof_call_info_t*) value;
-    call_info_free(call_info);
-    return ST_CONTINUE;
+    return selected_times(call_info->child->thread, call_info->total_time, call_info->self_time,
+                          call_info->wait_time, call_info->extra_times);
+}
+
+static double
+call_info_convert(prof_call_info_t *call_info, prof_measure_t value)
+{
+    return selected_convert(call_info->child->thread, value);
+}
+
+static void
+call_info_mark(prof_call_ref_t *call_ref)
+{
+    /* The call info belongs to its result. */
+    rb_gc_mark(call_ref->target->thread->result);
 }
 
+/* Keeps an object handed out for a record alive as long as its result */
+static void
+prof_result_keep(thread_data_t *thread_data, VALUE object);
+
 static VALUE
-call_info_new(prof_call_info_t *result)
+call_info_new(prof_call_ref_t *call_ref)
 {
-    /* We don't want Ruby freeing the underlying C structures, that
-       is done when the prof_method_t is freed. */
-    return Data_Wrap_Struct(cCallInfo, NULL, NULL, result);
+    thread_data_t *thread_data = call_ref->target->thread;
+    size_t index = call_ref - thread_data->call_refs;
+    VALUE result;
+
+    if (!thread_data->call_ref_objects)
+    {
+      size_t count = thread_data->call_info_count * 2;
+      thread_data->call_ref_objects = PROF_ARENA_ALLOC_N(thread_data->arena, VALUE, count);
+      MEMZERO(thread_data->call_ref_objects, VALUE, count);
+    }
+
+    result = thread_data->call_ref_objects[index];
+    if (!result)
+    {
+      /* We don't want Ruby freeing the underlying C structures, that
+         is done when the result is freed. */
+      result = Data_Wrap_Struct(cCallInfo, call_info_mark, NULL, call_ref);
+      thread_data->call_ref_objects[index] = result;
+      prof_result_keep(thread_data, result);
+    }
+    return result;
 }
 
-static prof_call_info_t *
-get_call_info_result(VALUE obj)
+static prof_call_ref_t *
+get_call_ref(VALUE obj)
 {
     if (BUILTIN_TYPE(obj) != T_DATA)
     {
         /* Should never happen */
       rb_raise(rb_eTypeError, "Not a call info object");
     }
-    return (prof_call_info_t *) DATA_PTR(obj);
+    return (prof_call_ref_t *) DATA_PTR(obj);
+}
+
+static prof_call_info_t *
+get_call_info_result(VALUE obj)
+{
+    return get_call_ref(obj)->call_info;
 }
 
+static VALUE prof_method_new(prof_method_t *result);
 
 /* call-seq:
    called -> MethodInfo
@@ -496,12 +802,7 @@ Returns the target method. */
 static VALUE
 call_info_target(VALUE self)
 {
-    /* Target is a pointer to a method_info - so we have to be careful
-       about the GC.  We will wrap the method_info but provide no
-       free method so the underlying object is not freed twice! */
-    
-    prof_call_info_t *result = get_call_info_result(self);
-    return Data_Wrap_Struct(cMethodInfo, NULL, NULL, result->target);
+    return prof_method_new(get_call_ref(self)->target);
 }
 
 /* call-seq:
@@ -535,7 +836,7 @@ call_info_total_time(VALUE self)
 {
     prof_call_info_t *result = get_call_info_result(self);
 
-    return rb_float_new(convert_measurement(result->total_time));
+    return rb_float_new(call_info_convert(result, call_info_times(result).total_time));
 }
 
 /* call-seq:
@@ -547,7 +848,7 @@ call_info_self_time(VALUE self)
 {
     prof_call_info_t *result = get_call_info_result(self);
 
-    return rb_float_new(convert_measurement(result->self_time));
+    return rb_float_new(call_info_convert(result, call_info_times(result).self_time));
 }
 
 /* call-seq:
@@ -559,7 +860,7 @@ call_info_wait_time(VALUE self)
 {
     prof_call_info_t *result = get_call_info_result(self);
 
-    return rb_float_new(convert_measurement(result->wait_time));
+    return rb_float_new(call_info_convert(result, call_info_times(result).wait_time));
 }
 
 /* call-seq:
@@ -570,8 +871,13 @@ static VALUE
 call_info_children_time(VALUE self)
 {
     prof_call_info_t *result = get_call_info_result(self);
-    prof_measure_t children_time = result->total_time - result->self_time - result->wait_time;
-    return rb_float_new(convert_measurement(children_time));
+    prof_times_t times = call_info_times(result);
+    prof_measure_t children_time = 0;
+
+    /* A recursive call collapsed into its caller has no total time */
+    if (times.total_time > times.self_time + times.wait_time)
+      children_time = times.total_time - times.self_time - times.wait_time;
+    return rb_float_new(call_info_convert(result, children_time));
 }
 
 
@@ -586,52 +892,117 @@ the RubyProf::Result object.
 
 /* :nodoc: */
 static prof_method_t *
-prof_method_create(st_data_t key, VALUE klass, ID mid, int depth, 
-                   const char* source_file, int line)
+prof_method_create(thread_data_t *thread_data, const prof_method_key_t *key)
 {
-    prof_method_t *result = ALLOC(prof_method_t);
+    prof_method_t *result = PROF_ARENA_ALLOC(thread_data->arena, prof_method_t);
     
-    result->klass = klass;
-    result->mid = mid;
-    result->key = key;
-    result->depth = depth;
+    result->key = *key;
 
     result->called = 0;
     result->total_time = 0;
     result->self_time = 0;
     result->wait_time = 0;
-    result->parents = caller_table_create();
-    result->children = caller_table_create();
+    result->total_overhead = 0;
+    result->self_overhead = 0;
+    result->extra_times = extra_times_create(thread_data);
+    result->call_infos = caller_table_create();
+    result->parents = NULL;
+    result->parents_count = 0;
+    result->children = NULL;
+    result->children_count = 0;
+    result->thread = thread_data;
     result->active_frame = 0;
     result->base = result;
-        
-    result->source_file = source_file;
-    result->line = line;
+    result->object = Qnil;
+    return result;
+}
+
+/* What the registry knows about a method */
+static inline prof_registry_entry_t *
+prof_method_entry(prof_method_t *method)
+{
+    return prof_registry_entry(method->thread->registry, method->key.id);
+}
+
+/* Printers ask for names over and over, so they are built once
+   and shared by every thread's record of the method. */
+static VALUE
+entry_klass_name(prof_registry_entry_t *entry)
+{
+    if (NIL_P(entry->klass_name) && entry->klass_text)
+      entry->klass_name = rb_obj_freeze(rb_str_new2(entry->klass_text));
+    else if (NIL_P(entry->klass_name))
+      entry->klass_name = rb_obj_freeze(klass_name(entry->klass));
+    return entry->klass_name;
+}
+
+/* Returns a method's cached name for its recursion depth, or nil */
+static VALUE
+cached_name(VALUE *names, int depth)
+{
+    if (NIL_P(*names))
+      *names = rb_ary_new();
+    return rb_ary_entry(*names, depth);
+}
+
+static VALUE
+entry_method_name(prof_registry_entry_t *entry, int depth)
+{
+    VALUE result = cached_name(&entry->method_names, depth);
+
+    if (NIL_P(result))
+    {
+      if (entry->method_text)
+        result = append_depth(rb_str_new2(entry->method_text), depth);
+      else
+        result = method_name(entry->mid, depth);
+      rb_obj_freeze(result);
+      rb_ary_store(entry->method_names, depth, result);
+    }
+    return result;
+}
+
+static VALUE
+entry_full_name(prof_registry_entry_t *entry, int depth)
+{
+    VALUE result = cached_name(&entry->full_names, depth);
+
+    if (NIL_P(result))
+    {
+      result = rb_str_dup(entry_klass_name(entry));
+      rb_str_cat2(result, "#");
+      rb_str_append(result, entry_method_name(entry, depth));
+      rb_obj_freeze(result);
+      rb_ary_store(entry->full_names, depth, result);
+    }
     return result;
 }
 
 static void
 prof_method_mark(prof_method_t *data)
 {
-    rb_gc_mark(data->klass);
+    rb_gc_mark(prof_method_entry(data)->klass);
+    rb_gc_mark(data->thread->result);
 }
 
 static void
 prof_method_free(prof_method_t *data)
 {
-    st_foreach(data->parents, free_call_infos, 0);
-    caller_table_free(data->parents); 
-    
-    st_foreach(data->children, free_call_infos, 0);
-    caller_table_free(data->children); 
-    
-    xfree(data);
+    /* The method itself, and its call infos, belong to the arena. */
+    if (data->call_infos)
+      caller_table_free(data->call_infos); 
 }
 
 static VALUE
 prof_method_new(prof_method_t *result)
 {
-    return Data_Wrap_Struct(cMethodInfo, prof_method_mark, prof_method_free, result);
+    if (NIL_P(result->object))
+    {
+      /* The method is freed along with its result. */
+      result->object = Data_Wrap_Struct(cMethodInfo, prof_method_mark, NULL, result);
+      prof_result_keep(result->thread, result->object);
+    }
+    return result->object;
 }
 
 static prof_method_t *
@@ -640,6 +1011,26 @@ get_prof_method(VALUE obj)
     return (prof_method_t *) DATA_PTR(obj);
 }
 
+static prof_times_t
+prof_method_times(prof_method_t *method)
+{
+    return selected_times(method->thread, method->total_time, method->self_time,
+                          method->wait_time, method->extra_times);
+}
+
+static double
+prof_method_convert(prof_method_t *method, prof_measure_t value)
+{
+    return selected_convert(method->thread, value);
+}
+
+/* The overhead is only removed from measure_mode's times */
+static int
+prof_method_compensated(prof_method_t *method)
+{
+    return thread_data_result(method->thread)->selected == 0;
+}
+
 /* call-seq:
    called -> int
 
@@ -662,7 +1053,7 @@ prof_method_total_time(VALUE self)
 {
     prof_method_t *result = get_prof_method(self);
 
-    return rb_float_new(convert_measurement(result->total_time));
+    return rb_float_new(prof_method_convert(result, prof_method_times(result).total_time));
 }
 
 /* call-seq:
@@ -674,7 +1065,37 @@ prof_method_self_time(VALUE self)
 {
     prof_method_t *result = get_prof_method(self);
 
-    return rb_float_new(convert_measurement(result->self_time));
+    return rb_float_new(prof_method_convert(result, prof_method_times(result).self_time));
+}
+
+/* call-seq:
+   raw_total_time -> float
+
+Returns the total amount of time spent in this method and its children,
+including ruby-prof's overhead.  Only differs from total_time when
+RubyProf.compensate_overhead is set. */
+static VALUE
+prof_method_raw_total_time(VALUE self)
+{
+    prof_method_t *result = get_prof_method(self);
+    prof_measure_t overhead = prof_method_compensated(result) ? result->total_overhead : 0;
+
+    return rb_float_new(prof_method_convert(result, prof_method_times(result).total_time + overhead));
+}
+
+/* call-seq:
+   raw_self_time -> float
+
+Returns the total amount of time spent in this method, including
+ruby-prof's overhead.  Only differs from self_time when
+RubyProf.compensate_overhead is set. */
+static VALUE
+prof_method_raw_self_time(VALUE self)
+{
+    prof_method_t *result = get_prof_method(self);
+    prof_measure_t overhead = prof_method_compensated(result) ? result->self_overhead : 0;
+
+    return rb_float_new(prof_method_convert(result, prof_method_times(result).self_time + overhead));
 }
 
 /* call-seq:
@@ -686,7 +1107,7 @@ prof_method_wait_time(VALUE self)
 {
     prof_method_t *result = get_prof_method(self);
 
-    return rb_float_new(convert_measurement(result->wait_time));
+    return rb_float_new(prof_method_convert(result, prof_method_times(result).wait_time));
 }
 
 /* call-seq:
@@ -696,7 +1117,7 @@ prof_method_wait_time(VALUE self)
 static VALUE
 prof_method_line(VALUE self)
 {
-    return rb_int_new(get_prof_method(self)->line);
+    return rb_int_new(prof_method_entry(get_prof_method(self))->line);
 }
 
 /* call-seq:
@@ -707,8 +1128,14 @@ static VALUE
 prof_method_children_time(VALUE self)
 {
     prof_method_t *result = get_prof_method(self);
-    prof_measure_t children_time = result->total_time - result->self_time - result->wait_time;
-    return rb_float_new(convert_measurement(children_time));
+    prof_times_t times = prof_method_times(result);
+    prof_measure_t children_time = 0;
+
+    /* A method collapsed by recursion_limit has less total time than
+       self and wait time */
+    if (times.total_time > times.self_time + times.wait_time)
+      children_time = times.total_time - times.self_time - times.wait_time;
+    return rb_float_new(prof_method_convert(result, children_time));
 }
 
 /* call-seq:
@@ -718,7 +1145,7 @@ return the source file of the method
 */
 static VALUE prof_method_source_file(VALUE self)
 {
-    const char* sf = get_prof_method(self)->source_file;
+    const char* sf = prof_method_entry(get_prof_method(self))->source_file;
     if(!sf)
     {
       return rb_str_new2("ruby_runtime");
@@ -733,13 +1160,14 @@ static VALUE prof_method_source_file(VALUE self)
 /* call-seq:
    method_class -> klass
 
-Returns the Ruby klass that owns this method. */
+Returns the Ruby klass that owns this method, or nil for a
+result read by RubyProf::Result.load. */
 static VALUE
 prof_method_klass(VALUE self)
 {
     prof_method_t *result = get_prof_method(self);
 
-    return result->klass;
+    return prof_method_entry(result)->klass;
 }
 
 /* call-seq:
@@ -749,47 +1177,51 @@ Returns the id of this method. */
 static VALUE
 prof_method_id(VALUE self)
 {
-    prof_method_t *result = get_prof_method(self);
+    prof_registry_entry_t *entry = prof_method_entry(get_prof_method(self));
 
-    return ID2SYM(result->mid);
+    /* Loaded methods only have a name */
+    if (entry->method_text && !entry->mid)
+      entry->mid = rb_intern(entry->method_text);
+    return ID2SYM(entry->mid);
 }
 
 /* call-seq:
    klass_name -> string
 
 Returns the name of this method's class.  Singleton classes
-will have the form <Object::Object>. */
+will have the form <Object::Object>.  The name is frozen. */
 
 static VALUE
 prof_klass_name(VALUE self)
 {
-    prof_method_t *method = get_prof_method(self);
-    return klass_name(method->klass);
+    return entry_klass_name(prof_method_entry(get_prof_method(self)));
 }
 
 /* call-seq:
    method_name -> string
 
 Returns the name of this method in the format Object#method.  Singletons
-methods will be returned in the format <Object::Object>#method.*/
+methods will be returned in the format <Object::Object>#method.  The
+name is frozen.*/
 
 static VALUE
 prof_method_name(VALUE self)
 {
     prof_method_t *method = get_prof_method(self);
-    return method_name(method->mid, method->depth);
+    return entry_method_name(prof_method_entry(method), method->key.depth);
 }
 
 /* call-seq:
    full_name -> string
 
-Returns the full name of this method in the format Object#method.*/
+Returns the full name of this method in the format Object#method.
+The name is frozen.*/
 
 static VALUE
 prof_full_name(VALUE self)
 {
     prof_method_t *method = get_prof_method(self);
-    return full_name(method->klass, method->mid, method->depth);
+    return entry_full_name(prof_method_entry(method), method->key.depth);
 }
 
 /* call-seq:
@@ -805,23 +1237,20 @@ prof_method_base(VALUE self)
     if (method == method->base)
       return self;
     else
-      /* Target is a pointer to a method_info - so we have to be careful
-         about the GC.  We will wrap the method_info but provide no
-         free method so the underlying object is not freed twice! */
-      return Data_Wrap_Struct(cMethodInfo, NULL, NULL, method->base);
+      return prof_method_new(method->base);
 }
 
-static int
-prof_method_collect_call_infos(st_data_t key, st_data_t value, st_data_t result)
-{
-    /* Create a new Ruby CallInfo object and store it into the hash
-       keyed on the parent's name.  We use the parent's name because
-       we want to see that printed out for child records in
-       a call graph. */
-    prof_call_info_t *call_info = (prof_call_info_t *) value;
-    VALUE arr = (VALUE) result;
-    rb_ary_push(arr, call_info_new(call_info));
-    return ST_CONTINUE;
+static VALUE
+prof_method_collect_call_infos(prof_call_ref_t *call_refs, int count)
+{
+    /* Create a new Ruby CallInfo object for each caller or callee. */
+    VALUE result = rb_ary_new2(count);
+    int i;
+
+    for (i = 0; i < count; i++)
+      rb_ary_push(result, call_info_new(&call_refs[i]));
+
+    return result;
 }
 
 /* call-seq:
@@ -835,10 +1264,8 @@ prof_method_parents(VALUE self)
     /* Returns an array of call info objects for this
        method's callers (the methods this method called). */
 
-    VALUE children = rb_ary_new();
     prof_method_t *result = get_prof_method(self);
-    st_foreach(result->parents, prof_method_collect_call_infos, children);
-    return children;
+    return prof_method_collect_call_infos(result->parents, result->parents_count);
 }
 
 
@@ -853,10 +1280,8 @@ prof_method_children(VALUE self)
     /* Returns an array of call info objects for this
        method's callees (the methods this method called). */
 
-    VALUE children = rb_ary_new();
     prof_method_t *result = get_prof_method(self);
-    st_foreach(result->children, prof_method_collect_call_infos, children);
-    return children;
+    return prof_method_collect_call_infos(result->children, result->children_count);
 }
 
 /* :nodoc: */
@@ -875,11 +1300,11 @@ prof_method_cmp(VALUE self, VALUE other)
     else if (y->called == 0)
       return INT2FIX(-1);
     else
-      return rb_dbl_cmp(x->total_time, y->total_time);
+      return rb_dbl_cmp(prof_method_times(x).total_time, prof_method_times(y).total_time);
 }
 
 static int
-collect_methods(st_data_t key, st_data_t value, st_data_t result)
+collect_methods(prof_method_key_t *key, void *value, void *result)
 {
     /* Called for each method stored in a thread's method table. 
        We want to store the method info information into an array.*/
@@ -893,66 +1318,233 @@ collect_methods(st_data_t key, st_data_t value, st_data_t result)
 
 /* ================  Thread Handling   =================*/
 
+static void thread_data_replay_events(thread_data_t* thread_data);
+
 /* ---- Keeps track of thread's stack and methods ---- */
 static thread_data_t*
-thread_data_create()
+thread_data_create(prof_arena_t *arena)
 {
-    thread_data_t* result = ALLOC(thread_data_t);
+    thread_data_t* result = PROF_ARENA_ALLOC(arena, thread_data_t);
+    result->arena = arena;
+    result->registry = registry;
     result->stack = stack_create();
     result->method_info_table = method_info_table_create();
+    result->methods = NULL;
+    result->methods_capacity = 0;
     result->last_switch = 0;
+    result->call_infos = NULL;
+    result->call_info_count = 0;
+    result->call_refs = NULL;
+    result->call_ref_objects = NULL;
+    result->result = Qnil;
+    result->events = NULL;
+    result->event_count = 0;
+    result->event_depth = 0;
+    result->event_line = 0;
+    result->event_line_changed = 0;
+    result->event_lines = 0;
+    result->overhead_carry = 0;
+    result->excluded = 0;
+    result->fiber = Qnil;
+    result->owner = result;
+    result->thread = result;
+    result->fibers = 0;
+    result->sample_time = 0;
+    result->raised = 0;
+    result->raise_time = 0;
+
+    if (deferred_aggregation)
+      result->events = ALLOC_N(prof_event_t, EVENT_BUFFER_SIZE);
+
     return result;
 }
 
-static void
-thread_data_free(thread_data_t* thread_data)
+/* Creates thread data that the event hook doesn't record to, for a
+   result that is loaded from a file or copied from the profile. */
+static thread_data_t*
+thread_data_create_detached(prof_arena_t *arena, prof_registry_t *registry,
+                            unsigned long thread_id)
 {
-    stack_free(thread_data->stack);
-    method_info_table_free(thread_data->method_info_table);
-    xfree(thread_data);
+    thread_data_t* result = thread_data_create(arena);
+    result->registry = registry;
+    result->thread_id = thread_id;
+    if (result->events)
+    {
+      xfree(result->events);
+      result->events = NULL;
+    }
+    return result;
 }
 
-
-/* ---- Hash, keyed on thread, that stores thread's stack
-        and methods---- */
-
-static st_table *
-threads_table_create()
+static void
+thread_data_free(thread_data_t* thread_data)
 {
-    return st_init_numtable();
+    /* Everything else belongs to the arena. */
+    if (thread_data->stack)
+      stack_free(thread_data->stack);
+    if (thread_data->events)
+      xfree(thread_data->events);
+    if (thread_data->methods)
+      xfree(thread_data->methods);
+    method_info_table_free(thread_data->method_info_table);
 }
 
-static inline size_t
-threads_table_insert(st_table *table, VALUE thread, thread_data_t *thread_data)
+/* Returns the thread's method with the given number in the
+   registry, or NULL if the thread hasn't called it. */
+static inline prof_method_t *
+thread_data_method(thread_data_t* thread_data, unsigned int id)
 {
-    /* Its too slow to key on the real thread id so just typecast thread instead. */
-    return st_insert(table, (st_data_t ) thread, (st_data_t) thread_data);
+    return id < thread_data->methods_capacity ? thread_data->methods[id] : NULL;
 }
 
-static inline thread_data_t *
-threads_table_lookup(st_table *table, long thread_id)
+static void
+thread_data_add_method(thread_data_t* thread_data, unsigned int id, prof_method_t *method)
 {
-    thread_data_t* result;
-    st_data_t val;
-
-    /* Its too slow to key on the real thread id so just typecast thread instead. */
-    if (st_lookup(table, (st_data_t) thread_id, &val))
-    {
-      result = (thread_data_t *) val;
-    }
-    else
+    if (id >= thread_data->methods_capacity)
     {
-        result = thread_data_create();
-        result->thread_id = thread_id;
-
-        /* Insert the table */
-        threads_table_insert(threads_tbl, thread_id, result);
+      unsigned int capacity = thread_data->registry->capacity;
+      REALLOC_N(thread_data->methods, prof_method_t*, capacity);
+      MEMZERO(thread_data->methods + thread_data->methods_capacity, prof_method_t*,
+              capacity - thread_data->methods_capacity);
+      thread_data->methods_capacity = capacity;
     }
-    return result;
+    thread_data->methods[id] = method;
 }
 
 static int
-free_thread_data(st_data_t key, st_data_t value, st_data_t dummy)
+assign_call_refs(prof_method_key_t *key, void *value, void *data)
+{
+    /* Hand out each method's slice of the call refs array.  The
+       counts are reset so that they can be used to fill the slices. */
+    prof_method_t *method = (prof_method_t *) value;
+    prof_call_ref_t **next = (prof_call_ref_t **) data;
+
+    method->children = *next;
+    *next += method->children_count;
+    method->children_count = 0;
+
+    method->parents = *next;
+    *next += method->parents_count;
+    method->parents_count = 0;
+
+    /* The call infos lookup table is only needed while profiling. */
+    caller_table_free(method->call_infos);
+    method->call_infos = NULL;
+
+    return ST_CONTINUE;
+}
+
+/* Converts the thread's call infos into a compressed sparse row
+   layout - a single array of prof_call_ref_t where each method's
+   children, followed by its parents, are stored contiguously. */
+static void
+thread_data_compact(thread_data_t* thread_data)
+{
+    prof_call_info_chunk_t *chunk;
+    prof_call_ref_t *next;
+    int i;
+
+    /* The stack and the methods array aren't needed anymore. */
+    stack_free(thread_data->stack);
+    thread_data->stack = NULL;
+    if (thread_data->methods)
+      xfree(thread_data->methods);
+    thread_data->methods = NULL;
+    thread_data->methods_capacity = 0;
+
+    /* Count each method's children and parents */
+    for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+    {
+        for (i = 0; i < chunk->used; i++)
+        {
+            prof_call_info_t *call_info = &chunk->call_infos[i];
+            call_info->parent->children_count++;
+            call_info->child->parents_count++;
+        }
+    }
+
+    thread_data->call_refs = PROF_ARENA_ALLOC_N(thread_data->arena, prof_call_ref_t,
+                                                thread_data->call_info_count * 2);
+    next = thread_data->call_refs;
+    prof_table_foreach(thread_data->method_info_table, assign_call_refs, &next);
+
+    /* Chunks are linked newest first - reverse them so that the
+       rows keep the call infos in the order they were seen. */
+    chunk = thread_data->call_infos;
+    thread_data->call_infos = NULL;
+    while (chunk)
+    {
+        prof_call_info_chunk_t *next_chunk = chunk->next;
+        chunk->next = thread_data->call_infos;
+        thread_data->call_infos = chunk;
+        chunk = next_chunk;
+    }
+
+    /* Now fill in the rows. */
+    for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+    {
+        for (i = 0; i < chunk->used; i++)
+        {
+            prof_call_info_t *call_info = &chunk->call_infos[i];
+            prof_method_t *parent = call_info->parent;
+            prof_method_t *child = call_info->child;
+            prof_call_ref_t *call_ref = &parent->children[parent->children_count++];
+
+            call_ref->target = child;
+            call_ref->call_info = call_info;
+
+            call_ref = &child->parents[child->parents_count++];
+            call_ref->target = parent;
+            call_ref->call_info = call_info;
+        }
+    }
+}
+
+
+/* ---- Hash, keyed on thread, that stores thread's stack
+        and methods---- */
+
+static st_table *
+threads_table_create()
+{
+#ifdef PROF_TLS_THREAD_DATA
+    threads_tbl_serial++;
+#endif
+    return st_init_numtable();
+}
+
+static inline size_t
+threads_table_insert(st_table *table, VALUE thread, thread_data_t *thread_data)
+{
+    /* Its too slow to key on the real thread id so just typecast thread instead. */
+    return st_insert(table, (st_data_t ) thread, (st_data_t) thread_data);
+}
+
+static inline thread_data_t *
+threads_table_lookup(st_table *table, long thread_id)
+{
+    thread_data_t* result;
+    st_data_t val;
+
+    /* Its too slow to key on the real thread id so just typecast thread instead. */
+    if (st_lookup(table, (st_data_t) thread_id, &val))
+    {
+      result = (thread_data_t *) val;
+    }
+    else
+    {
+        result = thread_data_create(arena);
+        result->thread_id = thread_id;
+        result->excluded = !filter_include_thread(thread_id);
+
+        /* Insert the table */
+        threads_table_insert(threads_tbl, thread_id, result);
+    }
+    return result;
+}
+
+static int
+free_thread_data(st_data_t key, st_data_t value, st_data_t dummy)
 {
     thread_data_free((thread_data_t*)value);
     return ST_CONTINUE;
@@ -967,6 +1559,141 @@ threads_table_free(st_table *table)
 }
 
 
+#ifdef PROF_FIBERS
+/* Returns the data of a fiber other than the first one its thread
+   ran.  Fibers are keyed on the fiber object, just like threads. */
+static thread_data_t *
+fiber_data_lookup(thread_data_t *thread_data, VALUE fiber)
+{
+    thread_data_t* result;
+    st_data_t val;
+
+    if (st_lookup(threads_tbl, (st_data_t) get_thread_id(fiber), &val))
+      return (thread_data_t *) val;
+
+    result = thread_data_create(arena);
+    result->thread_id = get_thread_id(fiber);
+    result->excluded = thread_data->excluded;
+    result->fiber = fiber;
+    result->thread = thread_data->thread;
+    result->fibers = 1;
+    if (merge_fibers)
+      result->owner = thread_data->owner;
+
+    threads_table_insert(threads_tbl, fiber, result);
+    return result;
+}
+#endif
+
+#ifdef PROF_FIBERS
+/* The methods that can switch to another fiber */
+static VALUE cFiber = Qnil;
+static VALUE cFiberSingleton = Qnil;
+static VALUE cEnumerator = Qnil;
+static ID id_resume, id_transfer, id_yield, id_raise, id_kill;
+static ID id_next, id_peek, id_next_values, id_peek_values;
+
+static int
+fiber_switch_p(rb_event_flag_t event, VALUE klass, ID mid)
+{
+    if (event != RUBY_EVENT_C_CALL)
+      return 0;
+    if (klass == cFiber)
+      return mid == id_resume || mid == id_transfer || mid == id_raise || mid == id_kill;
+    if (klass == cFiberSingleton)
+      return mid == id_yield;
+    if (klass == cEnumerator)
+      return mid == id_next || mid == id_peek || mid == id_next_values || mid == id_peek_values;
+    return 0;
+}
+#endif
+
+/* Returns the current thread's data, creating it for the
+   thread's first event.  Switching fibers switches thread data.
+
+   rb_fiber_current creates the root fiber of a thread that never
+   switched fibers, and the hook mustn't allocate, so a thread's fiber
+   is only looked up once it calls a method that switches fibers.
+   Until then its first fiber is the only one it has run.  This is
+   done when fibers are merged too, since each fiber still needs its
+   own stack. */
+static inline thread_data_t *
+thread_data_current(rb_event_flag_t event, VALUE klass, ID mid)
+{
+    thread_data_t* thread_data;
+#ifdef PROF_FIBERS
+    VALUE fiber;
+#endif
+
+#ifdef PROF_TLS_THREAD_DATA
+    if (tls_threads_tbl_serial != threads_tbl_serial)
+    {
+      tls_thread_data = threads_table_lookup(threads_tbl, get_thread_id(rb_thread_current()));
+      tls_threads_tbl_serial = threads_tbl_serial;
+    }
+    thread_data = tls_thread_data;
+#else
+    {
+      long thread_id = get_thread_id(rb_thread_current());
+
+      if (last_thread_data && last_thread_data->thread->thread_id == thread_id)
+        thread_data = last_thread_data->thread;
+      else
+        thread_data = threads_table_lookup(threads_tbl, thread_id);
+    }
+#endif
+
+#ifdef PROF_FIBERS
+    if (!thread_data->fibers)
+    {
+      if (!fiber_switch_p(event, klass, mid))
+        return thread_data;
+      /* The fiber about to switch away is the one recorded so far,
+         and Ruby creates its object to switch anyway */
+      thread_data->fibers = 1;
+      thread_data->fiber = rb_fiber_current();
+      return thread_data;
+    }
+
+    fiber = rb_fiber_current();
+    if (last_thread_data && last_thread_data->fiber == fiber)
+      return last_thread_data;
+    if (thread_data->fiber == fiber)
+      return thread_data;
+    return fiber_data_lookup(thread_data, fiber);
+#else
+    return thread_data;
+#endif
+}
+
+static int
+replay_thread_events(st_data_t key, st_data_t value, st_data_t dummy)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+
+    /* Aggregate any events that are still waiting.  This is done for
+       every thread before any is collected since a merged fiber's
+       events add to its thread's methods. */
+    if (thread_data->events)
+    {
+      thread_data_replay_events(thread_data);
+      xfree(thread_data->events);
+      thread_data->events = NULL;
+    }
+    return ST_CONTINUE;
+}
+
+static int
+compact_thread(st_data_t key, st_data_t value, st_data_t result)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+
+    /* The result now owns the thread's data */
+    thread_data->result = (VALUE) result;
+    thread_data_compact(thread_data);
+    return ST_CONTINUE;
+}
+
 static int
 collect_threads(st_data_t key, st_data_t value, st_data_t result)
 {
@@ -976,11 +1703,15 @@ collect_threads(st_data_t key, st_data_t value, st_data_t result)
        as an int. */
     thread_data_t* thread_data = (thread_data_t*) value;
     VALUE threads_hash = (VALUE) result;
-    
-    VALUE methods = rb_ary_new();
+    VALUE methods;
+
+    /* Merged fibers are reported with their thread */
+    if (thread_data->excluded || thread_data->owner != thread_data)
+      return ST_CONTINUE;
     
     /* Now collect an array of all the called methods */
-    st_foreach(thread_data->method_info_table, collect_methods, methods);
+    methods = rb_ary_new2(thread_data->method_info_table->count);
+    prof_table_foreach(thread_data->method_info_table, collect_methods, (void *) methods);
     
     /* Store the results in the threads hash keyed on the thread id. */
     rb_hash_aset(threads_hash, ULONG2NUM(thread_data->thread_id), methods);
@@ -1016,55 +1747,81 @@ get_event_name(rb_event_flag_t event)
   }
 }
 
+/* Adds a frame's extra measurements to a method's or call info's times */
+static void
+update_extra_times(prof_times_t *times, prof_frame_t *frame,
+                   const prof_measure_t *extra_total)
+{
+    int i;
+
+    for (i = 0; i < extra_measurement_count; i++)
+    {
+      if (!frame->collapsed)
+        times[i].total_time += extra_total[i];
+      times[i].self_time += extra_total[i] - frame->extra_child[i] - frame->extra_wait[i];
+      times[i].wait_time += frame->extra_wait[i];
+    }
+}
+
 static void
 update_result(thread_data_t* thread_data,
-              prof_measure_t total_time,
+              prof_measure_t total_time, const prof_measure_t *extra_total,
               prof_frame_t  *parent_frame, prof_frame_t *child_frame)
 {
     prof_method_t *parent = NULL;
     prof_method_t *child = child_frame->method;
-    prof_call_info_t *parent_call_info = NULL;
-    prof_call_info_t *child_call_info = NULL;
+    prof_call_info_t *call_info = NULL;
+    prof_call_info_cache_t *cache = NULL;
+    int i;
     
     prof_measure_t wait_time = child_frame->wait_time;
     prof_measure_t self_time = total_time - child_frame->child_time - wait_time;
 
+    /* A collapsed frame's total time is already part of an outer
+       frame's, for both the method and the recursive call to it. */
+    prof_measure_t counted_time = (child_frame->collapsed ? 0 : total_time);
+
     /* Update information about the child (ie, the current method) */
     child->called++;
-    child->total_time += total_time;
+    child->total_time += counted_time;
     child->self_time += self_time;
     child->wait_time += wait_time;
+    if (extra_measurement_count > 0)
+      update_extra_times(child->extra_times, child_frame, extra_total);
 
     if (!parent_frame) return;
     
     parent = parent_frame->method;
-        
-    child_call_info = caller_table_lookup(parent->children, child->key);
-    if (child_call_info == NULL)
+
+    /* Has this frame called the child before? */
+    cache = frame_call_info_cache_lookup(parent_frame, child);
+    if (cache)
     {
-        child_call_info = call_info_create(child);
-        caller_table_insert(parent->children, child->key, child_call_info);
+        call_info = cache->call_info;
     }
-
-    child_call_info->called++;
-    child_call_info->total_time += total_time;
-    child_call_info->self_time += self_time;
-    child_call_info->wait_time += wait_time;
-    child_call_info->line = parent_frame->line;
-        
-    /* Update child's parent information  */
-    parent_call_info = caller_table_lookup(child->parents, parent->key);
-    if (parent_call_info == NULL)
+    else
     {
-        parent_call_info = call_info_create(parent);
-        caller_table_insert(child->parents, parent->key, parent_call_info);
+        call_info = caller_table_lookup(parent->call_infos, &child->key);
+        if (call_info == NULL)
+        {
+            call_info = call_info_create(thread_data->owner, parent, child);
+            caller_table_insert(parent->call_infos, &child->key, call_info);
+        }
+
+        cache = frame_call_info_cache_next(parent_frame);
+        cache->child = child;
+        cache->call_info = call_info;
     }
-    
-    parent_call_info->called++;
-    parent_call_info->total_time += total_time;
-    parent_call_info->self_time += self_time;
-    parent_call_info->wait_time += wait_time;
-    parent_call_info->line = (parent_frame ? parent_frame->line : 0);
+
+    /* The call info is shared by the parent's children
+       and the child's parents. */
+    call_info->called++;
+    call_info->total_time += counted_time;
+    call_info->self_time += self_time;
+    call_info->wait_time += wait_time;
+    if (extra_measurement_count > 0)
+      update_extra_times(call_info->extra_times, child_frame, extra_total);
+    call_info->line = parent_frame->line;
     
     
     /* If the caller is the top of the stack, the merge in
@@ -1076,113 +1833,711 @@ update_result(thread_data_t* thread_data,
     {
       parent->total_time += total_time;
       parent->wait_time += wait_time;
+      for (i = 0; i < extra_measurement_count; i++)
+      {
+        parent->extra_times[i].total_time += extra_total[i];
+        parent->extra_times[i].wait_time += child_frame->extra_wait[i];
+      }
     }
 }
 
 
-#ifdef RUBY_VM
-static void
-prof_event_hook(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass)
-#else
+/* Records a call to a method.  Finds, or creates, the method
+   and pushes a new frame for it onto the thread's stack. */
 static void
-prof_event_hook(rb_event_flag_t event, NODE *node, VALUE self, ID mid, VALUE klass)
-#endif
+prof_call(thread_data_t* thread_data, rb_event_flag_t event, VALUE klass, ID mid,
+          prof_measure_t now, const char* source_file, int line)
 {
-    
-    VALUE thread;
-    prof_measure_t now = 0;
-    thread_data_t* thread_data = NULL;
-    long thread_id = 0;
+    int depth = 0;
+    int collapsed;
+    unsigned int id;
+    int i;
+    prof_method_key_t key;
+    prof_method_t *method = NULL;
     prof_frame_t *frame = NULL;
-#ifdef RUBY_VM
 
-    if (event != RUBY_EVENT_C_CALL &&
-  event != RUBY_EVENT_C_RETURN) {
-  VALUE thread = rb_thread_current();
-  rb_frame_method_id_and_class(&mid, &klass);
+    /* Line numbers are not accurate for c method calls */
+    int method_line = (event == RUBY_EVENT_C_CALL ? 0 : line);
+    const char* method_source_file = (event == RUBY_EVENT_C_CALL ? NULL : source_file);
+
+    /* Is this an include for a module?  If so get the actual
+       module class since we want to combine all profiling
+       results for that module. */
+    
+    if (klass != 0)
+      klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
+      
+    id = prof_registry_intern(thread_data->registry, klass, mid, method_source_file, method_line);
+    method = thread_data_method(thread_data->owner, id);
+    
+    if (!method)
+    {
+      prof_method_key_init(&key, id, 0);
+      method = prof_method_create(thread_data->owner, &key);
+      method_info_table_insert(thread_data->owner->method_info_table, &key, method);
+      thread_data_add_method(thread_data->owner, id, method);
+    }
+    
+    depth = method->active_frame;
+    method->active_frame++;                  
+
+    /* Deeper calls are merged into the method at the limit */
+    collapsed = (recursion_limit >= 0 && depth > recursion_limit);
+    if (collapsed)
+      depth = recursion_limit;
+    
+    if (depth > 0)
+    {
+      prof_method_t *base_method = method;
+      prof_method_key_init(&key, id, depth);
+      method = method_info_table_lookup(thread_data->owner->method_info_table, &key);
+      
+      if (!method)
+      {
+        method = prof_method_create(thread_data->owner, &key);
+        method->base = base_method;
+        method_info_table_insert(thread_data->owner->method_info_table, &key, method);
+      }
     }
+
+    /* The call and return events fall half in the caller and half in
+       the callee, so both are charged one event. */
+    frame = stack_peek(thread_data->stack);
+    if (frame)
+      frame->events++;
+
+    /* Push a new frame onto the stack */
+    frame = stack_push(thread_data->stack);
+    frame->method = method;
+    frame->start_time = now;
+    frame->wait_time = 0;
+    frame->child_time = 0;
+    frame->child_overhead = 0;
+    frame->events = 1;
+    frame->collapsed = collapsed;
+    frame->line = line;
+#ifdef PROF_FRAME_UNIQ
+    frame->uniq = 0;
 #endif
-    /*  This code is here for debug purposes - uncomment it out
-        when debugging to see a print out of exactly what the
-        profiler is tracing.
+    frame_call_info_cache_clear(frame);
+    for (i = 0; i < extra_measurement_count; i++)
     {
-        st_data_t key = 0;
-        static unsigned long last_thread_id = 0;
+      frame->extra_start[i] = thread_data->extra_now[i];
+      frame->extra_wait[i] = 0;
+      frame->extra_child[i] = 0;
+    }
+}
 
-        VALUE thread = rb_thread_current();
-        unsigned long thread_id = get_thread_id(thread);
-        char* class_name = rb_obj_classname(klass);
-        char* method_name = rb_id2name(mid);
+/* Records a return from the method at the top of the thread's stack. */
+static void
+prof_return(thread_data_t* thread_data, prof_measure_t now)
+{
+    prof_frame_t* frame = NULL;
+    prof_frame_t* caller_frame = NULL;
+    prof_measure_t total_time;
+    prof_measure_t extra_total[PROF_MAX_EXTRA_MEASUREMENTS];
+    int i;
 
-        char* source_file = rb_sourcefile();
-        unsigned int source_line = rb_sourceline();
-        
-        char* event_name = get_event_name(event);
-        
-        if (last_thread_id != thread_id)
-          printf("\n");
-          
-        if (klass != 0)
-          klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
-        key = method_key(klass, mid, 0);          
-        printf("%2u: %-8s :%2d  %s#%s (%u)\n",
-               thread_id, event_name, source_line, class_name, method_name, key);
-        last_thread_id = thread_id;               
-    } */
-    
-    /* Special case - skip any methods from the mProf 
-       module, such as Prof.stop, since they clutter
-       the results but aren't important to them results. */
-    if (self == mProf) return;
+    frame = stack_pop(thread_data->stack);
+    caller_frame = stack_peek(thread_data->stack);
+      
+    /* Frame can be null.  This can happen if RubProf.start is called from
+       a method that exits.  Frames unwound by an exception are popped
+       by prof_unwind. */
+    if (frame == NULL) return;
 
-    /* Get current measurement*/
-    now = get_measurement();
-    
-    /* Get the current thread information. */
-    thread = rb_thread_current();
-    thread_id = get_thread_id(thread);
-    
-    /* Was there a context switch? */
-    if (!last_thread_data || last_thread_data->thread_id != thread_id)
+    total_time = now - frame->start_time;
+
+    /* Take the cost of the frame's events out of its times.  The estimate
+       is fractional, so carry the remainder over to the next frame rather
+       than rounding it away. */
+    if (event_overhead > 0)
     {
-      prof_measure_t wait_time = 0;
-      
-      /* Get new thread information. */
-      thread_data = threads_table_lookup(threads_tbl, thread_id);
+        prof_measure_t self_time = total_time - frame->child_overhead - frame->child_time - frame->wait_time;
+        double estimate = frame->events * event_overhead + thread_data->overhead_carry;
+        prof_measure_t overhead = (prof_measure_t) estimate;
 
-      /* How long has this thread been waiting? */
-      wait_time = now - thread_data->last_switch;
-      thread_data->last_switch = 0;
+        thread_data->overhead_carry = estimate - overhead;
+        if (overhead > self_time)
+          overhead = self_time;
 
-      /* Get the frame at the top of the stack.  This may represent
-         the current method (EVENT_LINE, EVENT_RETURN)  or the
-         previous method (EVENT_CALL).*/
-      frame = stack_peek(thread_data->stack);
-    
-      if (frame)
-        frame->wait_time += wait_time;
-        
-      /* Save on the last thread the time of the context switch
-         and reset this thread's last context switch to 0.*/
-      if (last_thread_data)
-        last_thread_data->last_switch = now;
-        
-      last_thread_data = thread_data;
+        frame->method->self_overhead += overhead;
+        overhead += frame->child_overhead;
+        if (!frame->collapsed)
+          frame->method->total_overhead += overhead;
+        total_time -= overhead;
+
+        if (caller_frame)
+        {
+          caller_frame->child_overhead += overhead;
+          /* See the top of stack merge in update_result */
+          if (stack_size(thread_data->stack) == 1)
+            caller_frame->method->total_overhead += overhead;
+        }
     }
-    else
+
+    for (i = 0; i < extra_measurement_count; i++)
+      extra_total[i] = thread_data->extra_now[i] - frame->extra_start[i];
+
+    if (caller_frame)
     {
-      thread_data = last_thread_data;
-      frame = stack_peek(thread_data->stack);
+        caller_frame->child_time += total_time;
+        for (i = 0; i < extra_measurement_count; i++)
+          caller_frame->extra_child[i] += extra_total[i];
     }
+      
+    frame->method->base->active_frame--;
     
-    switch (event) {
-    case RUBY_EVENT_LINE:
+    update_result(thread_data, total_time, extra_total, caller_frame, frame);
+}
+
+/* Remembers when an exception was raised.  Ruby 1.8 doesn't report
+   returns from the methods an exception unwinds, and neither ruby
+   reports them for throw, so their frames are popped later (see
+   prof_unwind) and ended at the time of the raise. */
+static void
+prof_raise(thread_data_t* thread_data, prof_measure_t now)
+{
+    thread_data->raised = 1;
+    thread_data->raise_time = now;
+    MEMCPY(thread_data->raise_extra, thread_data->extra_now, prof_measure_t, extra_measurement_count);
+}
+
+static inline int
+prof_frame_is(prof_frame_t *frame, VALUE klass, ID mid)
+{
+    prof_registry_entry_t *entry = prof_method_entry(frame->method);
+    return entry->klass == klass && entry->mid == mid;
+}
+
+/* Pops the top count frames of the thread's stack, which ruby has
+   already unwound. */
+static void
+prof_unwind_frames(thread_data_t* thread_data, int count, prof_measure_t now)
+{
+    prof_measure_t extra_now[PROF_MAX_EXTRA_MEASUREMENTS];
+    int raised = thread_data->raised;
+
+    MEMCPY(extra_now, thread_data->extra_now, prof_measure_t, extra_measurement_count);
+    if (raised)
+      MEMCPY(thread_data->extra_now, thread_data->raise_extra, prof_measure_t, extra_measurement_count);
+
+    for (; count > 0; count--)
     {
-      /* Keep track of the current line number in this method.  When
-         a new method is called, we know what line number it was 
-         called from. */
-      if (frame)
+      prof_frame_t *frame = stack_peek(thread_data->stack);
+
+      /* A frame that started after the raise, in an ensure clause or
+         a rescue clause, was unwound later.  So were its callers. */
+      if (raised && frame->start_time > thread_data->raise_time)
       {
+        raised = 0;
+        MEMCPY(thread_data->extra_now, extra_now, prof_measure_t, extra_measurement_count);
+      }
+      prof_return(thread_data, raised ? thread_data->raise_time : now);
+    }
+
+    MEMCPY(thread_data->extra_now, extra_now, prof_measure_t, extra_measurement_count);
+    thread_data->raised = 0;
+}
+
+/* Makes the method that is returning the top of the thread's stack.
+   Any frames above it were unwound without the event hook being told.
+   If the method isn't on the stack at all it was called before
+   profiling started and the stack is left alone. */
+static void
+prof_unwind(thread_data_t* thread_data, VALUE klass, ID mid, prof_measure_t now)
+{
+    prof_stack_t *stack = thread_data->stack;
+    prof_frame_t *frame;
+
+    if (klass != 0)
+      klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
+
+    frame = stack_peek(stack);
+    if (frame == NULL || prof_frame_is(frame, klass, mid))
+      return;
+
+    for (frame--; frame >= stack->start; frame--)
+    {
+      if (prof_frame_is(frame, klass, mid))
+      {
+        prof_unwind_frames(thread_data, stack->ptr - frame - 1, now);
+        return;
+      }
+    }
+}
+
+#ifdef PROF_FRAME_UNIQ
+static int
+prof_frame_live(prof_frame_t *frame)
+{
+    struct FRAME *ruby_frame_p;
+
+    if (frame->uniq == 0)
+      return 1;
+
+    for (ruby_frame_p = ruby_frame; ruby_frame_p; ruby_frame_p = ruby_frame_p->prev)
+    {
+      if (ruby_frame_p->uniq == frame->uniq)
+        return 1;
+    }
+    return 0;
+}
+
+/* After an exception, pops the frames that are no longer on ruby's
+   stack.  That way the frames of methods an exception unwound don't
+   pile up when the method that rescues it doesn't return, say it
+   retries in a loop. */
+static void
+prof_unwind_ruby_frames(thread_data_t* thread_data, prof_measure_t now)
+{
+    prof_stack_t *stack = thread_data->stack;
+    prof_frame_t *frame = stack->ptr - 1;
+
+    while (frame >= stack->start && !prof_frame_live(frame))
+      frame--;
+
+    if (frame < stack->ptr - 1)
+      prof_unwind_frames(thread_data, stack->ptr - frame - 1, now);
+
+    /* Only the first event after the raise is checked, the frames of
+       ensure clauses the exception runs are left to prof_unwind. */
+    thread_data->raised = 0;
+}
+#endif
+
+/* ================  Deferred Aggregation  =================*/
+
+/* When deferred aggregation is on, the event hook just appends
+   events to the thread's event buffer.  They are replayed through
+   prof_call and prof_return when the buffer fills up and when
+   profiling stops. */
+
+static prof_event_t *
+thread_data_event(thread_data_t* thread_data)
+{
+    if (thread_data->event_count == EVENT_BUFFER_SIZE)
+      thread_data_replay_events(thread_data);
+
+    return &thread_data->events[thread_data->event_count++];
+}
+
+static void
+thread_data_replay_events(thread_data_t* thread_data)
+{
+    size_t i;
+
+    for (i = 0; i < thread_data->event_count; i++)
+    {
+      prof_event_t *event = &thread_data->events[i];
+      prof_frame_t *frame = stack_peek(thread_data->stack);
+
+      if (frame)
+        frame->events += event->lines;
+
+      switch (event->event) {
+      case EVENT_WAIT:
+        if (frame)
+          frame->wait_time += event->time;
+        break;
+      case RUBY_EVENT_RAISE:
+        prof_raise(thread_data, event->time);
+        break;
+      case RUBY_EVENT_RETURN:
+      case RUBY_EVENT_C_RETURN:
+        prof_unwind(thread_data, event->klass, event->mid, event->time);
+        prof_return(thread_data, event->time);
+        break;
+      default:
+        if (frame && event->caller_line >= 0)
+          frame->line = event->caller_line;
+        prof_call(thread_data, event->event, event->klass, event->mid,
+                  event->time, event->source_file, event->line);
+        break;
+      }
+    }
+    thread_data->event_count = 0;
+}
+
+static void
+thread_data_defer_event(thread_data_t* thread_data, rb_event_flag_t event,
+                        VALUE klass, ID mid, prof_measure_t now, int line)
+{
+    prof_event_t *deferred_event = NULL;
+
+    switch (event) {
+    case RUBY_EVENT_LINE:
+    {
+      if (thread_data->event_depth > 0)
+      {
+        thread_data->event_line = line;
+        thread_data->event_line_changed = 1;
+        thread_data->event_lines++;
+        break;
+      }
+      /* The first method seen for this thread - record it as a call,
+         see prof_event_hook. */
+    }
+    case RUBY_EVENT_CALL:
+    case RUBY_EVENT_C_CALL:
+    {
+      deferred_event = thread_data_event(thread_data);
+      deferred_event->event = event;
+      deferred_event->klass = klass;
+      deferred_event->mid = mid;
+      deferred_event->time = now;
+      deferred_event->source_file = rb_sourcefile();
+      deferred_event->line = line;
+      /* Only record the caller's line if it moved, otherwise the caller's
+         frame already has the right line when the events are replayed. */
+      deferred_event->caller_line = (thread_data->event_line_changed ? thread_data->event_line : -1);
+      deferred_event->lines = thread_data->event_lines;
+
+      thread_data->event_depth++;
+      thread_data->event_line_changed = 0;
+      thread_data->event_lines = 0;
+      break;
+    }
+    case RUBY_EVENT_RETURN:
+    case RUBY_EVENT_C_RETURN:
+    {
+      if (thread_data->event_depth == 0)
+        break;
+
+      deferred_event = thread_data_event(thread_data);
+      deferred_event->event = event;
+      deferred_event->klass = klass;
+      deferred_event->mid = mid;
+      deferred_event->time = now;
+      deferred_event->lines = thread_data->event_lines;
+
+      thread_data->event_depth--;
+      thread_data->event_line_changed = 0;
+      thread_data->event_lines = 0;
+      break;
+    }
+    case RUBY_EVENT_RAISE:
+    {
+      deferred_event = thread_data_event(thread_data);
+      deferred_event->event = event;
+      deferred_event->time = now;
+      deferred_event->lines = 0;
+      break;
+    }
+    }
+}
+
+static void
+thread_data_wait(thread_data_t* thread_data, prof_measure_t wait_time)
+{
+    if (thread_data->events)
+    {
+      prof_event_t *deferred_event = thread_data_event(thread_data);
+      deferred_event->event = EVENT_WAIT;
+      deferred_event->time = wait_time;
+      deferred_event->lines = 0;
+    }
+    else
+    {
+      /* Get the frame at the top of the stack.  This may represent
+         the current method (EVENT_LINE, EVENT_RETURN)  or the
+         previous method (EVENT_CALL).*/
+      prof_frame_t *frame = stack_peek(thread_data->stack);
+    
+      if (frame)
+        frame->wait_time += wait_time;
+    }
+}
+
+
+/* ================  Sampling  =================*/
+
+#include "prof_sampler.h"
+#include "prof_dump.h"
+
+#ifdef PROF_SAMPLING
+static int sampling = 0;
+static long sample_interval = SAMPLER_DEFAULT_INTERVAL;
+
+static int
+sampler_unwind(st_data_t key, st_data_t value, st_data_t dummy)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+
+    /* Leave the outermost frame on the stack, like the tracing
+       hook does. */
+    while (stack_size(thread_data->stack) > 1)
+      prof_return(thread_data, thread_data->sample_time);
+    return ST_CONTINUE;
+}
+
+/* Turns the samples into calls and returns.  Each sample's stack is
+   compared to the thread's stack - frames that are no longer on the
+   stack return and new frames are called.  The sample's weight is then
+   added to the thread's clock, so it is charged to the method at the
+   top of the sample's stack and to that method's callers.  This means
+   that a method's called count is the number of times it was seen
+   being entered, not the number of times it was really called.  The
+   buffers are emptied so that sampling can go on. */
+static void
+sampler_replay()
+{
+    prof_sample_frame_t *stack = ALLOC_N(prof_sample_frame_t, SAMPLER_MAX_DEPTH);
+    prof_sample_frame_t *frames = ALLOC_N(prof_sample_frame_t, SAMPLER_MAX_DEPTH);
+    size_t i;
+    unsigned int j;
+
+    for (i = 0; i < sampler.sample_count; i++)
+    {
+      prof_sample_t *sample = &sampler.samples[i];
+      thread_data_t* thread_data = threads_table_lookup(threads_tbl, sample->thread_id);
+      unsigned int count = 0;
+      unsigned int depth = 0;
+
+      /* Rebuild the sample's stack from the previous one */
+      MEMCPY(stack + sample->shared, sampler.frames + sample->start,
+             prof_sample_frame_t, sample->depth - sample->shared);
+      for (j = sample->shared; j < sample->depth; j++)
+        stack[j].klass = sampler_klass(stack[j].klass);
+
+      if (thread_data->excluded)
+        continue;
+
+      /* Leave out the frames of excluded classes */
+      for (j = 0; j < sample->depth; j++)
+      {
+        if (filter_include_klass(stack[j].klass))
+          frames[count++] = stack[j];
+      }
+
+      /* How many of the thread's frames are still active? */
+      while (depth < stack_size(thread_data->stack) && depth < count)
+      {
+        prof_registry_entry_t *entry = prof_method_entry(thread_data->stack->start[depth].method);
+        if (entry->klass != frames[depth].klass || entry->mid != frames[depth].mid)
+          break;
+        depth++;
+      }
+
+      while (stack_size(thread_data->stack) > depth)
+        prof_return(thread_data, thread_data->sample_time);
+
+      for (j = 0; j < depth; j++)
+        thread_data->stack->start[j].line = frames[j].line;
+
+      for (j = depth; j < count; j++)
+        prof_call(thread_data, RUBY_EVENT_CALL, frames[j].klass, frames[j].mid,
+                  thread_data->sample_time, frames[j].source_file, frames[j].line);
+
+      thread_data->sample_time += sample->weight;
+    }
+    xfree(stack);
+    xfree(frames);
+
+    if (sampler.dropped > 0)
+      rb_warn("RubyProf dropped %lu samples, the sample buffers were full", sampler.dropped);
+
+    sampler.sample_count = 0;
+    sampler.frame_count = 0;
+    sampler.dropped = 0;
+
+    /* The next sample can't share frames with the replayed ones */
+    sampler.stack_thread_id = 0;
+}
+
+static void
+sampler_aggregate()
+{
+    sampler_replay();
+    st_foreach(threads_tbl, sampler_unwind, 0);
+    sampler_free_buffers();
+}
+#endif
+
+/* Accounts a context switch to thread_data in the extra
+   measurements, like the event hook does for measure_mode. */
+static void
+thread_data_extra_switch(thread_data_t* thread_data, thread_data_t* last_thread_data)
+{
+    prof_frame_t *frame = stack_peek(thread_data->stack);
+    int i;
+
+    for (i = 0; i < extra_measurement_count; i++)
+    {
+      if (frame && !extra_measurements[i].per_thread)
+        frame->extra_wait[i] += thread_data->extra_now[i] - thread_data->extra_last_switch[i];
+      if (last_thread_data)
+        last_thread_data->extra_last_switch[i] = thread_data->extra_now[i];
+    }
+}
+
+/* Records the line the thread has reached in its current method,
+   which is where the method's next callee is called from. */
+static inline void
+thread_data_line(thread_data_t* thread_data, int line)
+{
+    if (thread_data->events)
+    {
+      if (thread_data->event_depth > 0)
+      {
+        thread_data->event_line = line;
+        thread_data->event_line_changed = 1;
+      }
+    }
+    else
+    {
+      prof_frame_t *frame = stack_peek(thread_data->stack);
+
+      if (frame)
+        frame->line = line;
+    }
+}
+
+
+#ifdef RUBY_VM
+static void
+prof_event_hook(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass)
+#else
+static void
+prof_event_hook(rb_event_flag_t event, NODE *node, VALUE self, ID mid, VALUE klass)
+#endif
+{
+    
+    prof_measure_t now = 0;
+    prof_measure_t extra_now[PROF_MAX_EXTRA_MEASUREMENTS];
+    thread_data_t* thread_data = NULL;
+    prof_frame_t *frame = NULL;
+    int i;
+#ifdef RUBY_VM
+
+    if (event != RUBY_EVENT_C_CALL &&
+  event != RUBY_EVENT_C_RETURN) {
+  VALUE thread = rb_thread_current();
+  rb_frame_method_id_and_class(&mid, &klass);
+    }
+#endif
+    /*  This code is here for debug purposes - uncomment it out
+        when debugging to see a print out of exactly what the
+        profiler is tracing.
+    {
+        static unsigned long last_thread_id = 0;
+
+        VALUE thread = rb_thread_current();
+        unsigned long thread_id = get_thread_id(thread);
+        char* class_name = rb_obj_classname(klass);
+        char* method_name = rb_id2name(mid);
+
+        char* source_file = rb_sourcefile();
+        unsigned int source_line = rb_sourceline();
+        
+        char* event_name = get_event_name(event);
+        
+        if (last_thread_id != thread_id)
+          printf("\n");
+          
+        if (klass != 0)
+          klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
+        printf("%2u: %-8s :%2d  %s#%s\n",
+               thread_id, event_name, source_line, class_name, method_name);
+        last_thread_id = thread_id;               
+    } */
+    
+    /* Special case - skip any methods from the mProf 
+       module, such as Prof.stop, since they clutter
+       the results but aren't important to them results. */
+    if (self == mProf) return;
+
+    /* Ignore the ruby code run to evaluate class filters */
+    if (filter_evaluating) return;
+
+#if defined(MEASURE_PERF_EVENTS)
+    perf_thread_open();
+#endif
+
+    /* Get current measurement*/
+    now = get_measurement();
+    for (i = 0; i < extra_measurement_count; i++)
+      extra_now[i] = extra_measurements[i].measure();
+    
+    /* Get the current thread information. */
+    thread_data = thread_data_current(event, klass, mid);
+    MEMCPY(thread_data->extra_now, extra_now, prof_measure_t, extra_measurement_count);
+    
+    /* Was there a context switch? */
+    if (thread_data != last_thread_data)
+    {
+      prof_measure_t wait_time = 0;
+      
+      /* How long has this thread been waiting?  A thread's own
+         clock doesn't run while it waits, and can't be compared
+         with the time another thread switched on its clock. */
+      if (!measure_per_thread)
+      {
+        wait_time = now - thread_data->last_switch;
+        thread_data_wait(thread_data, wait_time);
+      }
+      thread_data->last_switch = 0;
+      if (extra_measurement_count > 0)
+        thread_data_extra_switch(thread_data, last_thread_data);
+        
+      /* Save on the last thread the time of the context switch
+         and reset this thread's last context switch to 0.*/
+      if (last_thread_data)
+        last_thread_data->last_switch = now;
+        
+      last_thread_data = thread_data;
+    }
+
+    /* Skip excluded threads and the methods of excluded classes.  An
+       exception raised by an excluded method can still unwind the
+       frames of included ones. */
+    if (thread_data->excluded ||
+        (event != RUBY_EVENT_RAISE && !filter_include_klass(klass)))
+      return;
+
+    /* Without line events, find out where the caller is when it
+       makes a call.  Ruby 1.8 remembers the call site in the callee's
+       frame, or passes it to the hook for a c function.  Ruby 1.9 only
+       knows it for c functions - the line of the caller of a ruby
+       method is left at the caller's last known line. */
+    if (!trace_lines && (event == RUBY_EVENT_CALL || event == RUBY_EVENT_C_CALL))
+    {
+#ifdef RUBY_VM
+      if (event == RUBY_EVENT_C_CALL)
+        thread_data_line(thread_data, rb_sourceline());
+#else
+      NODE *call_node = (event == RUBY_EVENT_C_CALL ? node : NULL);
+#ifdef HAVE_ENV_H
+      if (event == RUBY_EVENT_CALL)
+        call_node = ruby_frame->node;
+#endif
+      if (call_node)
+        thread_data_line(thread_data, nd_line(call_node));
+#endif
+    }
+
+    if (thread_data->events)
+    {
+      thread_data_defer_event(thread_data, event, klass, mid, now, rb_sourceline());
+      return;
+    }
+
+#ifdef PROF_FRAME_UNIQ
+    if (thread_data->raised && event != RUBY_EVENT_RAISE)
+      prof_unwind_ruby_frames(thread_data, now);
+#endif
+
+    frame = stack_peek(thread_data->stack);
+    
+    switch (event) {
+    case RUBY_EVENT_LINE:
+    {
+      /* Keep track of the current line number in this method.  When
+         a new method is called, we know what line number it was 
+         called from. */
+      if (frame)
+      {
+        frame->events++;
 #ifdef RUBY_VM
     frame->line = rb_sourceline();
 #else
@@ -1195,291 +2550,1451 @@ prof_event_hook(rb_event_flag_t event, NODE *node, VALUE self, ID mid, VALUE kla
          the first method seen for this thread, so fall through
          to below to create it. */
     }
-    case RUBY_EVENT_CALL:
-    case RUBY_EVENT_C_CALL:
+    case RUBY_EVENT_CALL:
+    case RUBY_EVENT_C_CALL:
+    {
+        prof_call(thread_data, event, klass, mid, now, rb_sourcefile(), rb_sourceline());
+#ifdef PROF_FRAME_UNIQ
+        stack_peek(thread_data->stack)->uniq = ruby_frame->uniq;
+#endif
+        break;
+    }
+    case RUBY_EVENT_RETURN:
+    case RUBY_EVENT_C_RETURN:
+    {
+        prof_unwind(thread_data, klass, mid, now);
+        prof_return(thread_data, now);
+        break;
+    }
+    case RUBY_EVENT_RAISE:
+    {
+        prof_raise(thread_data, now);
+        break;
+    }
+    }
+}
+
+
+/* ================  Overhead Calibration  =================*/
+
+/* Each event costs the time it takes ruby to call the event
+   hook, read the clock and update the profile, and that time
+   ends up in the profiled methods' times.  To compensate, the
+   cost of an event is measured when profiling starts, by timing
+   calls to a trivial c method with and without the event hook
+   installed (the hook works on scratch profiling data), and the
+   cost of each frame's events is subtracted when it returns
+   (see prof_return). */
+
+#define CALIBRATION_CALLS 4096  /* Keeps all the events in a deferred buffer */
+#define CALIBRATION_ROUNDS 5
+
+static prof_measure_t
+prof_calibration_run(ID mid)
+{
+    prof_measure_t start = get_measurement();
+    int i;
+
+    for (i = 0; i < CALIBRATION_CALLS; i++)
+      rb_funcall(Qnil, mid, 0);
+
+    return get_measurement() - start;
+}
+
+static double
+prof_calibrate()
+{
+    st_table *saved_threads_tbl = threads_tbl;
+    prof_arena_t *saved_arena = arena;
+    prof_registry_t *saved_registry = registry;
+    thread_data_t *saved_last_thread_data = last_thread_data;
+    ID mid = rb_intern("nil?");
+    prof_measure_t plain = 0;
+    prof_measure_t hooked = 0;
+    int round;
+
+    for (round = 0; round < CALIBRATION_ROUNDS; round++)
+    {
+      prof_measure_t elapsed = prof_calibration_run(mid);
+
+      /* Other activity can only make a run slower */
+      if (round == 0 || elapsed < plain)
+        plain = elapsed;
+    }
+
+    for (round = 0; round < CALIBRATION_ROUNDS; round++)
+    {
+      prof_measure_t elapsed;
+
+      threads_tbl = threads_table_create();
+      arena = prof_arena_create();
+      registry = prof_registry_create();
+      last_thread_data = NULL;
+
+#ifdef RUBY_VM
+      rb_add_event_hook(prof_event_hook, RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN, Qnil);
+#else
+      rb_add_event_hook(prof_event_hook, RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN);
+#endif
+      elapsed = prof_calibration_run(mid);
+      rb_remove_event_hook(prof_event_hook);
+
+      threads_table_free(threads_tbl);
+      prof_arena_free(arena);
+      prof_registry_free(registry);
+
+      if (round == 0 || elapsed < hooked)
+        hooked = elapsed;
+    }
+
+    threads_tbl = saved_threads_tbl;
+    arena = saved_arena;
+    registry = saved_registry;
+    last_thread_data = saved_last_thread_data;
+
+    if (hooked < plain)
+      return 0;
+    return (double) (hooked - plain) / (CALIBRATION_CALLS * 2);
+}
+
+/* call-seq:
+   compensate_overhead? -> boolean
+
+   Returns whether ruby-prof compensates for its own overhead.*/
+static VALUE
+prof_get_compensate_overhead(VALUE self)
+{
+    return compensate_overhead ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+   compensate_overhead=value -> void
+
+   Specifies whether ruby-prof should compensate for its own overhead.
+   Every call, return and line event costs time, which is counted in
+   the times of the methods being profiled.  That makes methods that
+   make many small calls look much slower than they are.  When
+   compensating, ruby-prof measures what an event costs in the current
+   measure mode when profiling starts, counts the events in each frame
+   and subtracts their estimated cost from the frame's total and self
+   times.  The uncompensated times are available from
+   MethodInfo#raw_total_time and MethodInfo#raw_self_time, and the
+   estimated cost of an event from Result#event_overhead.*/
+static VALUE
+prof_set_compensate_overhead(VALUE self, VALUE val)
+{
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set compensate_overhead while profiling");
+    }
+
+    compensate_overhead = RTEST(val);
+    return val;
+}
+
+/* call-seq:
+   recursion_limit -> integer or nil
+
+   Returns the deepest recursion that is reported as a method of its
+   own, or nil if there is no limit.*/
+static VALUE
+prof_get_recursion_limit(VALUE self)
+{
+    return recursion_limit < 0 ? Qnil : INT2NUM(recursion_limit);
+}
+
+/* call-seq:
+   recursion_limit=value -> void
+
+   Specifies how deep recursive calls are reported separately.  By
+   default each recursion depth of a method is a method of its own,
+   named with the depth (Object#parse-1, Object#parse-2 and so on),
+   so deep recursion makes for a lot of methods.  With a limit, calls
+   deeper than the limit are merged into the method at the limit, and
+   a limit of 0 collapses all the recursive calls of a method into
+   the method.  A merged method's total time only counts its outermost
+   call, so it isn't counted twice, and the CallInfo of a merged
+   recursive call has the calls and self time but no total time.  Set
+   to nil for no limit.*/
+static VALUE
+prof_set_recursion_limit(VALUE self, VALUE val)
+{
+    int limit = NIL_P(val) ? -1 : NUM2INT(val);
+
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set recursion_limit while profiling");
+    }
+
+    if (!NIL_P(val) && limit < 0)
+    {
+      rb_raise(rb_eArgError, "recursion limit can't be negative: %d", limit);
+    }
+
+    recursion_limit = limit;
+    return val;
+}
+
+
+/* ========  ProfResult ============== */
+
+/* Document-class: RubyProf::Result
+The RubyProf::Result class is used to store the results of a 
+profiling run.  And instace of the class is returned from
+the methods RubyProf#stop and RubyProf#profile.
+
+RubyProf::Result has one field, called threads, which is a hash
+table keyed on thread ID.  For each thread id, the hash table
+stores another hash table that contains profiling information
+for each method called during the threads execution.  That
+hash table is keyed on method name and contains
+RubyProf::MethodInfo objects. */
+
+
+static void
+prof_result_mark(prof_result_t *prof_result)
+{
+    VALUE threads = prof_result->threads;
+    rb_gc_mark(threads);
+    rb_gc_mark(prof_result->objects);
+    if (prof_result->registry)
+      prof_registry_mark(prof_result->registry);
+}
+
+static void
+prof_result_free(prof_result_t *prof_result)
+{
+    prof_result->threads = Qnil;
+    if (prof_result->threads_tbl)
+      threads_table_free(prof_result->threads_tbl);
+    if (prof_result->arena)
+      prof_arena_free(prof_result->arena);
+    if (prof_result->registry)
+      prof_registry_free(prof_result->registry);
+    if (prof_result->mapping)
+      prof_dump_unmap(prof_result->mapping, prof_result->mapping_size);
+    xfree(prof_result);
+}
+
+/* Creates a result that takes over a threads table, with its
+   arena and registry. */
+static VALUE
+prof_result_new(st_table *result_threads_tbl, prof_arena_t *result_arena,
+                prof_registry_t *result_registry)
+{
+    prof_result_t *prof_result = ALLOC(prof_result_t);
+    VALUE result;
+
+    prof_result->threads = Qnil;
+    prof_result->objects = Qnil;
+    prof_result->threads_tbl = NULL;
+    prof_result->arena = NULL;
+    prof_result->registry = NULL;
+    prof_result->mapping = NULL;
+    prof_result->mapping_size = 0;
+    prof_result->event_overhead = event_overhead;
+    prof_result->measurements[0].mode = measure_mode;
+    prof_result->measurements[0].measure = get_measurement;
+    prof_result->measurements[0].convert = convert_measurement;
+    prof_result->measurements[0].per_thread = measure_per_thread;
+    prof_result->measurements[0].scale = 0;
+    MEMCPY(prof_result->measurements + 1, extra_measurements, prof_measurement_t, extra_measurement_count);
+    prof_result->measurement_count = extra_measurement_count + 1;
+    prof_result->selected = 0;
+    result = Data_Wrap_Struct(cResult, prof_result_mark, prof_result_free, prof_result);
+
+    /* The result takes over the threads table, the arena and the
+       registry.  Ruby objects for the threads, methods and calls
+       are only created when they are asked for. */
+    prof_result->threads_tbl = result_threads_tbl;
+    prof_result->arena = result_arena;
+    prof_result->registry = result_registry;
+    st_foreach(result_threads_tbl, replay_thread_events, 0);
+    st_foreach(result_threads_tbl, compact_thread, result);
+
+    return result;
+}
+
+
+static prof_result_t *
+get_prof_result(VALUE obj)
+{
+    if (BUILTIN_TYPE(obj) != T_DATA ||
+      RDATA(obj)->dfree != (RUBY_DATA_FUNC) prof_result_free)
+    {
+        /* Should never happen */
+      rb_raise(rb_eTypeError, "wrong result object");
+    }
+    return (prof_result_t *) DATA_PTR(obj);
+}
+
+/* call-seq:
+   threads -> Hash
+
+Returns a hash table keyed on thread ID.  For each thread id,
+the hash table stores another hash table that contains profiling
+information for each method called during the threads execution.
+That hash table is keyed on method name and contains 
+RubyProf::MethodInfo objects.  The hash is built the first time
+it is asked for, and each method and call has a single MethodInfo
+or CallInfo object. */
+static VALUE
+prof_result_threads(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+
+    if (NIL_P(prof_result->threads))
+    {
+      prof_result->threads = rb_hash_new();
+      st_foreach(prof_result->threads_tbl, collect_threads, prof_result->threads);
+    }
+    return prof_result->threads;
+}
+
+/* call-seq:
+   allocation_stats -> Hash
+
+Returns statistics about the memory allocated to record the
+profile.  The hash contains:
+
+   *:chunks - The number of chunks allocated.
+   *:reserved - The total size of the chunks in bytes.
+   *:used - The number of bytes handed out from the chunks.
+   *:allocations - The number of threads, methods and call infos (or
+   blocks of them) allocated.
+   *:methods - The number of distinct methods, which all threads share.
+   *:registry - The size of the methods' class, id, source file and
+    line, shared by all threads, in bytes.*/
+static VALUE
+prof_result_allocation_stats(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    VALUE result = prof_arena_stats(prof_result->arena);
+    rb_hash_aset(result, ID2SYM(rb_intern("methods")), UINT2NUM(prof_result->registry->count));
+    rb_hash_aset(result, ID2SYM(rb_intern("registry")), ULONG2NUM(prof_registry_size(prof_result->registry)));
+    return result;
+}
+
+/* Result#to_columns writes a column per counter, each a string of
+   packed native 64 bit integers or doubles. */
+enum {
+    METHOD_THREAD_ID, METHOD_ID, METHOD_DEPTH, METHOD_CALLED,
+    METHOD_TOTAL_TIME, METHOD_SELF_TIME, METHOD_WAIT_TIME, METHOD_COLUMNS
+};
+
+enum {
+    CALL_PARENT, CALL_CHILD, CALL_CALLED, CALL_LINE,
+    CALL_TOTAL_TIME, CALL_SELF_TIME, CALL_WAIT_TIME, CALL_COLUMNS
+};
+
+static const char *method_column_names[METHOD_COLUMNS] = {
+    "thread_id", "id", "depth", "called", "total_time", "self_time", "wait_time"
+};
+
+static const char *call_column_names[CALL_COLUMNS] = {
+    "parent", "child", "called", "line", "total_time", "self_time", "wait_time"
+};
+
+typedef struct {
+    st_table *rows;             /* The row of each method */
+    st_data_t row_count;
+    VALUE methods[METHOD_COLUMNS];
+    VALUE calls[CALL_COLUMNS];
+} prof_columns_t;
+
+static void
+column_add_int(VALUE column, unsigned LONG_LONG value)
+{
+    rb_str_buf_cat(column, (const char *) &value, sizeof(value));
+}
+
+static void
+column_add_float(VALUE column, double value)
+{
+    rb_str_buf_cat(column, (const char *) &value, sizeof(value));
+}
+
+static int
+column_add_method(prof_method_key_t *key, void *value, void *data)
+{
+    prof_columns_t *columns = (prof_columns_t *) data;
+    prof_method_t *method = (prof_method_t *) value;
+    prof_times_t times = prof_method_times(method);
+    VALUE *row = columns->methods;
+
+    st_insert(columns->rows, (st_data_t) method, columns->row_count++);
+    column_add_int(row[METHOD_THREAD_ID], method->thread->thread_id);
+    column_add_int(row[METHOD_ID], key->id);
+    column_add_int(row[METHOD_DEPTH], key->depth);
+    column_add_int(row[METHOD_CALLED], method->called);
+    column_add_float(row[METHOD_TOTAL_TIME], selected_convert(method->thread, times.total_time));
+    column_add_float(row[METHOD_SELF_TIME], selected_convert(method->thread, times.self_time));
+    column_add_float(row[METHOD_WAIT_TIME], selected_convert(method->thread, times.wait_time));
+    return ST_CONTINUE;
+}
+
+static int
+column_add_methods(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+
+    /* The same threads as Result#threads */
+    if (!thread_data->excluded && thread_data->owner == thread_data)
+      prof_table_foreach(thread_data->method_info_table, column_add_method, (void *) data);
+    return ST_CONTINUE;
+}
+
+static int
+column_add_calls(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_columns_t *columns = (prof_columns_t *) data;
+    VALUE *row = columns->calls;
+    prof_call_info_chunk_t *chunk;
+    int i;
+
+    if (thread_data->excluded || thread_data->owner != thread_data)
+      return ST_CONTINUE;
+
+    for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+    {
+        for (i = 0; i < chunk->used; i++)
+        {
+            prof_call_info_t *call_info = &chunk->call_infos[i];
+            prof_times_t times = call_info_times(call_info);
+            st_data_t parent = 0;
+            st_data_t child = 0;
+
+            st_lookup(columns->rows, (st_data_t) call_info->parent, &parent);
+            st_lookup(columns->rows, (st_data_t) call_info->child, &child);
+            column_add_int(row[CALL_PARENT], parent);
+            column_add_int(row[CALL_CHILD], child);
+            column_add_int(row[CALL_CALLED], call_info->called);
+            column_add_int(row[CALL_LINE], call_info->line);
+            column_add_float(row[CALL_TOTAL_TIME], call_info_convert(call_info, times.total_time));
+            column_add_float(row[CALL_SELF_TIME], call_info_convert(call_info, times.self_time));
+            column_add_float(row[CALL_WAIT_TIME], call_info_convert(call_info, times.wait_time));
+        }
+    }
+    return ST_CONTINUE;
+}
+
+/* call-seq:
+   to_columns -> Hash
+
+Returns the profile's counters as columns for numeric tools, read
+straight from the profile without creating a MethodInfo or CallInfo
+object.  The hash contains:
+
+   *:names - The full name of each method, indexed by method id.
+   *:methods - A row per method and thread, in the same order as the
+    methods of Result#threads, with the columns :thread_id, :id, :depth, :called, :total_time,
+    :self_time and :wait_time.
+   *:calls - A row per call between two methods with the columns
+    :parent and :child (rows of :methods), :called, :line,
+    :total_time, :self_time and :wait_time.
+
+Each column is a binary string of native 64 bit values - times are
+doubles in seconds (or whatever the selected measure mode counts), to
+be unpacked with 'D*', and the other columns are integers, to be
+unpacked with 'Q*'.  A method's name at a recursive depth above 0
+is the name with the depth appended, see MethodInfo#full_name.*/
+static VALUE
+prof_result_to_columns(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    prof_columns_t columns;
+    VALUE result = rb_hash_new();
+    VALUE names = rb_ary_new2(prof_result->registry->count);
+    VALUE methods = rb_hash_new();
+    VALUE calls = rb_hash_new();
+    unsigned int i;
+
+    for (i = 0; i < prof_result->registry->count; i++)
+      rb_ary_push(names, entry_full_name(prof_registry_entry(prof_result->registry, i), 0));
+
+    for (i = 0; i < METHOD_COLUMNS; i++)
+    {
+      columns.methods[i] = rb_str_buf_new(0);
+      rb_hash_aset(methods, ID2SYM(rb_intern(method_column_names[i])), columns.methods[i]);
+    }
+    for (i = 0; i < CALL_COLUMNS; i++)
+    {
+      columns.calls[i] = rb_str_buf_new(0);
+      rb_hash_aset(calls, ID2SYM(rb_intern(call_column_names[i])), columns.calls[i]);
+    }
+
+    columns.rows = st_init_numtable();
+    columns.row_count = 0;
+    st_foreach(prof_result->threads_tbl, column_add_methods, (st_data_t) &columns);
+    st_foreach(prof_result->threads_tbl, column_add_calls, (st_data_t) &columns);
+    st_free_table(columns.rows);
+
+    rb_hash_aset(result, ID2SYM(rb_intern("names")), names);
+    rb_hash_aset(result, ID2SYM(rb_intern("methods")), methods);
+    rb_hash_aset(result, ID2SYM(rb_intern("calls")), calls);
+    return result;
+}
+
+/* Result#dump and Result.load, see prof_dump.h for the format. */
+
+static void
+dump_times(prof_dump_times_t *times, prof_result_t *prof_result,
+           prof_measure_t total_time, prof_measure_t self_time,
+           prof_measure_t wait_time, prof_times_t *extra_times)
+{
+    int i;
+
+    MEMZERO(times, prof_dump_times_t, PROF_MAX_MEASUREMENTS);
+    times[0][0] = total_time;
+    times[0][1] = self_time;
+    times[0][2] = wait_time;
+    for (i = 1; i < prof_result->measurement_count; i++)
+    {
+      times[i][0] = extra_times[i - 1].total_time;
+      times[i][1] = extra_times[i - 1].self_time;
+      times[i][2] = extra_times[i - 1].wait_time;
+    }
+}
+
+static void
+load_times(prof_dump_times_t *times, prof_result_t *prof_result,
+           prof_measure_t *total_time, prof_measure_t *self_time,
+           prof_measure_t *wait_time, prof_times_t *extra_times)
+{
+    int i;
+
+    *total_time = (prof_measure_t) times[0][0];
+    *self_time = (prof_measure_t) times[0][1];
+    *wait_time = (prof_measure_t) times[0][2];
+    for (i = 1; i < prof_result->measurement_count; i++)
+    {
+      extra_times[i - 1].total_time = (prof_measure_t) times[i][0];
+      extra_times[i - 1].self_time = (prof_measure_t) times[i][1];
+      extra_times[i - 1].wait_time = (prof_measure_t) times[i][2];
+    }
+}
+
+typedef struct {
+    prof_result_t *prof_result;
+    VALUE path;
+    prof_dump_strings_t strings;
+    prof_dump_method_t *methods;
+    FILE *file;
+    st_table *rows;             /* The index of each of a thread's methods */
+    st_data_t row_count;
+} prof_dump_t;
+
+static int
+dump_row(prof_method_key_t *key, void *value, void *data)
+{
+    prof_dump_t *dump = (prof_dump_t *) data;
+    st_insert(dump->rows, (st_data_t) value, dump->row_count++);
+    return ST_CONTINUE;
+}
+
+static int
+dump_method(prof_method_key_t *key, void *value, void *data)
+{
+    prof_dump_t *dump = (prof_dump_t *) data;
+    prof_method_t *method = (prof_method_t *) value;
+    prof_dump_record_t record;
+    st_data_t base = 0;
+
+    st_lookup(dump->rows, (st_data_t) method->base, &base);
+    record.id = key->id;
+    record.depth = key->depth;
+    record.called = method->called;
+    record.base = base;
+    record.total_overhead = method->total_overhead;
+    record.self_overhead = method->self_overhead;
+    dump_times(record.times, dump->prof_result, method->total_time, method->self_time,
+               method->wait_time, method->extra_times);
+    fwrite(&record, sizeof(record), 1, dump->file);
+    return ST_CONTINUE;
+}
+
+static int
+dump_thread(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_dump_t *dump = (prof_dump_t *) data;
+    prof_dump_thread_t header;
+    prof_call_info_chunk_t *chunk;
+    int i;
+
+    /* The same threads as Result#threads */
+    if (thread_data->excluded || thread_data->owner != thread_data)
+      return ST_CONTINUE;
+
+    header.thread_id = thread_data->thread_id;
+    header.method_count = thread_data->method_info_table->count;
+    header.call_count = thread_data->call_info_count;
+    fwrite(&header, sizeof(header), 1, dump->file);
+
+    st_free_table(dump->rows);
+    dump->rows = st_init_numtable();
+    dump->row_count = 0;
+    prof_table_foreach(thread_data->method_info_table, dump_row, dump);
+    prof_table_foreach(thread_data->method_info_table, dump_method, dump);
+
+    for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+    {
+        for (i = 0; i < chunk->used; i++)
+        {
+            prof_call_info_t *call_info = &chunk->call_infos[i];
+            prof_dump_call_t record;
+            st_data_t parent = 0;
+            st_data_t child = 0;
+
+            st_lookup(dump->rows, (st_data_t) call_info->parent, &parent);
+            st_lookup(dump->rows, (st_data_t) call_info->child, &child);
+            record.parent = parent;
+            record.child = child;
+            record.called = call_info->called;
+            record.line = call_info->line;
+            dump_times(record.times, dump->prof_result, call_info->total_time, call_info->self_time,
+                       call_info->wait_time, call_info->extra_times);
+            fwrite(&record, sizeof(record), 1, dump->file);
+        }
+    }
+    return ST_CONTINUE;
+}
+
+static int
+count_threads(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    if (!thread_data->excluded && thread_data->owner == thread_data)
+      (*(unsigned int *) data)++;
+    return ST_CONTINUE;
+}
+
+static VALUE
+dump_write(VALUE data)
+{
+    prof_dump_t *dump = (prof_dump_t *) data;
+    prof_result_t *prof_result = dump->prof_result;
+    prof_registry_t *registry = prof_result->registry;
+    prof_dump_header_t header;
+    unsigned int i;
+    int failed;
+
+    /* Names go in the string table, so find them first. */
+    prof_dump_strings_init(&dump->strings);
+    dump->methods = ALLOC_N(prof_dump_method_t, registry->count ? registry->count : 1);
+    for (i = 0; i < registry->count; i++)
+    {
+      prof_registry_entry_t *entry = prof_registry_entry(registry, i);
+      VALUE klass_name = entry_klass_name(entry);
+      VALUE method_name = entry_method_name(entry, 0);
+      dump->methods[i].klass_name = prof_dump_string(&dump->strings, StringValuePtr(klass_name));
+      dump->methods[i].method_name = prof_dump_string(&dump->strings, StringValuePtr(method_name));
+      dump->methods[i].source_file = prof_dump_string(&dump->strings, entry->source_file);
+      dump->methods[i].line = entry->line;
+    }
+
+    MEMZERO(&header, prof_dump_header_t, 1);
+    memcpy(header.magic, PROF_DUMP_MAGIC, sizeof(header.magic));
+    header.version = PROF_DUMP_VERSION;
+    header.byte_order = PROF_DUMP_BYTE_ORDER;
+    header.measurement_count = prof_result->measurement_count;
+    header.method_count = registry->count;
+    st_foreach(prof_result->threads_tbl, count_threads, (st_data_t) &header.thread_count);
+    for (i = 0; i < (unsigned int) prof_result->measurement_count; i++)
+    {
+      header.modes[i] = prof_result->measurements[i].mode;
+      header.scales[i] = measurement_convert(&prof_result->measurements[i], 1);
+    }
+    header.event_overhead = prof_result->event_overhead;
+    header.strings_offset = sizeof(header);
+    header.strings_size = dump->strings.size;
+    header.methods_offset = header.strings_offset + ((dump->strings.size + 7) & ~7);
+    header.threads_offset = header.methods_offset + sizeof(prof_dump_method_t) * registry->count;
+
+    dump->file = fopen(StringValuePtr(dump->path), "wb");
+    if (!dump->file)
+      rb_sys_fail(StringValuePtr(dump->path));
+
+    /* The string table is padded so the records are aligned */
+    fwrite(&header, sizeof(header), 1, dump->file);
+    fwrite(dump->strings.data, 1, dump->strings.size, dump->file);
+    fwrite("\0\0\0\0\0\0\0", 1, header.methods_offset - header.strings_offset - dump->strings.size, dump->file);
+    fwrite(dump->methods, sizeof(prof_dump_method_t), registry->count, dump->file);
+
+    dump->rows = st_init_numtable();
+    st_foreach(prof_result->threads_tbl, dump_thread, (st_data_t) dump);
+
+    failed = ferror(dump->file);
+    failed = fclose(dump->file) != 0 || failed;
+    dump->file = NULL;
+    if (failed)
+      rb_sys_fail(StringValuePtr(dump->path));
+    return Qnil;
+}
+
+/* Frees the buffers dump_write made, whether or not it raised */
+static VALUE
+dump_done(VALUE data)
+{
+    prof_dump_t *dump = (prof_dump_t *) data;
+
+    if (dump->file)
+      fclose(dump->file);
+    if (dump->rows)
+      st_free_table(dump->rows);
+    if (dump->strings.offsets)
+      prof_dump_strings_free(&dump->strings);
+    xfree(dump->methods);
+    return Qnil;
+}
+
+/* call-seq:
+   dump(path) -> self
+
+Writes the result to a file in a compact binary format, which
+RubyProf::Result.load reads back.  The file can only be read on
+a machine with the same byte order. */
+static VALUE
+prof_result_dump(VALUE self, VALUE path)
+{
+    prof_dump_t dump;
+
+    StringValue(path);
+
+    MEMZERO(&dump, prof_dump_t, 1);
+    dump.prof_result = get_prof_result(self);
+    dump.path = path;
+    rb_ensure(dump_write, (VALUE) &dump, dump_done, (VALUE) &dump);
+    return self;
+}
+
+static void
+load_error(VALUE path, const char *message)
+{
+    rb_raise(rb_eRuntimeError, "%s: %s", StringValuePtr(path), message);
+}
+
+/* Returns the string at offset in a loaded file's string table */
+static const char *
+load_string(VALUE path, const char *strings, unsigned LONG_LONG size,
+            unsigned LONG_LONG offset)
+{
+    if (offset == PROF_DUMP_NONE)
+      return NULL;
+    if (offset >= size)
+      load_error(path, "invalid string");
+    return strings + offset;
+}
+
+/* Rebuilds a thread's methods and calls from its records and
+   returns the position of the next thread. */
+static const char *
+load_thread(VALUE result, VALUE path, const char *data, const char *end)
+{
+    prof_result_t *prof_result = get_prof_result(result);
+    const prof_dump_thread_t *header = (const prof_dump_thread_t *) data;
+    const prof_dump_record_t *records;
+    const prof_dump_call_t *calls;
+    thread_data_t *thread_data;
+    prof_method_t **rows;
+    int extra_count = prof_result->measurement_count - 1;
+    unsigned LONG_LONG i;
+
+    if ((size_t) (end - data) < sizeof(*header))
+      load_error(path, "truncated file");
+    records = (const prof_dump_record_t *) (header + 1);
+    if (header->method_count > (unsigned LONG_LONG) (end - (const char *) records) / sizeof(*records))
+      load_error(path, "truncated file");
+    calls = (const prof_dump_call_t *) (records + header->method_count);
+    if (header->call_count > (unsigned LONG_LONG) (end - (const char *) calls) / sizeof(*calls))
+      load_error(path, "truncated file");
+
+    thread_data = thread_data_create_detached(prof_result->arena, prof_result->registry,
+                                              (unsigned long) header->thread_id);
+    thread_data->result = result;
+    threads_table_insert(prof_result->threads_tbl, (VALUE) header->thread_id, thread_data);
+
+    rows = PROF_ARENA_ALLOC_N(prof_result->arena, prof_method_t *, header->method_count ? header->method_count : 1);
+    for (i = 0; i < header->method_count; i++)
+    {
+        const prof_dump_record_t *record = &records[i];
+        prof_method_key_t key;
+        prof_method_t *method;
+
+        /* Each depth of a method has a record of its own */
+        if (record->id >= prof_result->registry->count || record->base >= header->method_count ||
+            record->depth < 0)
+          load_error(path, "invalid method");
+
+        prof_method_key_init(&key, record->id, record->depth);
+        method = prof_method_create(thread_data, &key);
+        method->extra_times = extra_count ? PROF_ARENA_ALLOC_N(prof_result->arena, prof_times_t, extra_count) : NULL;
+        method->called = (int) record->called;
+        method->total_overhead = (prof_measure_t) record->total_overhead;
+        method->self_overhead = (prof_measure_t) record->self_overhead;
+        load_times((prof_dump_times_t *) record->times, prof_result, &method->total_time,
+                   &method->self_time, &method->wait_time, method->extra_times);
+        prof_table_insert(thread_data->method_info_table, &key, method);
+        rows[i] = method;
+    }
+
+    for (i = 0; i < header->method_count; i++)
+      rows[i]->base = rows[records[i].base];
+
+    for (i = 0; i < header->call_count; i++)
     {
-        int depth = 0;
-        st_data_t key = 0;
-        prof_method_t *method = NULL;
+        const prof_dump_call_t *record = &calls[i];
+        prof_call_info_t *call_info;
+
+        if (record->parent >= header->method_count || record->child >= header->method_count)
+          load_error(path, "invalid call");
+
+        call_info = call_info_create(thread_data, rows[record->parent], rows[record->child]);
+        call_info->extra_times = extra_count ? PROF_ARENA_ALLOC_N(prof_result->arena, prof_times_t, extra_count) : NULL;
+        call_info->called = (int) record->called;
+        call_info->line = (int) record->line;
+        load_times((prof_dump_times_t *) record->times, prof_result, &call_info->total_time,
+                   &call_info->self_time, &call_info->wait_time, call_info->extra_times);
+    }
 
-        /* Is this an include for a module?  If so get the actual
-           module class since we want to combine all profiling
-           results for that module. */
-        
-        if (klass != 0)
-          klass = (BUILTIN_TYPE(klass) == T_ICLASS ? RBASIC(klass)->klass : klass);
-          
-        key = method_key(klass, mid, 0);
-   
-        method = method_info_table_lookup(thread_data->method_info_table, key);
-        
-        if (!method)
-        {
-          const char* source_file = rb_sourcefile();
-          int line = rb_sourceline();
-          
-          /* Line numbers are not accurate for c method calls */
-            if (event == RUBY_EVENT_C_CALL)
-            {
-              line = 0;
-              source_file = NULL;
-            }
-            
-          method = prof_method_create(key, klass, mid, depth, source_file, line);
-          method_info_table_insert(thread_data->method_info_table, key, method);
-        }
+    thread_data_compact(thread_data);
+    return (const char *) (calls + header->call_count);
+}
+
+/* call-seq:
+   load(path) -> RubyProf::Result
+
+Reads a result written by RubyProf::Result#dump.  The file is mapped
+into memory and its records are copied in one pass, with the names used
+in place, so a large profile loads quickly and its methods are only
+turned into MethodInfo objects when they are asked for.  Any printer can print the loaded result, but its
+methods have no class - MethodInfo#klass returns nil. */
+static VALUE
+prof_result_load(VALUE klass, VALUE path)
+{
+    prof_result_t *prof_result;
+    const prof_dump_header_t *header;
+    const prof_dump_method_t *methods;
+    const char *data;
+    const char *strings;
+    const char *end;
+    VALUE result;
+    unsigned int i;
+
+    StringValue(path);
+
+    prof_result = ALLOC(prof_result_t);
+    prof_result->threads = Qnil;
+    prof_result->objects = Qnil;
+    prof_result->threads_tbl = st_init_numtable();
+    prof_result->arena = prof_arena_create();
+    prof_result->registry = prof_registry_create();
+    prof_result->mapping = NULL;
+    prof_result->mapping_size = 0;
+    prof_result->event_overhead = 0;
+    prof_result->measurement_count = 1;
+    prof_result->selected = 0;
+    MEMZERO(prof_result->measurements, prof_measurement_t, PROF_MAX_MEASUREMENTS);
+
+    /* From here on the result frees everything if the file is invalid */
+    result = Data_Wrap_Struct(cResult, prof_result_mark, prof_result_free, prof_result);
+    prof_result->mapping = prof_dump_map(StringValuePtr(path), &prof_result->mapping_size);
+
+    data = (const char *) prof_result->mapping;
+    end = data + prof_result->mapping_size;
+    header = (const prof_dump_header_t *) data;
+
+    if (prof_result->mapping_size < sizeof(*header) ||
+        memcmp(header->magic, PROF_DUMP_MAGIC, sizeof(header->magic)) != 0)
+      load_error(path, "not a ruby-prof profile");
+    if (header->byte_order != PROF_DUMP_BYTE_ORDER)
+      load_error(path, "profile was written on a machine with a different byte order");
+    if (header->version != PROF_DUMP_VERSION)
+      rb_raise(rb_eRuntimeError, "%s: unsupported profile version %u", StringValuePtr(path), header->version);
+    if (header->measurement_count < 1 || header->measurement_count > PROF_MAX_MEASUREMENTS ||
+        header->strings_offset > prof_result->mapping_size ||
+        header->strings_size > prof_result->mapping_size - header->strings_offset ||
+        (header->strings_size && data[header->strings_offset + header->strings_size - 1] != '\0') ||
+        header->methods_offset > prof_result->mapping_size ||
+        header->method_count > (prof_result->mapping_size - header->methods_offset) / sizeof(prof_dump_method_t) ||
+        header->threads_offset > prof_result->mapping_size)
+      load_error(path, "truncated file");
+
+    prof_result->event_overhead = header->event_overhead;
+    prof_result->measurement_count = header->measurement_count;
+    for (i = 0; i < header->measurement_count; i++)
+    {
+      prof_result->measurements[i].mode = header->modes[i];
+      prof_result->measurements[i].scale = header->scales[i];
+    }
+
+    strings = data + header->strings_offset;
+    methods = (const prof_dump_method_t *) (data + header->methods_offset);
+    for (i = 0; i < header->method_count; i++)
+    {
+      const char *klass_text = load_string(path, strings, header->strings_size, methods[i].klass_name);
+      const char *method_text = load_string(path, strings, header->strings_size, methods[i].method_name);
+      if (!klass_text || !method_text)
+        load_error(path, "invalid method");
+      prof_registry_add(prof_result->registry, klass_text, method_text,
+                        load_string(path, strings, header->strings_size, methods[i].source_file),
+                        (int) methods[i].line);
+    }
+
+    data += header->threads_offset;
+    for (i = 0; i < header->thread_count; i++)
+      data = load_thread(result, path, data, end);
+
+    return result;
+}
+
+/* call-seq:
+   event_overhead -> float
+
+Returns the estimated cost of an event that was subtracted from
+the results, or 0 if RubyProf.compensate_overhead wasn't set. */
+static VALUE
+prof_result_event_overhead(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    return rb_float_new(measurement_convert(&prof_result->measurements[0], 1) * prof_result->event_overhead);
+}
+
+static prof_result_t *
+thread_data_result(thread_data_t *thread_data)
+{
+    return (prof_result_t *) DATA_PTR(thread_data->result);
+}
+
+static void
+prof_result_keep(thread_data_t *thread_data, VALUE object)
+{
+    prof_result_t *prof_result = thread_data_result(thread_data);
+
+    if (NIL_P(prof_result->objects))
+      prof_result->objects = rb_ary_new();
+    rb_ary_push(prof_result->objects, object);
+}
+
+/* call-seq:
+   measure_modes -> [measure_mode, ...]
+
+Returns the measure modes that were recorded, see RubyProf.measure_modes=. */
+static VALUE
+prof_result_measure_modes(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    VALUE result = rb_ary_new();
+    int i;
+
+    for (i = 0; i < prof_result->measurement_count; i++)
+      rb_ary_push(result, INT2NUM(prof_result->measurements[i].mode));
+    return result;
+}
+
+/* call-seq:
+   measure_mode -> measure_mode
+
+Returns the measure mode whose values MethodInfo and CallInfo
+report.  This is the first of measure_modes unless it has been
+changed with measure_mode=. */
+static VALUE
+prof_result_measure_mode(VALUE self)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    return INT2NUM(prof_result->measurements[prof_result->selected].mode);
+}
+
+/* call-seq:
+   measure_mode=value -> void
+
+Selects which of the recorded measure modes MethodInfo and CallInfo
+report, and so which measurement printers print.  Raises an
+ArgumentError if the mode wasn't recorded.  Overhead compensation
+only applies to the first measure mode. */
+static VALUE
+prof_result_set_measure_mode(VALUE self, VALUE val)
+{
+    prof_result_t *prof_result = get_prof_result(self);
+    int mode = NUM2INT(val);
+    int i;
+
+    for (i = 0; i < prof_result->measurement_count; i++)
+    {
+      if (prof_result->measurements[i].mode == mode)
+      {
+        prof_result->selected = i;
+        return val;
+      }
+    }
+    rb_raise(rb_eArgError, "measure mode %d wasn't recorded", mode);
+    return val;
+}
+
+
+
+/* Finds the functions that take and convert mode's measurements,
+   raising an ArgumentError if the mode isn't supported. */
+static void
+measurement_init(prof_measurement_t *measurement, long mode)
+{
+    switch (mode) {
+      case MEASURE_PROCESS_TIME:
+        measurement->measure = measure_process_time;
+        measurement->convert = convert_process_time;
+        break;
         
-        depth = method->active_frame;
-        method->active_frame++;                  
+      case MEASURE_WALL_TIME:
+        measurement->measure = measure_wall_time;
+        measurement->convert = convert_wall_time;
+        break;
         
-        if (depth > 0)
-        {
-          prof_method_t *base_method = method;
-          key = method_key(klass, mid, depth);
-          method = method_info_table_lookup(thread_data->method_info_table, key);
-          
-          if (!method)
-          {
-            const char* source_file = rb_sourcefile();
-            int line = rb_sourceline();
-            
-            /* Line numbers are not accurate for c method calls */
-            if (event == RUBY_EVENT_C_CALL)
-            {
-              line = 0;
-              source_file = NULL;
-            }
+      #if defined(MEASURE_MONOTONIC_TIME)
+      case MEASURE_MONOTONIC_TIME:
+        measurement->measure = measure_monotonic_time;
+        measurement->convert = convert_monotonic_time;
+        break;
+      #endif
+
+      #if defined(MEASURE_THREAD_TIME)
+      case MEASURE_THREAD_TIME:
+        measurement->measure = measure_thread_time;
+        measurement->convert = convert_thread_time;
+        break;
+      #endif
+
+      #if defined(MEASURE_CPU_TIME)
+      case MEASURE_CPU_TIME:
+        if (cpu_frequency == 0)
+            cpu_frequency = get_cpu_frequency();
+        if (!cpu_clock_invariant())
+            rb_warn("the cpu's clock counter may not tick at a constant rate, CPU_TIME measurements may be unreliable");
+        measurement->measure = measure_cpu_time;
+        measurement->convert = convert_cpu_time;
+        break;
+      #endif
               
-            method = prof_method_create(key, klass, mid, depth, source_file, line);
-            method->base = base_method;
-            method_info_table_insert(thread_data->method_info_table, key, method);
-          }
-        }
+      #if defined(MEASURE_PERF_EVENTS)
+      case MEASURE_TASK_CLOCK:
+      case MEASURE_PAGE_FAULTS:
+      case MEASURE_CONTEXT_SWITCHES:
+      case MEASURE_INSTRUCTIONS:
+      case MEASURE_CPU_CYCLES:
+      case MEASURE_CACHE_MISSES:
+      case MEASURE_BRANCH_MISSES:
+        perf_select(mode);
+        measurement->measure = measure_perf_event;
+        measurement->convert = mode == MEASURE_TASK_CLOCK ? convert_perf_time : convert_perf_count;
+        break;
+      #endif
+
+      #if defined(MEASURE_ALLOCATIONS)
+      case MEASURE_ALLOCATIONS:
+        measurement->measure = measure_allocations;
+        measurement->convert = convert_allocations;
+        break;
+      #endif
+        
+      #if defined(MEASURE_MEMORY)
+      case MEASURE_MEMORY:
+        measurement->measure = measure_memory;
+        measurement->convert = convert_memory;
+        break;
+      #endif
+
+      #if defined(MEASURE_GC_RUNS)
+      case MEASURE_GC_RUNS:
+        measurement->measure = measure_gc_runs;
+        measurement->convert = convert_gc_runs;
+        break;
+      #endif
 
-        /* Push a new frame onto the stack */
-        frame = stack_push(thread_data->stack);
-        frame->method = method;
-        frame->start_time = now;
-        frame->wait_time = 0;
-        frame->child_time = 0;
-        frame->line = rb_sourceline();
+      #if defined(MEASURE_GC_TIME)
+      case MEASURE_GC_TIME:
+        measurement->measure = measure_gc_time;
+        measurement->convert = convert_gc_time;
+        break;
+      #endif
 
+      default:
+        rb_raise(rb_eArgError, "invalid mode: %ld", mode);
         break;
     }
-    case RUBY_EVENT_RETURN:
-    case RUBY_EVENT_C_RETURN:
+
+    measurement->mode = mode;
+    measurement->per_thread = 0;
+    measurement->scale = 0;
+#if defined(RUBY_VM)
+    /* Ruby 1.8's threads all run on one native thread, so they
+       share its clock. */
+#if defined(MEASURE_THREAD_TIME)
+    if (mode == MEASURE_THREAD_TIME)
+      measurement->per_thread = 1;
+#endif
+#if defined(MEASURE_PERF_EVENTS)
+    if (PERF_MODE(mode))
+      measurement->per_thread = 1;
+#endif
+#endif
+}
+
+/* call-seq:
+   measure_mode -> measure_mode
+   
+   Returns what ruby-prof is measuring.  Valid values include:
+   
+   *RubyProf::PROCESS_TIME - Measure process time.  This is default.  It is implemented using the clock functions in the C Runtime library.
+   *RubyProf::WALL_TIME - Measure wall time using gettimeofday on Linx and GetLocalTime on Windows
+   *RubyProf::MONOTONIC_TIME - Measure wall time in nanoseconds using the monotonic clock, which isn't affected by changes to the system time.  This requires clock_gettime.
+   *RubyProf::THREAD_TIME - Measure the cpu time used by each thread, in nanoseconds.  Since a thread's clock stops while it waits, wait times are not measured.  This requires clock_gettime and CLOCK_THREAD_CPUTIME_ID.
+   *RubyProf::CPU_TIME - Measure time using the CPU clock counter.  This mode is only supported on x86, x86_64 or PowerPC platforms. 
+   *RubyProf::TASK_CLOCK, RubyProf::PAGE_FAULTS, RubyProf::CONTEXT_SWITCHES - Count the thread's cpu time, page faults or context switches with Linux's perf events.
+   *RubyProf::INSTRUCTIONS, RubyProf::CPU_CYCLES, RubyProf::CACHE_MISSES, RubyProf::BRANCH_MISSES - Count the thread's hardware events with Linux's perf events.  These need access to the cpu's performance counters, see RubyProf.perf_event_supported?.
+   *RubyProf::ALLOCATIONS - Measure object allocations.  This requires a patched Ruby interpreter.
+   *RubyProf::MEMORY - Measure memory size.  This requires a patched Ruby interpreter.
+   *RubyProf::GC_RUNS - Measure number of garbage collections.  This requires a patched Ruby interpreter.
+   *RubyProf::GC_TIME - Measure time spent doing garbage collection.  This requires a patched Ruby interpreter.*/
+static VALUE
+prof_get_measure_mode(VALUE self)
+{
+    return INT2NUM(measure_mode);
+}
+
+/* call-seq:
+   measure_mode=value -> void
+   
+   Specifies what ruby-prof should measure.  Valid values include:
+   
+   *RubyProf::PROCESS_TIME - Measure process time.  This is default.  It is implemented using the clock functions in the C Runtime library.
+   *RubyProf::WALL_TIME - Measure wall time using gettimeofday on Linx and GetLocalTime on Windows
+   *RubyProf::MONOTONIC_TIME - Measure wall time in nanoseconds using the monotonic clock, which isn't affected by changes to the system time.  This requires clock_gettime.
+   *RubyProf::THREAD_TIME - Measure the cpu time used by each thread, in nanoseconds.  Since a thread's clock stops while it waits, wait times are not measured.  This requires clock_gettime and CLOCK_THREAD_CPUTIME_ID.
+   *RubyProf::CPU_TIME - Measure time using the CPU clock counter.  This mode is only supported on x86, x86_64 or PowerPC platforms. 
+   *RubyProf::TASK_CLOCK, RubyProf::PAGE_FAULTS, RubyProf::CONTEXT_SWITCHES - Count the thread's cpu time, page faults or context switches with Linux's perf events.
+   *RubyProf::INSTRUCTIONS, RubyProf::CPU_CYCLES, RubyProf::CACHE_MISSES, RubyProf::BRANCH_MISSES - Count the thread's hardware events with Linux's perf events.  These need access to the cpu's performance counters, see RubyProf.perf_event_supported?.
+   *RubyProf::ALLOCATIONS - Measure object allocations.  This requires a patched Ruby interpreter.
+   *RubyProf::MEMORY - Measure memory size.  This requires a patched Ruby interpreter.
+   *RubyProf::GC_RUNS - Measure number of garbage collections.  This requires a patched Ruby interpreter.
+   *RubyProf::GC_TIME - Measure time spent doing garbage collection.  This requires a patched Ruby interpreter.*/
+static VALUE
+prof_set_measure_mode(VALUE self, VALUE val)
+{
+    long mode = NUM2LONG(val);
+    prof_measurement_t measurement;
+
+    if (threads_tbl)
     {
-        prof_frame_t* caller_frame = NULL;
+      rb_raise(rb_eRuntimeError, "can't set measure_mode while profiling");
+    }
 
-        prof_measure_t total_time;
+    measurement_init(&measurement, mode);
 
-        frame = stack_pop(thread_data->stack);
-        caller_frame = stack_peek(thread_data->stack);
-          
-        /* Frame can be null.  This can happen if RubProf.start is called from
-           a method that exits.  And it can happen if an exception is raised
-           in code that is being profiled and the stack unwinds (RubProf is
-           not notified of that by the ruby runtime. */
-        if (frame == NULL) return;
+#if defined(MEASURE_PERF_EVENTS)
+    if (!PERF_MODE(mode))
+      perf_close_counters();
+#endif
+
+    measure_mode = mode;
+    get_measurement = measurement.measure;
+    convert_measurement = measurement.convert;
+    measure_per_thread = measurement.per_thread;
+    extra_measurement_count = 0;
+    return val;
+}
 
-        total_time = now - frame->start_time;
+/* call-seq:
+   measure_modes -> [measure_mode, ...]
 
-        if (caller_frame)
-        {
-            caller_frame->child_time += total_time;
-        }
-          
-        frame->method->base->active_frame--;
-        
-        update_result(thread_data, total_time, caller_frame, frame);
-        break;
+   Returns the measure modes that will be recorded.  The first is
+   measure_mode. */
+static VALUE
+prof_get_measure_modes(VALUE self)
+{
+    VALUE result = rb_ary_new();
+    int i;
+
+    rb_ary_push(result, INT2NUM(measure_mode));
+    for (i = 0; i < extra_measurement_count; i++)
+      rb_ary_push(result, INT2NUM(extra_measurements[i].mode));
+    return result;
+}
+
+/* call-seq:
+   measure_modes=[measure_mode, ...] -> void
+
+   Records several measurements in one profiling run, for example
+
+     RubyProf.measure_modes = [RubyProf::WALL_TIME, RubyProf::PROCESS_TIME, RubyProf::ALLOCATIONS]
+
+   Up to four measure modes may be given, see measure_mode= for the
+   modes.  The first becomes measure_mode.  Use Result#measure_mode=
+   to choose which measurement the results report.  Only one perf
+   event mode can be recorded at a time, and the extra measurements
+   can't be combined with deferred aggregation or sampling.  Setting
+   measure_mode goes back to recording one measurement.*/
+static VALUE
+prof_set_measure_modes(VALUE self, VALUE val)
+{
+    VALUE modes = rb_Array(val);
+    long count = RARRAY_LEN(modes);
+    long mode_values[PROF_MAX_MEASUREMENTS];
+    prof_measurement_t measurements[PROF_MAX_MEASUREMENTS];
+    long i, j;
+#if defined(MEASURE_PERF_EVENTS)
+    int perf_modes = 0;
+#endif
+
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set measure_modes while profiling");
+    }
+
+    if (count < 1 || count > PROF_MAX_MEASUREMENTS)
+      rb_raise(rb_eArgError, "between 1 and %d measure modes can be recorded", PROF_MAX_MEASUREMENTS);
+
+    /* Check the whole list before changing any state */
+    for (i = 0; i < count; i++)
+    {
+      mode_values[i] = NUM2LONG(rb_ary_entry(modes, i));
+      for (j = 0; j < i; j++)
+      {
+        if (mode_values[i] == mode_values[j])
+          rb_raise(rb_eArgError, "measure mode %ld given twice", mode_values[i]);
       }
+#if defined(MEASURE_PERF_EVENTS)
+      if (PERF_MODE(mode_values[i]) && ++perf_modes > 1)
+        rb_raise(rb_eArgError, "only one perf event mode can be recorded at a time");
+#endif
+    }
+
+    /* Find each mode's functions, which raises if a mode isn't
+       supported.  Selecting a perf event switches the counters over
+       to it, so that is done last, once every other mode is known
+       to be valid. */
+    for (i = 0; i < count; i++)
+    {
+#if defined(MEASURE_PERF_EVENTS)
+      if (PERF_MODE(mode_values[i]))
+        continue;
+#endif
+      measurement_init(&measurements[i], mode_values[i]);
+    }
+#if defined(MEASURE_PERF_EVENTS)
+    for (i = 0; i < count; i++)
+    {
+      if (PERF_MODE(mode_values[i]))
+        measurement_init(&measurements[i], mode_values[i]);
     }
+    if (perf_modes == 0)
+      perf_close_counters();
+#endif
+
+    measure_mode = mode_values[0];
+    get_measurement = measurements[0].measure;
+    convert_measurement = measurements[0].convert;
+    measure_per_thread = measurements[0].per_thread;
+    MEMCPY(extra_measurements, measurements + 1, prof_measurement_t, count - 1);
+    extra_measurement_count = count - 1;
+    return val;
 }
 
+/* call-seq:
+   deferred_aggregation? -> boolean
 
-/* ========  ProfResult ============== */
+   Returns whether aggregation of profiling data is deferred until
+   profiling stops.*/
+static VALUE
+prof_get_deferred_aggregation(VALUE self)
+{
+    return deferred_aggregation ? Qtrue : Qfalse;
+}
 
-/* Document-class: RubyProf::Result
-The RubyProf::Result class is used to store the results of a 
-profiling run.  And instace of the class is returned from
-the methods RubyProf#stop and RubyProf#profile.
+/* call-seq:
+   deferred_aggregation=value -> void
+
+   Specifies whether ruby-prof should defer aggregating profiling data.
+   Normally ruby-prof updates its methods and call graph as each method
+   is called and returns.  When aggregation is deferred, the events are
+   just recorded into a buffer for each thread and are aggregated when
+   the buffer fills up and when profiling stops.  This moves most of the
+   profiler's work out of the profiled code, which makes timings of short
+   sections of code less distorted.  The results are the same.*/
+static VALUE
+prof_set_deferred_aggregation(VALUE self, VALUE val)
+{
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set deferred_aggregation while profiling");
+    }
 
-RubyProf::Result has one field, called threads, which is a hash
-table keyed on thread ID.  For each thread id, the hash table
-stores another hash table that contains profiling information
-for each method called during the threads execution.  That
-hash table is keyed on method name and contains
-RubyProf::MethodInfo objects. */
+    deferred_aggregation = RTEST(val);
+    return val;
+}
 
+#ifdef PROF_SAMPLING
+/* call-seq:
+   sampling? -> boolean
 
-static void
-prof_result_mark(prof_result_t *prof_result)
+   Returns whether ruby-prof samples the stack instead of tracing
+   every call.*/
+static VALUE
+prof_get_sampling(VALUE self)
 {
-    VALUE threads = prof_result->threads;
-    rb_gc_mark(threads);
+    return sampling ? Qtrue : Qfalse;
 }
 
-static void
-prof_result_free(prof_result_t *prof_result)
+/* call-seq:
+   sampling=value -> void
+
+   Specifies whether ruby-prof should sample the stack instead of
+   tracing every call.  A sampling profile interrupts the program
+   every sample_interval microseconds of cpu time and records the
+   stack of the running thread, which has much less overhead than
+   tracing.  The results have the same shape as a tracing profile,
+   but times are statistical estimates, a method's called count is
+   the number of times it was seen being entered and its line is the
+   first line it was seen running.  Since samples
+   are taken on cpu time, PROCESS_TIME is the natural measure mode.
+
+   Sampling is only available on ruby 1.8.*/
+static VALUE
+prof_set_sampling(VALUE self, VALUE val)
 {
-    prof_result->threads = Qnil;
-    xfree(prof_result);
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set sampling while profiling");
+    }
+
+    sampling = RTEST(val);
+    return val;
 }
 
+/* call-seq:
+   sample_interval -> interval
+
+   Returns the sampling interval in microseconds.*/
 static VALUE
-prof_result_new()
+prof_get_sample_interval(VALUE self)
 {
-    prof_result_t *prof_result = ALLOC(prof_result_t);
-
-    /* Wrap threads in Ruby regular Ruby hash table. */
-    prof_result->threads = rb_hash_new();
-    st_foreach(threads_tbl, collect_threads, prof_result->threads);
-
-    return Data_Wrap_Struct(cResult, prof_result_mark, prof_result_free, prof_result);
+    return LONG2NUM(sample_interval);
 }
 
+/* call-seq:
+   sample_interval=interval -> void
 
-static prof_result_t *
-get_prof_result(VALUE obj)
+   Specifies the sampling interval in microseconds.  The default
+   is 1000, or 1000 samples per second of cpu time.*/
+static VALUE
+prof_set_sample_interval(VALUE self, VALUE val)
 {
-    if (BUILTIN_TYPE(obj) != T_DATA ||
-      RDATA(obj)->dfree != (RUBY_DATA_FUNC) prof_result_free)
+    long interval = NUM2LONG(val);
+
+    if (threads_tbl)
     {
-        /* Should never happen */
-      rb_raise(rb_eTypeError, "wrong result object");
+      rb_raise(rb_eRuntimeError, "can't set sample_interval while profiling");
     }
-    return (prof_result_t *) DATA_PTR(obj);
+    if (interval <= 0)
+    {
+      rb_raise(rb_eArgError, "invalid sample interval: %ld", interval);
+    }
+
+    sample_interval = interval;
+    return val;
 }
+#endif
 
 /* call-seq:
-   threads -> Hash
+   trace_lines? -> boolean
 
-Returns a hash table keyed on thread ID.  For each thread id,
-the hash table stores another hash table that contains profiling
-information for each method called during the threads execution.
-That hash table is keyed on method name and contains 
-RubyProf::MethodInfo objects. */
+   Returns whether ruby-prof traces line events.*/
 static VALUE
-prof_result_threads(VALUE self)
+prof_get_trace_lines(VALUE self)
 {
-    prof_result_t *prof_result = get_prof_result(self);
-    return prof_result->threads;
+    return trace_lines ? Qtrue : Qfalse;
 }
 
+/* call-seq:
+   trace_lines=value -> void
+
+   Specifies whether ruby-prof should trace line events.  By default
+   ruby-prof is notified of every line ruby executes so that it knows
+   which line each method was called from.  That is by far the most
+   common event, so turning it off makes profiling considerably
+   cheaper.  Instead, the line a method was called from is looked up
+   when it is called.  The trade-offs are:
+
+   * On ruby 1.9 only calls to c functions get the right line.  Calls
+     to ruby methods get the caller's line at its previous call.
+   * A thread's call graph starts at the first method called after
+     profiling starts rather than the method that was running, so a
+     thread can have more than one top level method.*/
+static VALUE
+prof_set_trace_lines(VALUE self, VALUE val)
+{
+    if (threads_tbl)
+    {
+      rb_raise(rb_eRuntimeError, "can't set trace_lines while profiling");
+    }
 
+    trace_lines = RTEST(val);
+    return val;
+}
 
+#ifdef PROF_FIBERS
 /* call-seq:
-   measure_mode -> measure_mode
-   
-   Returns what ruby-prof is measuring.  Valid values include:
-   
-   *RubyProf::PROCESS_TIME - Measure process time.  This is default.  It is implemented using the clock functions in the C Runtime library.
-   *RubyProf::WALL_TIME - Measure wall time using gettimeofday on Linx and GetLocalTime on Windows
-   *RubyProf::CPU_TIME - Measure time using the CPU clock counter.  This mode is only supported on Pentium or PowerPC platforms. 
-   *RubyProf::ALLOCATIONS - Measure object allocations.  This requires a patched Ruby interpreter.
-   *RubyProf::MEMORY - Measure memory size.  This requires a patched Ruby interpreter.
-   *RubyProf::GC_RUNS - Measure number of garbage collections.  This requires a patched Ruby interpreter.
-   *RubyProf::GC_TIME - Measure time spent doing garbage collection.  This requires a patched Ruby interpreter.*/
+   merge_fibers? -> boolean
+
+   Returns whether fibers are reported as part of their thread.*/
 static VALUE
-prof_get_measure_mode(VALUE self)
+prof_get_merge_fibers(VALUE self)
 {
-    return INT2NUM(measure_mode);
+    return merge_fibers ? Qtrue : Qfalse;
 }
 
 /* call-seq:
-   measure_mode=value -> void
-   
-   Specifies what ruby-prof should measure.  Valid values include:
-   
-   *RubyProf::PROCESS_TIME - Measure process time.  This is default.  It is implemented using the clock functions in the C Runtime library.
-   *RubyProf::WALL_TIME - Measure wall time using gettimeofday on Linx and GetLocalTime on Windows
-   *RubyProf::CPU_TIME - Measure time using the CPU clock counter.  This mode is only supported on Pentium or PowerPC platforms. 
-   *RubyProf::ALLOCATIONS - Measure object allocations.  This requires a patched Ruby interpreter.
-   *RubyProf::MEMORY - Measure memory size.  This requires a patched Ruby interpreter.
-   *RubyProf::GC_RUNS - Measure number of garbage collections.  This requires a patched Ruby interpreter.
-   *RubyProf::GC_TIME - Measure time spent doing garbage collection.  This requires a patched Ruby interpreter.*/
+   merge_fibers=value -> void
+
+   Specifies whether fibers are reported as part of the thread that
+   created them.  Each fiber has its own stack, so by default a fiber
+   is reported like a thread, keyed on the fiber's object id in
+   RubyProf::Result#threads, and the time it is suspended counts as
+   wait time.  When fibers are merged the methods they call are
+   added to their thread's methods.  A method running in several
+   fibers at once is then reported as a recursive call.*/
 static VALUE
-prof_set_measure_mode(VALUE self, VALUE val)
+prof_set_merge_fibers(VALUE self, VALUE val)
 {
-    long mode = NUM2LONG(val);
-
     if (threads_tbl)
     {
-      rb_raise(rb_eRuntimeError, "can't set measure_mode while profiling");
+      rb_raise(rb_eRuntimeError, "can't set merge_fibers while profiling");
     }
 
-    switch (mode) {
-      case MEASURE_PROCESS_TIME:
-        get_measurement = measure_process_time;
-        convert_measurement = convert_process_time;
-        break;
-        
-      case MEASURE_WALL_TIME:
-        get_measurement = measure_wall_time;
-        convert_measurement = convert_wall_time;
-        break;
-        
-      #if defined(MEASURE_CPU_TIME)
-      case MEASURE_CPU_TIME:
-        if (cpu_frequency == 0)
-            cpu_frequency = measure_cpu_time();
-        get_measurement = measure_cpu_time;
-        convert_measurement = convert_cpu_time;
-        break;
-      #endif
-              
-      #if defined(MEASURE_ALLOCATIONS)
-      case MEASURE_ALLOCATIONS:
-        get_measurement = measure_allocations;
-        convert_measurement = convert_allocations;
-        break;
-      #endif
-        
-      #if defined(MEASURE_MEMORY)
-      case MEASURE_MEMORY:
-        get_measurement = measure_memory;
-        convert_measurement = convert_memory;
-        break;
-      #endif
-
-      #if defined(MEASURE_GC_RUNS)
-      case MEASURE_GC_RUNS:
-        get_measurement = measure_gc_runs;
-        convert_measurement = convert_gc_runs;
-        break;
-      #endif
-
-      #if defined(MEASURE_GC_TIME)
-      case MEASURE_GC_TIME:
-        get_measurement = measure_gc_time;
-        convert_measurement = convert_gc_time;
-        break;
-      #endif
-
-      default:
-        rb_raise(rb_eArgError, "invalid mode: %d", mode);
-        break;
-    }
-    
-    measure_mode = mode;
+    merge_fibers = RTEST(val);
     return val;
 }
+#endif
 
 /* =========  Profiling ============= */
 void
 prof_install_hook()
 {
+    rb_event_flag_t events = RUBY_EVENT_CALL | RUBY_EVENT_RETURN |
+                             RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN |
+                             RUBY_EVENT_RAISE;
+
+    if (trace_lines)
+      events |= RUBY_EVENT_LINE;
+
 #ifdef RUBY_VM
-    rb_add_event_hook(prof_event_hook,
-          RUBY_EVENT_CALL | RUBY_EVENT_RETURN |
-          RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN 
-          | RUBY_EVENT_LINE, Qnil);
+    rb_add_event_hook(prof_event_hook, events, Qnil);
 #else
-    rb_add_event_hook(prof_event_hook,
-          RUBY_EVENT_CALL | RUBY_EVENT_RETURN |
-          RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN 
-          | RUBY_EVENT_LINE);
+#ifdef PROF_SAMPLING
+    if (sampling)
+      sampler_start(sample_interval);
+    else
+#endif
+    rb_add_event_hook(prof_event_hook, events);
 #endif
 
 #if defined(TOGGLE_GC_STATS)
@@ -1495,6 +4010,11 @@ prof_remove_hook()
 #endif
 
     /* Now unregister from event   */
+#ifdef PROF_SAMPLING
+    if (sampling)
+      sampler_stop();
+    else
+#endif
     rb_remove_event_hook(prof_event_hook);
 }
 
@@ -1525,9 +4045,39 @@ prof_start(VALUE self)
         rb_raise(rb_eRuntimeError, "RubyProf.start was already called");
     }
 
+    if (extra_measurement_count > 0 && deferred_aggregation)
+    {
+        rb_raise(rb_eRuntimeError, "can't record several measure modes with deferred aggregation");
+    }
+#ifdef PROF_SAMPLING
+    if (extra_measurement_count > 0 && sampling)
+    {
+        rb_raise(rb_eRuntimeError, "can't record several measure modes while sampling");
+    }
+#endif
+
+    /* Measure the cost of an event before there is any profiling data */
+    event_overhead = 0;
+    if (compensate_overhead)
+      event_overhead = prof_calibrate();
+#ifdef PROF_SAMPLING
+    /* Samples aren't events */
+    if (sampling)
+      event_overhead = 0;
+#endif
+
+    /* Decide the classes named by filters, which may raise */
+    filter_compile();
+
     /* Setup globals */
     last_thread_data = NULL;
     threads_tbl = threads_table_create();
+    arena = prof_arena_create();
+    registry = prof_registry_create();
+#ifdef PROF_SAMPLING
+    if (sampling)
+      sampler_create_buffers();
+#endif
     prof_install_hook();              
     return self;
 }    
@@ -1572,6 +4122,350 @@ prof_resume(VALUE self)
     return self;
 }
 
+/* ================  Snapshots   =================*/
+
+/* RubyProf.snapshot copies the profile into a result while profiling
+   goes on.  The copy gets its own arena and a copy of the registry.
+   Its methods on the stacks are then returned from, as of the time of
+   the snapshot, so methods that are still running are included.  With
+   a reset the profile's counters are zeroed instead of being freed and
+   its frames start over, so that consecutive snapshots add up to the
+   whole profile. */
+typedef struct {
+    prof_arena_t *arena;
+    prof_registry_t *registry;
+    st_table *threads_tbl;      /* The copies, keyed like threads_tbl */
+    st_table *copies;           /* Each thread data's and method's copy */
+    prof_measure_t now;
+    prof_measure_t extra_now[PROF_MAX_EXTRA_MEASUREMENTS];
+} prof_snapshot_t;
+
+/* Returns the time, and sets the extra measurements, at which a
+   thread's running methods are cut off.  Only the running thread's
+   clock can be read, so a thread that measures its own time and isn't
+   running is cut off at its last call. */
+static prof_measure_t
+snapshot_thread_now(prof_snapshot_t *snapshot, thread_data_t *thread_data,
+                    prof_measure_t *extra_now)
+{
+    prof_frame_t *frame = stack_peek(thread_data->stack);
+    int running = (thread_data == last_thread_data);
+    int i;
+
+    for (i = 0; i < extra_measurement_count; i++)
+      extra_now[i] = (running || !extra_measurements[i].per_thread ?
+                      snapshot->extra_now[i] : thread_data->extra_now[i]);
+
+#ifdef PROF_SAMPLING
+    if (sampling)
+      return thread_data->sample_time;
+#endif
+    if (running || !measure_per_thread)
+      return snapshot->now;
+    return frame ? frame->start_time : 0;
+}
+
+/* How long a thread that isn't running has been waiting */
+static prof_measure_t
+snapshot_thread_wait(prof_snapshot_t *snapshot, thread_data_t *thread_data)
+{
+#ifdef PROF_SAMPLING
+    if (sampling)
+      return 0;
+#endif
+    if (thread_data == last_thread_data || measure_per_thread || !thread_data->last_switch)
+      return 0;
+    return snapshot->now - thread_data->last_switch;
+}
+
+static prof_method_t *
+snapshot_method(prof_snapshot_t *snapshot, prof_method_t *method)
+{
+    thread_data_t *thread_data;
+    prof_method_t *copy;
+    st_data_t val;
+
+    if (st_lookup(snapshot->copies, (st_data_t) method, &val))
+      return (prof_method_t *) val;
+
+    st_lookup(snapshot->copies, (st_data_t) method->thread, &val);
+    thread_data = (thread_data_t *) val;
+
+    copy = prof_method_create(thread_data, &method->key);
+    copy->called = method->called;
+    copy->total_time = method->total_time;
+    copy->self_time = method->self_time;
+    copy->wait_time = method->wait_time;
+    copy->total_overhead = method->total_overhead;
+    copy->self_overhead = method->self_overhead;
+    if (copy->extra_times)
+      MEMCPY(copy->extra_times, method->extra_times, prof_times_t, extra_measurement_count);
+    copy->active_frame = method->active_frame;
+    st_insert(snapshot->copies, (st_data_t) method, (st_data_t) copy);
+    method_info_table_insert(thread_data->method_info_table, &copy->key, copy);
+
+    if (method->base != method)
+      copy->base = snapshot_method(snapshot, method->base);
+    return copy;
+}
+
+static int
+snapshot_replay_events(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    if (thread_data->events)
+      thread_data_replay_events(thread_data);
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_thread_create(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_snapshot_t *snapshot = (prof_snapshot_t *) data;
+    thread_data_t* copy;
+
+    if (thread_data->excluded)
+      return ST_CONTINUE;
+
+    copy = thread_data_create_detached(snapshot->arena, snapshot->registry, thread_data->thread_id);
+    copy->overhead_carry = thread_data->overhead_carry;
+    st_insert(snapshot->copies, (st_data_t) thread_data, (st_data_t) copy);
+    st_insert(snapshot->threads_tbl, key, (st_data_t) copy);
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_recorded_method(prof_method_key_t *key, void *value, void *data)
+{
+    prof_method_t *method = (prof_method_t *) value;
+
+    /* Methods that have no calls since a reset are left out, unless
+       they are running, which snapshot_thread_close takes care of. */
+    if (method->called > 0)
+      snapshot_method((prof_snapshot_t *) data, method);
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_thread_copy(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_snapshot_t *snapshot = (prof_snapshot_t *) data;
+    prof_call_info_chunk_t *chunk;
+    thread_data_t* copy;
+    st_data_t val;
+    int i;
+
+    if (!st_lookup(snapshot->copies, (st_data_t) thread_data, &val))
+      return ST_CONTINUE;
+    copy = (thread_data_t *) val;
+
+    st_lookup(snapshot->copies, (st_data_t) thread_data->owner, &val);
+    copy->owner = (thread_data_t *) val;
+
+    /* A merged fiber's methods belong to its thread */
+    if (thread_data->owner != thread_data)
+      return ST_CONTINUE;
+
+    prof_table_foreach(thread_data->method_info_table, snapshot_recorded_method, snapshot);
+
+    for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+    {
+        for (i = 0; i < chunk->used; i++)
+        {
+            prof_call_info_t *call_info = &chunk->call_infos[i];
+            prof_call_info_t *call_info_copy;
+            prof_method_t *parent;
+
+            if (call_info->called == 0)
+              continue;
+
+            parent = snapshot_method(snapshot, call_info->parent);
+            call_info_copy = call_info_create(copy, parent, snapshot_method(snapshot, call_info->child));
+            call_info_copy->called = call_info->called;
+            call_info_copy->total_time = call_info->total_time;
+            call_info_copy->self_time = call_info->self_time;
+            call_info_copy->wait_time = call_info->wait_time;
+            if (call_info_copy->extra_times)
+              MEMCPY(call_info_copy->extra_times, call_info->extra_times, prof_times_t, extra_measurement_count);
+            call_info_copy->line = call_info->line;
+            caller_table_insert(parent->call_infos, &call_info_copy->child->key, call_info_copy);
+        }
+    }
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_thread_close(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_snapshot_t *snapshot = (prof_snapshot_t *) data;
+    prof_stack_t *stack = thread_data->stack;
+    prof_frame_t *frame;
+    thread_data_t* copy;
+    prof_measure_t now;
+    st_data_t val;
+    int i;
+
+    if (!st_lookup(snapshot->copies, (st_data_t) thread_data, &val))
+      return ST_CONTINUE;
+    copy = (thread_data_t *) val;
+
+    for (frame = stack->start; frame < stack->ptr; frame++)
+    {
+      prof_frame_t *frame_copy = stack_push(copy->stack);
+      *frame_copy = *frame;
+      frame_copy->method = snapshot_method(snapshot, frame->method);
+      frame_call_info_cache_clear(frame_copy);
+    }
+
+    now = snapshot_thread_now(snapshot, thread_data, copy->extra_now);
+    frame = stack_peek(copy->stack);
+    if (frame)
+    {
+      frame->wait_time += snapshot_thread_wait(snapshot, thread_data);
+      for (i = 0; i < extra_measurement_count; i++)
+      {
+        if (thread_data != last_thread_data && !extra_measurements[i].per_thread)
+          frame->extra_wait[i] += copy->extra_now[i] - thread_data->extra_last_switch[i];
+      }
+    }
+
+    /* Return from the running methods, leaving the outermost frame
+       like RubyProf.stop does */
+    while (stack_size(copy->stack) > 1)
+      prof_return(copy, now);
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_reset_method(prof_method_key_t *key, void *value, void *data)
+{
+    prof_method_t *method = (prof_method_t *) value;
+
+    method->called = 0;
+    method->total_time = 0;
+    method->self_time = 0;
+    method->wait_time = 0;
+    method->total_overhead = 0;
+    method->self_overhead = 0;
+    if (method->extra_times)
+      MEMZERO(method->extra_times, prof_times_t, extra_measurement_count);
+    return ST_CONTINUE;
+}
+
+static int
+snapshot_reset_thread(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*) value;
+    prof_snapshot_t *snapshot = (prof_snapshot_t *) data;
+    prof_stack_t *stack = thread_data->stack;
+    prof_call_info_chunk_t *chunk;
+    prof_measure_t extra_now[PROF_MAX_EXTRA_MEASUREMENTS];
+    prof_measure_t now = snapshot_thread_now(snapshot, thread_data, extra_now);
+    prof_frame_t *frame;
+    int i;
+
+    if (thread_data->owner == thread_data)
+    {
+      prof_table_foreach(thread_data->method_info_table, snapshot_reset_method, NULL);
+
+      for (chunk = thread_data->call_infos; chunk; chunk = chunk->next)
+      {
+        for (i = 0; i < chunk->used; i++)
+        {
+          prof_call_info_t *call_info = &chunk->call_infos[i];
+          call_info->called = 0;
+          call_info->total_time = 0;
+          call_info->self_time = 0;
+          call_info->wait_time = 0;
+          if (call_info->extra_times)
+            MEMZERO(call_info->extra_times, prof_times_t, extra_measurement_count);
+        }
+      }
+    }
+
+    /* The running methods start over, and waiting threads have
+       waited since the snapshot. */
+    for (frame = stack->start; frame < stack->ptr; frame++)
+    {
+      frame->start_time = now;
+      frame->wait_time = 0;
+      frame->child_time = 0;
+      frame->child_overhead = 0;
+      frame->events = 0;
+      for (i = 0; i < extra_measurement_count; i++)
+      {
+        frame->extra_start[i] = extra_now[i];
+        frame->extra_wait[i] = 0;
+        frame->extra_child[i] = 0;
+      }
+    }
+
+    if (snapshot_thread_wait(snapshot, thread_data))
+      thread_data->last_switch = now;
+    for (i = 0; i < extra_measurement_count; i++)
+    {
+      if (thread_data != last_thread_data && !extra_measurements[i].per_thread)
+        thread_data->extra_last_switch[i] = extra_now[i];
+    }
+    return ST_CONTINUE;
+}
+
+/* call-seq:
+   snapshot(reset = false) -> RubyProf::Result
+
+Returns the results so far without stopping the profiler.  Methods
+that are still running are included as if they had returned at the
+time of the snapshot.  If reset is true the profile starts over from
+the snapshot, so each snapshot only covers the time since the previous
+one.  Methods that weren't called since a reset are left out of the
+next snapshot, but not out of the result of RubyProf.stop. */
+static VALUE
+prof_snapshot(int argc, VALUE *argv, VALUE self)
+{
+    prof_snapshot_t snapshot;
+    VALUE reset;
+    int i;
+
+    rb_scan_args(argc, argv, "01", &reset);
+
+    if (threads_tbl == NULL)
+    {
+        rb_raise(rb_eRuntimeError, "RubyProf is not running.");
+    }
+
+    snapshot.now = get_measurement();
+    for (i = 0; i < extra_measurement_count; i++)
+      snapshot.extra_now[i] = extra_measurements[i].measure();
+
+#ifdef PROF_SAMPLING
+    if (sampling)
+    {
+      sigset_t mask;
+      sampler_block(&mask);
+      sampler_replay();
+      sampler_unblock(&mask);
+    }
+#endif
+    st_foreach(threads_tbl, snapshot_replay_events, 0);
+
+    snapshot.arena = prof_arena_create();
+    snapshot.registry = prof_registry_copy(registry);
+    snapshot.threads_tbl = threads_table_create();
+    snapshot.copies = st_init_numtable();
+    st_foreach(threads_tbl, snapshot_thread_create, (st_data_t) &snapshot);
+    st_foreach(threads_tbl, snapshot_thread_copy, (st_data_t) &snapshot);
+    st_foreach(threads_tbl, snapshot_thread_close, (st_data_t) &snapshot);
+    st_free_table(snapshot.copies);
+
+    if (RTEST(reset))
+      st_foreach(threads_tbl, snapshot_reset_thread, (st_data_t) &snapshot);
+
+    return prof_result_new(snapshot.threads_tbl, snapshot.arena, snapshot.registry);
+}
+
 /* call-seq:
    stop -> RubyProf::Result
 
@@ -1583,14 +4477,25 @@ prof_stop(VALUE self)
     
     prof_remove_hook();
 
+#ifdef PROF_SAMPLING
+    if (sampling)
+      sampler_aggregate();
+#endif
+
     /* Create the result */
-    result = prof_result_new();
+    result = prof_result_new(threads_tbl, arena, registry);
 
-    /* Unset the last_thread_data (very important!) 
-       and the threads table */
+    /* Unset the last_thread_data (very important!) and the threads
+       table, arena and registry, which now belong to the result */
     last_thread_data = NULL;
-    threads_table_free(threads_tbl);
     threads_tbl = NULL;
+    arena = NULL;
+    registry = NULL;
+    filter_free();
+
+#if defined(MEASURE_PERF_EVENTS)
+    perf_stop();
+#endif
 
     return result;
 }
@@ -1603,7 +4508,7 @@ static VALUE
 prof_profile(VALUE self)
 {
     int result;
-    
+    
     if (!rb_block_given_p())
     {
         rb_raise(rb_eArgError, "A block must be provided to the profile method.");
@@ -1630,16 +4535,80 @@ Init_ruby_prof()
     rb_define_module_function(mProf, "pause", prof_pause, 0);
     rb_define_module_function(mProf, "running?", prof_running, 0);
     rb_define_module_function(mProf, "profile", prof_profile, 0);
+    rb_define_module_function(mProf, "snapshot", prof_snapshot, -1);
     
     rb_define_singleton_method(mProf, "measure_mode", prof_get_measure_mode, 0);
     rb_define_singleton_method(mProf, "measure_mode=", prof_set_measure_mode, 1);
+    rb_define_singleton_method(mProf, "measure_modes", prof_get_measure_modes, 0);
+    rb_define_singleton_method(mProf, "measure_modes=", prof_set_measure_modes, 1);
+    rb_define_singleton_method(mProf, "deferred_aggregation?", prof_get_deferred_aggregation, 0);
+    rb_define_singleton_method(mProf, "deferred_aggregation=", prof_set_deferred_aggregation, 1);
+    rb_define_singleton_method(mProf, "trace_lines?", prof_get_trace_lines, 0);
+    rb_define_singleton_method(mProf, "trace_lines=", prof_set_trace_lines, 1);
+    rb_define_singleton_method(mProf, "compensate_overhead?", prof_get_compensate_overhead, 0);
+    rb_define_singleton_method(mProf, "compensate_overhead=", prof_set_compensate_overhead, 1);
+    rb_define_singleton_method(mProf, "recursion_limit", prof_get_recursion_limit, 0);
+    rb_define_singleton_method(mProf, "recursion_limit=", prof_set_recursion_limit, 1);
+
+    rb_global_variable(&include_classes);
+    rb_global_variable(&filter_cache_marker);
+    rb_global_variable(&exclude_classes);
+    rb_global_variable(&include_threads);
+    rb_global_variable(&exclude_threads);
+    rb_define_singleton_method(mProf, "include_classes", prof_get_include_classes, 0); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "include_classes=", prof_set_include_classes, 1); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "exclude_classes", prof_get_exclude_classes, 0); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "exclude_classes=", prof_set_exclude_classes, 1); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "include_threads", prof_get_include_threads, 0); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "include_threads=", prof_set_include_threads, 1); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "exclude_threads", prof_get_exclude_threads, 0); /* in prof_filter.h */
+    rb_define_singleton_method(mProf, "exclude_threads=", prof_set_exclude_threads, 1); /* in prof_filter.h */
+#ifdef PROF_SAMPLING
+    rb_global_variable(&sampler_marker);
+    rb_define_singleton_method(mProf, "sampling?", prof_get_sampling, 0);
+    rb_define_singleton_method(mProf, "sampling=", prof_set_sampling, 1);
+    rb_define_singleton_method(mProf, "sample_interval", prof_get_sample_interval, 0);
+    rb_define_singleton_method(mProf, "sample_interval=", prof_set_sample_interval, 1);
+#endif
+#ifdef PROF_FIBERS
+    rb_define_singleton_method(mProf, "merge_fibers?", prof_get_merge_fibers, 0);
+    rb_define_singleton_method(mProf, "merge_fibers=", prof_set_merge_fibers, 1);
+
+    cFiber = rb_path2class("Fiber");
+    cFiberSingleton = rb_singleton_class(cFiber);
+    cEnumerator = rb_path2class("Enumerator");
+    id_resume = rb_intern("resume");
+    id_transfer = rb_intern("transfer");
+    id_yield = rb_intern("yield");
+    id_raise = rb_intern("raise");
+    id_kill = rb_intern("kill");
+    id_next = rb_intern("next");
+    id_peek = rb_intern("peek");
+    id_next_values = rb_intern("next_values");
+    id_peek_values = rb_intern("peek_values");
+#endif
 
     rb_define_const(mProf, "CLOCKS_PER_SEC", INT2NUM(CLOCKS_PER_SEC));
+    rb_define_const(mProf, "MAX_MEASURE_MODES", INT2NUM(PROF_MAX_MEASUREMENTS));
     rb_define_const(mProf, "PROCESS_TIME", INT2NUM(MEASURE_PROCESS_TIME));
     rb_define_singleton_method(mProf, "measure_process_time", prof_measure_process_time, 0); /* in measure_process_time.h */
     rb_define_const(mProf, "WALL_TIME", INT2NUM(MEASURE_WALL_TIME));
     rb_define_singleton_method(mProf, "measure_wall_time", prof_measure_wall_time, 0); /* in measure_wall_time.h */
 
+    #ifndef MEASURE_MONOTONIC_TIME
+    rb_define_const(mProf, "MONOTONIC_TIME", Qnil);
+    #else
+    rb_define_const(mProf, "MONOTONIC_TIME", INT2NUM(MEASURE_MONOTONIC_TIME));
+    rb_define_singleton_method(mProf, "measure_monotonic_time", prof_measure_monotonic_time, 0); /* in measure_monotonic_time.h */
+    #endif
+
+    #ifndef MEASURE_THREAD_TIME
+    rb_define_const(mProf, "THREAD_TIME", Qnil);
+    #else
+    rb_define_const(mProf, "THREAD_TIME", INT2NUM(MEASURE_THREAD_TIME));
+    rb_define_singleton_method(mProf, "measure_thread_time", prof_measure_thread_time, 0); /* in measure_thread_time.h */
+    #endif
+
     #ifndef MEASURE_CPU_TIME
     rb_define_const(mProf, "CPU_TIME", Qnil);
     #else
@@ -1647,8 +4616,29 @@ Init_ruby_prof()
     rb_define_singleton_method(mProf, "measure_cpu_time", prof_measure_cpu_time, 0); /* in measure_cpu_time.h */
     rb_define_singleton_method(mProf, "cpu_frequency", prof_get_cpu_frequency, 0); /* in measure_cpu_time.h */
     rb_define_singleton_method(mProf, "cpu_frequency=", prof_set_cpu_frequency, 1); /* in measure_cpu_time.h */
+    rb_define_singleton_method(mProf, "cpu_frequency_error", prof_get_cpu_frequency_error, 0); /* in measure_cpu_time.h */
+    rb_define_singleton_method(mProf, "cpu_clock_invariant?", prof_get_cpu_clock_invariant, 0); /* in measure_cpu_time.h */
     #endif
         
+    #ifndef MEASURE_PERF_EVENTS
+    rb_define_const(mProf, "TASK_CLOCK", Qnil);
+    rb_define_const(mProf, "PAGE_FAULTS", Qnil);
+    rb_define_const(mProf, "CONTEXT_SWITCHES", Qnil);
+    rb_define_const(mProf, "INSTRUCTIONS", Qnil);
+    rb_define_const(mProf, "CPU_CYCLES", Qnil);
+    rb_define_const(mProf, "CACHE_MISSES", Qnil);
+    rb_define_const(mProf, "BRANCH_MISSES", Qnil);
+    #else
+    rb_define_const(mProf, "TASK_CLOCK", INT2NUM(MEASURE_TASK_CLOCK));
+    rb_define_const(mProf, "PAGE_FAULTS", INT2NUM(MEASURE_PAGE_FAULTS));
+    rb_define_const(mProf, "CONTEXT_SWITCHES", INT2NUM(MEASURE_CONTEXT_SWITCHES));
+    rb_define_const(mProf, "INSTRUCTIONS", INT2NUM(MEASURE_INSTRUCTIONS));
+    rb_define_const(mProf, "CPU_CYCLES", INT2NUM(MEASURE_CPU_CYCLES));
+    rb_define_const(mProf, "CACHE_MISSES", INT2NUM(MEASURE_CACHE_MISSES));
+    rb_define_const(mProf, "BRANCH_MISSES", INT2NUM(MEASURE_BRANCH_MISSES));
+    rb_define_singleton_method(mProf, "perf_event_supported?", prof_perf_event_supported, 1); /* in measure_perf_event.h */
+    #endif
+
     #ifndef MEASURE_ALLOCATIONS
     rb_define_const(mProf, "ALLOCATIONS", Qnil);
     #else
@@ -1680,6 +4670,14 @@ Init_ruby_prof()
     cResult = rb_define_class_under(mProf, "Result", rb_cObject);
     rb_undef_method(CLASS_OF(cMethodInfo), "new");
     rb_define_method(cResult, "threads", prof_result_threads, 0);
+    rb_define_method(cResult, "allocation_stats", prof_result_allocation_stats, 0);
+    rb_define_method(cResult, "to_columns", prof_result_to_columns, 0);
+    rb_define_method(cResult, "dump", prof_result_dump, 1);
+    rb_define_singleton_method(cResult, "load", prof_result_load, 1);
+    rb_define_method(cResult, "event_overhead", prof_result_event_overhead, 0);
+    rb_define_method(cResult, "measure_modes", prof_result_measure_modes, 0);
+    rb_define_method(cResult, "measure_mode", prof_result_measure_mode, 0);
+    rb_define_method(cResult, "measure_mode=", prof_result_set_measure_mode, 1);
 
     cMethodInfo = rb_define_class_under(mProf, "MethodInfo", rb_cObject);
     rb_include_module(cMethodInfo, rb_mComparable);
@@ -1700,6 +4698,8 @@ Init_ruby_prof()
     rb_define_method(cMethodInfo, "called", prof_method_called, 0);
     rb_define_method(cMethodInfo, "total_time", prof_method_total_time, 0);
     rb_define_method(cMethodInfo, "self_time", prof_method_self_time, 0);
+    rb_define_method(cMethodInfo, "raw_total_time", prof_method_raw_total_time, 0);
+    rb_define_method(cMethodInfo, "raw_self_time", prof_method_raw_self_time, 0);
     rb_define_method(cMethodInfo, "wait_time", prof_method_wait_time, 0);
     rb_define_method(cMethodInfo, "children_time", prof_method_children_time, 0);
 
@@ -4,6 +4,7 @@ require "ruby-prof/flat_printer"
 require "ruby-prof/graph_printer"
 require "ruby-prof/graph_html_printer"
 require "ruby-prof/call_tree_printer"
+require "ruby-prof/continuous"
 
 require "ruby-prof/test"
 
@@ -14,28 +15,34 @@ module RubyProf
     case ENV["RUBY_PROF_MEASURE_MODE"]
     when "wall" || "wall_time"
       RubyProf.measure_mode = RubyProf::WALL_TIME
+    when "monotonic", "monotonic_time"
+      RubyProf.measure_mode = RubyProf::MONOTONIC_TIME
+    when "thread", "thread_time"
+      RubyProf.measure_mode = RubyProf::THREAD_TIME
     when "cpu" || "cpu_time"
+      # Otherwise the extension measures the frequency itself
       if ENV.key?("RUBY_PROF_CPU_FREQUENCY")
         RubyProf.cpu_frequency = ENV["RUBY_PROF_CPU_FREQUENCY"].to_f
-      else
-        begin
-          open("/proc/cpuinfo") do |f|
-            f.each_line do |line|
-              s = line.slice(/cpu MHz\s*:\s*(.*)/, 1)
-              if s
-                RubyProf.cpu_frequency = s.to_f * 1000000
-                break
-              end
-            end
-          end
-        rescue Errno::ENOENT
-        end
       end
       RubyProf.measure_mode = RubyProf::CPU_TIME
     when "allocations"
       RubyProf.measure_mode = RubyProf::ALLOCATIONS
     when "memory"
       RubyProf.measure_mode = RubyProf::MEMORY
+    when "task_clock"
+      RubyProf.measure_mode = RubyProf::TASK_CLOCK
+    when "page_faults"
+      RubyProf.measure_mode = RubyProf::PAGE_FAULTS
+    when "context_switches"
+      RubyProf.measure_mode = RubyProf::CONTEXT_SWITCHES
+    when "instructions"
+      RubyProf.measure_mode = RubyProf::INSTRUCTIONS
+    when "cpu_cycles"
+      RubyProf.measure_mode = RubyProf::CPU_CYCLES
+    when "cache_misses"
+      RubyProf.measure_mode = RubyProf::CACHE_MISSES
+    when "branch_misses"
+      RubyProf.measure_mode = RubyProf::BRANCH_MISSES
     else
       RubyProf.measure_mode = RubyProf::PROCESS_TIME
     end
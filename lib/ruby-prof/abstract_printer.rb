@@ -18,10 +18,31 @@ module RubyProf
     #   :print_file  - True or false. Specifies if a method's source
     #                  file should be printed.  Default value if false.
     #
+    #   :measure_mode - Which of the result's measure modes to print,
+    #                  when several were recorded.  See
+    #                  RubyProf.measure_modes=.  Default value is the
+    #                  result's current measure mode.  The
+    #                  result's own measure mode is left unchanged.
+    #
     def setup_options(options = {})
       @options = options
     end      
 
+    def measure_mode
+      @options[:measure_mode] || @result.measure_mode
+    end
+
+    # Selects the printer's measure mode on the result while printing
+    # and restores the result's own selection afterwards, so it
+    # doesn't change what other printers of the result report.
+    def with_measure_mode
+      selected = @result.measure_mode
+      @result.measure_mode = measure_mode
+      yield
+    ensure
+      @result.measure_mode = selected if selected
+    end
+
     def min_percent
       @options[:min_percent] || 0
     end
@@ -11,13 +11,19 @@ module RubyProf
         
       # add a header - this information is somewhat arbitrary
       @output << "events: "
-      case RubyProf.measure_mode
+      case measure_mode
         when RubyProf::PROCESS_TIME
           @value_scale = RubyProf::CLOCKS_PER_SEC;
           @output << 'process_time'
         when RubyProf::WALL_TIME
           @value_scale = 1_000_000
           @output << 'wall_time'
+        when RubyProf.const_defined?(:MONOTONIC_TIME) && RubyProf::MONOTONIC_TIME
+          @value_scale = 1_000_000_000
+          @output << 'monotonic_time'
+        when RubyProf.const_defined?(:THREAD_TIME) && RubyProf::THREAD_TIME
+          @value_scale = 1_000_000_000
+          @output << 'thread_time'
         when RubyProf.const_defined?(:CPU_TIME) && RubyProf::CPU_TIME
           @value_scale = RubyProf.cpu_frequency
           @output << 'cpu_time'
@@ -33,12 +39,35 @@ module RubyProf
         when RubyProf.const_defined?(:GC_TIME) && RubyProf::GC_TIME
           @value_scale = 1000000
           @output << 'gc_time'
+        when RubyProf.const_defined?(:TASK_CLOCK) && RubyProf::TASK_CLOCK
+          @value_scale = 1_000_000_000
+          @output << 'task_clock'
+        when RubyProf.const_defined?(:PAGE_FAULTS) && RubyProf::PAGE_FAULTS
+          @value_scale = 1
+          @output << 'page_faults'
+        when RubyProf.const_defined?(:CONTEXT_SWITCHES) && RubyProf::CONTEXT_SWITCHES
+          @value_scale = 1
+          @output << 'context_switches'
+        when RubyProf.const_defined?(:INSTRUCTIONS) && RubyProf::INSTRUCTIONS
+          @value_scale = 1
+          @output << 'instructions'
+        when RubyProf.const_defined?(:CPU_CYCLES) && RubyProf::CPU_CYCLES
+          @value_scale = 1
+          @output << 'cpu_cycles'
+        when RubyProf.const_defined?(:CACHE_MISSES) && RubyProf::CACHE_MISSES
+          @value_scale = 1
+          @output << 'cache_misses'
+        when RubyProf.const_defined?(:BRANCH_MISSES) && RubyProf::BRANCH_MISSES
+          @value_scale = 1
+          @output << 'branch_misses'
         else
-          raise "Unknown measure mode: #{RubyProf.measure_mode}"
+          raise "Unknown measure mode: #{measure_mode}"
       end
       @output << "\n\n"
 
-      print_threads
+      with_measure_mode do
+        print_threads
+      end
     end
 
     def print_threads
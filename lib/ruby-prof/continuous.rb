@@ -0,0 +1,292 @@
+require 'thread'
+require 'fileutils'
+
+module RubyProf
+  # Profiles a long running process all the time, keeping the
+  # profiles of the last few windows of time in memory.
+  #
+  # A background thread takes a RubyProf.snapshot every window seconds,
+  # which also resets the counters, so each window is an ordinary
+  # RubyProf::Result covering just that window that any printer can
+  # render.  Windows are kept in a ring - when there are more than
+  # :windows of them, or they use more than :max_bytes, the oldest are
+  # dropped.  Windows can be written to files with Result#dump, either
+  # on demand with flush or every :flush_every windows.
+  #
+  # Where RubyProf.sampling= is available the profile is sampled every
+  # :sample_interval microseconds of cpu time, which bounds its cost.
+  # Elsewhere start raises NotImplementedError unless :trace is set,
+  # since tracing every call costs much more.
+  #
+  # Options:
+  #
+  #   window - The length of a window in seconds, 60 by default.
+  #
+  #   windows - The number of windows to keep, 10 by default.
+  #
+  #   max_bytes - The most memory the windows may use, as reported by
+  #               Result#allocation_stats, 64MB by default.  The
+  #               running profile isn't counted.
+  #
+  #   max_overhead - The fraction of a window the background thread
+  #                  may spend taking snapshots and writing files, 0.01
+  #                  by default.  When ending a window takes longer the
+  #                  next one is lengthened to match.  This only covers
+  #                  the background thread, not the cost of sampling or
+  #                  tracing the process itself.
+  #
+  #   sample_interval - The sampling interval in microseconds, 10000
+  #                     (100 samples per second) by default.
+  #
+  #   trace - Trace every call, without line events, instead of
+  #           sampling.  False by default.
+  #
+  #   output_dir - The directory flush writes to, the current directory
+  #                by default.
+  #
+  #   flush_every - Flush after this many windows.  By default windows
+  #                 are only written by flush.
+  #
+  # Example:
+  #
+  #   profiler = RubyProf::Continuous.new(:window => 60, :windows => 30)
+  #   profiler.start
+  #   ...
+  #   window = profiler.windows.last
+  #   RubyProf::FlatPrinter.new(window.result).print(STDOUT)
+  #   profiler.flush
+  #   ...
+  #   profiler.stop
+  class Continuous
+    DEFAULT_OPTIONS = {
+      :window => 60,
+      :windows => 10,
+      :max_bytes => 64 * 1024 * 1024,
+      :max_overhead => 0.01,
+      :sample_interval => 10000,
+      :trace => false,
+      :output_dir => nil,
+      :flush_every => nil }
+
+    # A window's profile and the time it covers.  path is the file it
+    # was flushed to, if it was.
+    Window = Struct.new(:result, :started_at, :finished_at, :path)
+
+    class Window
+      # The memory the window's profile uses, in bytes.
+      def bytes
+        stats = result.allocation_stats
+        stats[:reserved] + stats[:registry]
+      end
+    end
+
+    # Ruby 1.8's ConditionVariable#wait has no timeout
+    TIMED_WAIT = ConditionVariable.instance_method(:wait).arity != 1
+
+    attr_reader :window, :dropped
+
+    def initialize(options = {})
+      options = DEFAULT_OPTIONS.merge(options)
+      @window = options[:window].to_f
+      @windows = options[:windows].to_i
+      @max_bytes = options[:max_bytes]
+      @max_overhead = options[:max_overhead].to_f
+      @sample_interval = options[:sample_interval]
+      @trace = options[:trace]
+      @output_dir = options[:output_dir] || Dir.pwd
+      @flush_every = options[:flush_every]
+
+      raise ArgumentError, "window must be positive" unless @window > 0
+      raise ArgumentError, "windows must be positive" unless @windows > 0
+      raise ArgumentError, "max_overhead must be positive" unless @max_overhead > 0
+
+      @ring = []
+      @dropped = 0
+      @mutex = Mutex.new
+      @wakeup = ConditionVariable.new
+      @stopping = false
+      @thread = nil
+    end
+
+    # Starts profiling and the background thread.
+    def start
+      raise RuntimeError, "RubyProf is already running" if RubyProf.running?
+      unless @trace || RubyProf.respond_to?(:sampling=)
+        raise NotImplementedError, "sampling isn't available, pass :trace => true to trace every call instead"
+      end
+
+      @saved = save_settings
+      @rotated = 0
+      @stopping = false
+      @window_started_at = Time.now
+
+      # The thread waits until profiling has started and isn't profiled
+      # itself.
+      queue = Queue.new
+      @thread = Thread.new do
+        queue.pop
+        run
+      end
+      RubyProf.exclude_threads = (RubyProf.exclude_threads || []) + [@thread]
+      if @trace
+        RubyProf.sampling = false if RubyProf.respond_to?(:sampling=)
+        RubyProf.trace_lines = false
+      else
+        RubyProf.sampling = true
+        RubyProf.sample_interval = @sample_interval
+      end
+
+      begin
+        RubyProf.start
+      rescue
+        @thread.kill
+        restore_settings(@saved)
+        raise
+      end
+      queue.push(true)
+      self
+    end
+
+    def running?
+      !@thread.nil?
+    end
+
+    # Stops profiling and adds the last, partial, window.  Returns the
+    # windows that are kept.  A window the background thread is ending
+    # is finished first.
+    def stop
+      raise RuntimeError, "RubyProf::Continuous is not running" unless running?
+
+      @mutex.synchronize do
+        @stopping = true
+        @wakeup.signal
+      end
+      begin
+        @thread.join
+      ensure
+        @thread = nil
+        @mutex.synchronize do
+          add_window(RubyProf.stop)
+        end
+        restore_settings(@saved)
+      end
+      windows
+    end
+
+    # Ends the current window and starts a new one.  This is what the
+    # background thread does every window seconds.
+    def rotate
+      @mutex.synchronize do
+        add_window(RubyProf.snapshot(true))
+        @rotated += 1
+        flush_windows(@output_dir) if @flush_every && @rotated % @flush_every == 0
+      end
+    end
+
+    # Returns the windows that are kept, oldest first.
+    def windows
+      @mutex.synchronize { @ring.dup }
+    end
+
+    # Returns the memory the kept windows use in bytes.
+    def bytes
+      @mutex.synchronize { ring_bytes }
+    end
+
+    # Writes each window that hasn't been written yet to a file in dir
+    # and returns the paths of the new files.  They can be read back
+    # with RubyProf::Result.load.
+    def flush(dir = @output_dir)
+      @mutex.synchronize { flush_windows(dir) }
+    end
+
+    private
+
+    def run
+      cost = 0
+      # Keep the time spent here within the budget
+      while wait([@window, cost / @max_overhead].max - cost)
+        started = clock
+        rotate
+        cost = clock - started
+      end
+    end
+
+    # Waits seconds, or until stop is called.  Returns false when
+    # stopping.
+    def wait(seconds)
+      deadline = Time.now + seconds
+      @mutex.synchronize do
+        loop do
+          return false if @stopping
+          remaining = deadline - Time.now
+          return true if remaining <= 0
+
+          if TIMED_WAIT
+            @wakeup.wait(@mutex, remaining)
+          else
+            @mutex.unlock
+            begin
+              sleep([remaining, 0.1].min)
+            ensure
+              @mutex.lock
+            end
+          end
+        end
+      end
+    end
+
+    def clock
+      if RubyProf.respond_to?(:measure_thread_time)
+        RubyProf.measure_thread_time
+      else
+        Time.now.to_f
+      end
+    end
+
+    def add_window(result)
+      now = Time.now
+      @ring.push(Window.new(result, @window_started_at, now, nil))
+      @window_started_at = now
+
+      # Always keep the newest window, even if it's over the budget
+      while @ring.length > @windows || (@ring.length > 1 && ring_bytes > @max_bytes)
+        @ring.shift
+        @dropped += 1
+      end
+    end
+
+    def ring_bytes
+      @ring.inject(0) { |sum, window| sum + window.bytes }
+    end
+
+    def flush_windows(dir)
+      FileUtils.mkdir_p(dir)
+      @ring.select { |window| window.path.nil? }.map do |window|
+        name = "ruby-prof-#{Process.pid}-#{window.finished_at.strftime('%Y%m%d-%H%M%S')}-#{window.finished_at.usec}.prof"
+        path = File.join(dir, name)
+        window.result.dump(path)
+        window.path = path
+      end
+    end
+
+    def save_settings
+      settings = { :exclude_threads => RubyProf.exclude_threads,
+                   :trace_lines => RubyProf.trace_lines? }
+      if RubyProf.respond_to?(:sampling=)
+        settings[:sampling] = RubyProf.sampling?
+        settings[:sample_interval] = RubyProf.sample_interval
+      end
+      settings
+    end
+
+    def restore_settings(settings)
+      RubyProf.exclude_threads = settings[:exclude_threads]
+      RubyProf.trace_lines = settings[:trace_lines]
+      if settings.key?(:sampling)
+        RubyProf.sampling = settings[:sampling]
+        RubyProf.sample_interval = settings[:sample_interval]
+      end
+    end
+  end
+end
@@ -52,7 +52,9 @@ module RubyProf
       _erbout = @output
       erb = ERB.new(template, nil, nil)
       erb.filename = filename
-      @output << erb.result(binding)
+      with_measure_mode do
+        @output << erb.result(binding)
+      end
     end
 
     # These methods should be private but then ERB doesn't
@@ -56,7 +56,9 @@ module RubyProf
     def print(output = STDOUT, options = {})
       @output = output
       setup_options(options)
-      print_threads
+      with_measure_mode do
+        print_threads
+      end
     end
 
     private 
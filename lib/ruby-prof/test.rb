@@ -1,6 +1,7 @@
 # Now load ruby-prof and away we go
 require 'ruby-prof'
 require 'benchmark'
+require 'enumerator'
 
 module RubyProf
   module Test
@@ -21,10 +22,14 @@ module RubyProf
       yield(self.class::STARTED, name)
       @_result = result
       run_warmup
-      PROFILE_OPTIONS[:measure_modes].each do |measure_mode|
-        data = run_profile(measure_mode)
-        report_profile(data, measure_mode)
-        result.add_run
+      # Record as many measure modes as possible in each run
+      PROFILE_OPTIONS[:measure_modes].each_slice(RubyProf::MAX_MEASURE_MODES) do |measure_modes|
+        data = run_profile(measure_modes)
+        measure_modes.each do |measure_mode|
+          data.measure_mode = measure_mode
+          report_profile(data, measure_mode)
+          result.add_run
+        end
       end
       yield(self.class::FINISHED, name)
     end
@@ -59,8 +64,8 @@ module RubyProf
       end
     end
 
-    def run_profile(measure_mode)
-      RubyProf.measure_mode = measure_mode
+    def run_profile(measure_modes)
+      RubyProf.measure_modes = measure_modes
 
       print '  '
       PROFILE_OPTIONS[:count].times do |i|
@@ -80,13 +85,17 @@ module RubyProf
       end
 
       data = RubyProf.stop
-      bench = data.threads.values.inject(0) do |total, method_infos|
-        top = method_infos.sort.last
-        total += top.total_time
-        total
-      end
+      puts
+      measure_modes.each do |measure_mode|
+        data.measure_mode = measure_mode
+        bench = data.threads.values.inject(0) do |total, method_infos|
+          top = method_infos.sort.last
+          total += top.total_time
+          total
+        end
 
-      puts "\n  #{measure_mode_name(measure_mode)}: #{format_profile_total(bench, measure_mode)}\n"
+        puts "  #{measure_mode_name(measure_mode)}: #{format_profile_total(bench, measure_mode)}\n"
+      end
 
       data
     end
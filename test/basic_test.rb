@@ -187,4 +187,48 @@ class BasicTest < Test::Unit::TestCase
     
     RubyProf.stop
   end   
+
+  def test_allocation_stats
+    result = RubyProf.profile do
+      C1.new.hello
+    end
+
+    stats = result.allocation_stats
+    assert(stats[:chunks] > 0)
+    assert(stats[:allocations] > 0)
+    assert(stats[:used] > 0)
+    assert(stats[:used] <= stats[:reserved])
+  end
+
+  def test_cached_names
+    result = RubyProf.profile do
+      C1.hello
+      C1.new.hello
+    end
+
+    methods = result.threads.values.first
+    method = methods.find {|m| m.full_name == 'C1#hello'}
+    assert(method.full_name.frozen?)
+    assert(method.klass_name.frozen?)
+    assert(method.method_name.frozen?)
+    assert_same(method.full_name, method.full_name)
+    assert_same(method.klass_name, method.klass_name)
+    assert_same(method.method_name, method.method_name)
+  end
+
+  def test_same_objects
+    result = RubyProf.profile do
+      C1.new.hello
+    end
+
+    assert_same(result.threads, result.threads)
+    methods = result.threads.values.first
+    GC.start
+
+    method = methods.find {|m| m.full_name == 'C1#hello'}
+    call_info = method.parents.first
+    assert_same(call_info, method.parents.first)
+    assert_same(method, call_info.target.children.find {|c| c.target.full_name == 'C1#hello'}.target)
+    assert(method.children.all? {|c| methods.any? {|m| m.equal?(c.target)}})
+  end
 end
@@ -0,0 +1,67 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+class ColumnsTest < Test::Unit::TestCase
+  def fib(n)
+    n < 2 ? n : fib(n - 1) + fib(n - 2)
+  end
+
+  def setup
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+  end
+
+  def test_methods
+    result = RubyProf.profile do
+      fib(6)
+      Thread.new { fib(4) }.join
+    end
+
+    columns = result.to_columns
+    methods = result.threads.values.flatten
+    rows = columns[:methods]
+
+    ids = rows[:id].unpack('Q*')
+    depths = rows[:depth].unpack('Q*')
+    called = rows[:called].unpack('Q*')
+    thread_ids = rows[:thread_id].unpack('Q*')
+    total_times = rows[:total_time].unpack('D*')
+    self_times = rows[:self_time].unpack('D*')
+    assert_equal(methods.length, ids.length)
+
+    methods.each_with_index do |method, i|
+      name = columns[:names][ids[i]]
+      name = "#{name}-#{depths[i]}" if depths[i] > 0
+      assert_equal(method.full_name, name)
+      assert_equal(method.called, called[i])
+      assert_in_delta(method.total_time, total_times[i], 1e-9)
+      assert_in_delta(method.self_time, self_times[i], 1e-9)
+      assert(result.threads[thread_ids[i]].include?(method))
+    end
+  end
+
+  def test_calls
+    result = RubyProf.profile do
+      fib(6)
+    end
+
+    columns = result.to_columns
+    methods = result.threads.values.flatten
+    calls = columns[:calls]
+
+    parents = calls[:parent].unpack('Q*')
+    children = calls[:child].unpack('Q*')
+    called = calls[:called].unpack('Q*')
+    total_times = calls[:total_time].unpack('D*')
+    assert_equal(methods.inject(0) { |sum, method| sum + method.children.length }, parents.length)
+
+    parents.each_with_index do |parent, i|
+      call_info = methods[parent].children.find { |c| c.target.equal?(methods[children[i]]) }
+      assert_not_nil(call_info)
+      assert_equal(call_info.called, called[i])
+      assert_in_delta(call_info.total_time, total_times[i], 1e-9)
+    end
+  end
+end
@@ -0,0 +1,167 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+require 'tmpdir'
+require 'fileutils'
+
+class ContinuousTest < Test::Unit::TestCase
+  def setup
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+    @dir = File.join(Dir.tmpdir, "ruby_prof_continuous_test_#{$$}")
+  end
+
+  def teardown
+    FileUtils.rm_rf(@dir)
+  end
+
+  def work(count)
+    count.times { Array.new }
+  end
+
+  # Traces where sampling isn't available
+  def continuous(options)
+    RubyProf::Continuous.new({ :trace => !RubyProf.respond_to?(:sampling=) }.merge(options))
+  end
+
+  def find(result, name)
+    result.threads.values.flatten.find { |method| method.full_name == name }
+  end
+
+  def test_rotate
+    profiler = continuous(:window => 1000)
+    profiler.start
+    assert(profiler.running?)
+    work(2)
+    profiler.rotate
+    work(3)
+    windows = profiler.stop
+    assert(!profiler.running?)
+    assert(!RubyProf.running?)
+
+    # Each window is a result of its own
+    assert_equal(2, windows.length)
+    assert_equal([2, 3], windows.map { |window| find(window.result, '<Class::Array>#new').called })
+    assert(windows[0].started_at <= windows[0].finished_at)
+    assert_equal(windows[0].finished_at, windows[1].started_at)
+  end
+
+  def test_background_thread
+    profiler = continuous(:window => 0.05, :max_overhead => 1)
+    profiler.start
+    sleep(0.3)
+    windows = profiler.stop
+
+    assert(windows.length >= 3)
+    # The background thread isn't profiled
+    windows.each do |window|
+      assert_equal(1, window.result.threads.length)
+    end
+  end
+
+  def test_windows
+    profiler = continuous(:window => 1000, :windows => 2)
+    profiler.start
+    4.times do |i|
+      work(i + 1)
+      profiler.rotate
+    end
+    windows = profiler.stop
+
+    # Only the newest windows are kept
+    assert_equal(2, windows.length)
+    assert_equal(3, profiler.dropped)
+    assert_equal(4, find(windows[0].result, '<Class::Array>#new').called)
+  end
+
+  def test_max_bytes
+    profiler = continuous(:window => 1000, :max_bytes => 1)
+    profiler.start
+    3.times do
+      work(1)
+      profiler.rotate
+    end
+    windows = profiler.stop
+
+    # The newest window is kept even though it's over the budget
+    assert_equal(1, windows.length)
+    assert_equal(3, profiler.dropped)
+    assert(profiler.bytes > 1)
+  end
+
+  def test_flush
+    profiler = continuous(:window => 1000, :output_dir => @dir)
+    profiler.start
+    work(2)
+    profiler.rotate
+    paths = profiler.flush
+    assert_equal(1, paths.length)
+    assert_equal([], profiler.flush)
+    work(3)
+    windows = profiler.stop
+    paths += profiler.flush
+
+    assert_equal(windows.map { |window| window.path }, paths)
+    counts = paths.map { |path| find(RubyProf::Result.load(path), '<Class::Array>#new').called }
+    assert_equal([2, 3], counts)
+  end
+
+  def test_flush_every
+    profiler = continuous(:window => 1000, :output_dir => @dir, :flush_every => 2)
+    profiler.start
+    3.times { profiler.rotate }
+    profiler.stop
+    assert_equal(2, Dir[File.join(@dir, '*.prof')].length)
+  end
+
+  def test_restores_settings
+    thread = Thread.new {}
+    thread.join
+    RubyProf.exclude_threads = [thread]
+    trace_lines = RubyProf.trace_lines?
+
+    profiler = continuous({})
+    profiler.start
+    assert_raise(RuntimeError) { profiler.start }
+    profiler.stop
+    assert_raise(RuntimeError) { profiler.stop }
+
+    assert_equal([thread], RubyProf.exclude_threads)
+    assert_equal(trace_lines, RubyProf.trace_lines?)
+  ensure
+    RubyProf.exclude_threads = nil
+  end
+
+  def test_requires_sampling_or_trace
+    return if RubyProf.respond_to?(:sampling=)
+
+    exclude_threads = RubyProf.exclude_threads
+    profiler = RubyProf::Continuous.new
+    assert_raise(NotImplementedError) { profiler.start }
+    assert(!profiler.running?)
+    assert(!RubyProf.running?)
+    assert_equal(exclude_threads, RubyProf.exclude_threads)
+  end
+
+  def test_stop_wakes_background_thread
+    profiler = continuous(:window => 1000)
+    profiler.start
+    started = Time.now
+    windows = profiler.stop
+    assert(Time.now - started < 1)
+    assert_equal(1, windows.length)
+  end
+
+  def test_window_is_kept
+    profiler = continuous(:window => 0.01, :max_overhead => 0.000001)
+    profiler.start
+    sleep(0.2)
+    windows = profiler.stop
+
+    # Ending a window costs far more than the budget, so the windows
+    # are lengthened, but the configured window doesn't change
+    assert_equal(0.01, profiler.window)
+    assert(windows.length < 10)
+  end
+end
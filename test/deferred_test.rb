@@ -0,0 +1,87 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+class DeferredWork
+  def run(n)
+    n.times do
+      one
+      two
+    end
+  end
+
+  def one
+    two
+  end
+
+  def two
+    1 + 1
+  end
+end
+
+# --  Tests ----
+class DeferredTest < Test::Unit::TestCase
+  def teardown
+    RubyProf.deferred_aggregation = false
+  end
+
+  def summarize(result)
+    methods = result.threads.values.first
+    methods.inject({}) do |hash, method|
+      hash[method.full_name] = [method.called, method.line,
+                                method.parents.map {|call_info| [call_info.target.full_name, call_info.called, call_info.line]}.sort,
+                                method.children.map {|call_info| [call_info.target.full_name, call_info.called, call_info.line]}.sort]
+      hash
+    end
+  end
+
+  def profile(deferred, n)
+    RubyProf.deferred_aggregation = deferred
+    work = DeferredWork.new
+    RubyProf.profile do
+      work.run(n)
+    end
+  end
+
+  def test_deferred_aggregation
+    assert(!RubyProf.deferred_aggregation?)
+    RubyProf.deferred_aggregation = true
+    assert(RubyProf.deferred_aggregation?)
+  end
+
+  def test_set_while_running
+    RubyProf.start
+    assert_raise(RuntimeError) do
+      RubyProf.deferred_aggregation = true
+    end
+    RubyProf.stop
+  end
+
+  def test_same_results
+    # Names, call counts, line numbers and call graphs should be
+    # the same as when results are aggregated immediately
+    immediate = summarize(profile(false, 10))
+    deferred = summarize(profile(true, 10))
+    assert_equal(immediate.keys.sort, deferred.keys.sort)
+    immediate.each do |name, values|
+      assert_equal(values, deferred[name], name)
+    end
+  end
+
+  def test_buffer_overflow
+    # Record more events than fit in a thread's buffer
+    result = profile(true, 20000)
+
+    methods = result.threads.values.first
+    method = methods.detect {|method| method.full_name == 'DeferredWork#two'}
+    assert_equal(40000, method.called)
+
+    methods.each do |method|
+      check_parent_times(method)
+      check_parent_calls(method)
+      check_child_times(method)
+    end
+  end
+end
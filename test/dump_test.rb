@@ -0,0 +1,82 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+require 'tmpdir'
+
+class DumpTest < Test::Unit::TestCase
+  def fib(n)
+    n < 2 ? n : fib(n - 1) + fib(n - 2)
+  end
+
+  def setup
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+    @path = File.join(Dir.tmpdir, "ruby_prof_dump_test_#{$$}.prof")
+  end
+
+  def teardown
+    File.delete(@path) if File.exist?(@path)
+  end
+
+  # Loaded times are converted with a factor, which can differ in the last digit
+  def nanos(time)
+    (time * 1e9).round
+  end
+
+  def summary(result)
+    result.threads.values.map do |methods|
+      methods.map do |method|
+        [method.full_name, method.called, nanos(method.total_time), nanos(method.self_time),
+         nanos(method.wait_time), method.source_file, method.line, method.base.full_name,
+         method.parents.map { |call_info| [call_info.target.full_name, call_info.called, nanos(call_info.total_time)] }.sort,
+         method.children.map { |call_info| [call_info.target.full_name, call_info.line, nanos(call_info.self_time)] }.sort]
+      end.sort
+    end
+  end
+
+  def test_load
+    result = RubyProf.profile do
+      fib(8)
+      Thread.new { fib(3) }.join
+    end
+
+    assert_same(result, result.dump(@path))
+    loaded = RubyProf::Result.load(@path)
+    assert_equal(result.threads.keys, loaded.threads.keys)
+    assert_equal(summary(result), summary(loaded))
+    assert_equal(result.measure_modes, loaded.measure_modes)
+
+    method = loaded.threads.values.first.find { |m| m.full_name == 'DumpTest#fib' }
+    assert_nil(method.klass)
+    assert_equal(:fib, method.method_id)
+    assert_equal('DumpTest', method.klass_name)
+
+    printer = RubyProf::FlatPrinter.new(loaded)
+    printer.print(output = '')
+    assert_match(/DumpTest#fib/, output)
+  end
+
+  def test_invalid_file
+    File.open(@path, 'wb') { |file| file.write('not a profile' * 10) }
+    assert_raise(RuntimeError) { RubyProf::Result.load(@path) }
+
+    result = RubyProf.profile { fib(3) }
+    result.dump(@path)
+    data = File.open(@path, 'rb') { |file| file.read }
+    File.open(@path, 'wb') { |file| file.write(data[0, data.length - 8]) }
+    assert_raise(RuntimeError) { RubyProf::Result.load(@path) }
+
+    assert_raise(Errno::ENOENT) { RubyProf::Result.load(@path + '.missing') }
+  end
+
+  def test_dump_failure
+    result = RubyProf.profile { fib(3) }
+    assert_raise(Errno::ENOENT) { result.dump(File.join(@path + '.missing', 'profile')) }
+    assert_raise(Errno::ENOSPC) { result.dump('/dev/full') } if File.exist?('/dev/full')
+
+    # The result can still be written after a failed dump
+    result.dump(@path)
+    assert_equal(summary(result), summary(RubyProf::Result.load(@path)))
+  end
+end
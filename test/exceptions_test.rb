@@ -5,6 +5,65 @@ require 'ruby-prof'
 require 'test_helper'
 
 class ExceptionsTest < Test::Unit::TestCase
+  class Validator
+    def validate(value)
+      check(value)
+    end
+
+    def check(value)
+      raise(ArgumentError, 'invalid') if value.odd?
+      value
+    end
+
+    def nest(depth)
+      depth == 0 ? raise(RuntimeError, 'bottom') : nest(depth - 1)
+    end
+
+    def leave(depth)
+      depth == 0 ? throw(:done) : leave(depth - 1)
+    end
+  end
+
+  def validate_all
+    validator = Validator.new
+    20.times do |i|
+      begin
+        validator.validate(i)
+      rescue ArgumentError
+      end
+    end
+  end
+
+  def nest_all
+    validator = Validator.new
+    5.times do
+      begin
+        validator.nest(3)
+      rescue RuntimeError
+      end
+    end
+  end
+
+  def leave_all
+    validator = Validator.new
+    5.times do
+      catch(:done) do
+        validator.leave(3)
+      end
+    end
+  end
+
+  def find_method(methods, name)
+    methods.detect { |method| method.full_name == name }
+  end
+
+  def check_methods(methods)
+    methods.each do |method|
+      check_parent_times(method)
+      check_parent_calls(method)
+    end
+  end
+
   def test_profile
     puts "test_profile"
     result = begin
@@ -16,4 +75,74 @@ class ExceptionsTest < Test::Unit::TestCase
     assert_not_nil(result)
     puts result
   end
+
+  def test_rescue_in_loop
+    result = RubyProf.profile do
+      validate_all
+    end
+    methods = result.threads.values.first
+
+    # Unwound frames don't turn later calls into recursive ones
+    assert_equal([], methods.map { |method| method.full_name }.grep(/Validator#.*-\d+$/))
+
+    method = find_method(methods, 'ExceptionsTest::Validator#validate')
+    assert_equal(20, method.called)
+    assert_equal(1, method.parents.length)
+    assert_equal('Integer#times', method.parents[0].target.full_name)
+
+    method = find_method(methods, 'ExceptionsTest::Validator#check')
+    assert_equal(20, method.called)
+    assert_equal(1, method.parents.length)
+
+    check_methods(methods)
+  end
+
+  def test_recursive_raise
+    result = RubyProf.profile do
+      nest_all
+    end
+    methods = result.threads.values.first
+
+    names = methods.map { |method| method.full_name }.grep(/Validator#nest/).sort
+    assert_equal(['ExceptionsTest::Validator#nest', 'ExceptionsTest::Validator#nest-1',
+                  'ExceptionsTest::Validator#nest-2', 'ExceptionsTest::Validator#nest-3'], names)
+
+    names.each do |name|
+      assert_equal(5, find_method(methods, name).called)
+    end
+
+    check_methods(methods)
+  end
+
+  def test_throw
+    result = RubyProf.profile do
+      leave_all
+    end
+    methods = result.threads.values.first
+
+    names = methods.map { |method| method.full_name }.grep(/Validator#leave/)
+    assert_equal(4, names.length)
+
+    method = find_method(methods, 'ExceptionsTest::Validator#leave')
+    assert_equal(5, method.called)
+
+    check_methods(methods)
+  end
+
+  def test_deferred_aggregation
+    RubyProf.deferred_aggregation = true
+    result = RubyProf.profile do
+      validate_all
+      nest_all
+    end
+    methods = result.threads.values.first
+
+    assert_equal([], methods.map { |method| method.full_name }.grep(/Validator#(validate|check)-\d+$/))
+    assert_equal(20, find_method(methods, 'ExceptionsTest::Validator#check').called)
+    assert_equal(5, find_method(methods, 'ExceptionsTest::Validator#nest-3').called)
+
+    check_methods(methods)
+  ensure
+    RubyProf.deferred_aggregation = false
+  end
 end
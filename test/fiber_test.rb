@@ -0,0 +1,136 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+# Fibers get stacks of their own on ruby 1.9
+if defined?(Fiber) and RubyProf.respond_to?(:merge_fibers=)
+
+# Need to use wall time for this test due to the sleep calls
+RubyProf::measure_mode = RubyProf::WALL_TIME
+
+class FiberTest < Test::Unit::TestCase
+  def self.produce
+    Fiber.yield(1)
+    sleep(0.05)
+    Fiber.yield(2)
+  end
+
+  def setup
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def teardown
+    RubyProf.merge_fibers = false
+  end
+
+  def run_fiber
+    RubyProf.start
+    fiber = Fiber.new { self.class.produce }
+    fiber.resume
+    sleep(0.1)
+    fiber.resume
+    fiber.resume
+    RubyProf.stop
+  end
+
+  def find_method(methods, name)
+    methods.detect { |method| method.full_name == name }
+  end
+
+  def test_fiber_stacks
+    result = run_fiber
+    assert_equal(2, result.threads.length)
+
+    thread_methods = result.threads.values.detect { |methods| find_method(methods, 'Fiber#resume') }
+    fiber_methods = result.threads.values.detect { |methods| find_method(methods, '<Class::FiberTest>#produce') }
+    assert_not_nil(thread_methods)
+    assert_not_nil(fiber_methods)
+    assert_not_equal(thread_methods, fiber_methods)
+
+    # The fiber's methods are not in the thread's stack
+    assert_nil(find_method(thread_methods, '<Class::FiberTest>#produce'))
+    assert_nil(find_method(thread_methods, '<Class::Fiber>#yield'))
+
+    method = find_method(thread_methods, 'Fiber#resume')
+    assert_equal(3, method.called)
+
+    method = find_method(fiber_methods, '<Class::FiberTest>#produce')
+    assert_equal(1, method.called)
+    assert_in_delta(0.15, method.total_time, 0.02)
+
+    method = find_method(fiber_methods, 'Kernel#sleep')
+    assert_equal(1, method.called)
+    assert_in_delta(0.05, method.self_time, 0.02)
+
+    result.threads.values.flatten.each do |method|
+      check_parent_times(method)
+      check_parent_calls(method)
+    end
+  end
+
+  def test_suspended_fiber_waits
+    result = run_fiber
+    fiber_methods = result.threads.values.detect { |methods| find_method(methods, '<Class::FiberTest>#produce') }
+
+    # The fiber is suspended while the thread sleeps
+    method = find_method(fiber_methods, '<Class::Fiber>#yield')
+    assert_equal(2, method.called)
+    assert_in_delta(0.1, method.wait_time, 0.02)
+    assert_in_delta(0, method.self_time, 0.02)
+  end
+
+  def test_enumerator_next
+    enum = Enumerator.new do |yielder|
+      yielder << 1
+      yielder << 2
+    end
+    result = RubyProf.profile do
+      enum.next
+      enum.next
+    end
+    assert_equal(2, result.threads.length)
+
+    thread_methods = result.threads.values.detect { |methods| find_method(methods, 'Enumerator#next') }
+    fiber_methods = result.threads.values.detect { |methods| find_method(methods, 'Enumerator::Yielder#<<') }
+    assert_not_nil(thread_methods)
+    assert_not_nil(fiber_methods)
+    assert_not_equal(thread_methods, fiber_methods)
+    assert_equal(2, find_method(thread_methods, 'Enumerator#next').called)
+    assert_nil(find_method(thread_methods, 'Enumerator::Yielder#<<'))
+  end
+
+  def test_merge_fibers
+    assert(!RubyProf.merge_fibers?)
+    RubyProf.merge_fibers = true
+    assert(RubyProf.merge_fibers?)
+
+    result = run_fiber
+    assert_equal(1, result.threads.length)
+
+    methods = result.threads.values.first
+    assert_not_nil(find_method(methods, 'Fiber#resume'))
+    assert_not_nil(find_method(methods, '<Class::FiberTest>#produce'))
+
+    method = find_method(methods, 'Kernel#sleep')
+    assert_equal(2, method.called)
+    assert_in_delta(0.15, method.self_time, 0.02)
+
+    methods.each do |method|
+      check_parent_times(method)
+      check_parent_calls(method)
+    end
+  end
+
+  def test_merge_fibers_while_profiling
+    RubyProf.start
+    assert_raise(RuntimeError) do
+      RubyProf.merge_fibers = true
+    end
+  ensure
+    RubyProf.stop
+  end
+end
+
+end
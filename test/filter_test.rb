@@ -0,0 +1,151 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+module FilterApp
+  class Worker
+    def run
+      3.times do
+        step
+      end
+      FilterApp::Helper.help
+    end
+
+    def step
+      [1, 2].map {|i| i * 2}
+    end
+  end
+
+  class Helper
+    def self.help
+      sleep(0.01)
+    end
+  end
+end
+
+# --  Tests ----
+class FilterTest < Test::Unit::TestCase
+  def teardown
+    RubyProf.include_classes = nil
+    RubyProf.exclude_classes = nil
+    RubyProf.include_threads = nil
+    RubyProf.exclude_threads = nil
+  end
+
+  def method_names(result)
+    methods = result.threads.values.first
+    methods.map {|method| method.full_name}.sort
+  end
+
+  def profile
+    worker = FilterApp::Worker.new
+    RubyProf.profile do
+      worker.run
+    end
+  end
+
+  def test_settings
+    assert_equal([], RubyProf.include_classes)
+    RubyProf.include_classes = [FilterApp::Worker, /^FilterApp/]
+    assert_equal([FilterApp::Worker, /^FilterApp/], RubyProf.include_classes)
+
+    assert_raise(TypeError) do
+      RubyProf.exclude_classes = ["FilterApp"]
+    end
+    assert_raise(TypeError) do
+      RubyProf.exclude_threads = [FilterApp]
+    end
+
+    RubyProf.start
+    assert_raise(RuntimeError) do
+      RubyProf.exclude_classes = [Kernel]
+    end
+  ensure
+    RubyProf.stop if RubyProf.running?
+  end
+
+  def test_include_classes
+    RubyProf.include_classes = [/^FilterApp::/]
+    assert_equal(['<Class::FilterApp::Helper>#help',
+                  'FilterApp::Worker#run',
+                  'FilterApp::Worker#step'], method_names(profile))
+  end
+
+  def test_exclude_classes
+    RubyProf.exclude_classes = [Integer, Array, Kernel, FilterApp::Helper]
+    result = profile
+    names = method_names(result)
+
+    assert(names.include?('FilterApp::Worker#run'))
+    assert(names.include?('FilterApp::Worker#step'))
+    assert(!names.include?('Integer#times'))
+    assert(!names.include?('Array#map'))
+    assert(!names.include?('Kernel#sleep'))
+    assert(!names.include?('<Class::FilterApp::Helper>#help'))
+
+    # Excluded methods are folded into their caller
+    methods = result.threads.values.first
+    run = methods.detect {|method| method.full_name == 'FilterApp::Worker#run'}
+    step = methods.detect {|method| method.full_name == 'FilterApp::Worker#step'}
+    assert_equal('FilterApp::Worker#run', step.parents.first.target.full_name)
+    assert_equal(3, step.called)
+    assert_in_delta(0.01, run.self_time, 0.01)
+  end
+
+  def test_regexp_rules
+    # Matching a rule runs ruby code, which mustn't be profiled itself
+    RubyProf.exclude_classes = [/^NotAClass/]
+    anonymous = Class.new { def run; end }.new
+    worker = FilterApp::Worker.new
+    result = RubyProf.profile do
+      worker.run
+      anonymous.run
+    end
+    names = method_names(result)
+
+    assert(names.include?('FilterApp::Worker#step'))
+    assert_equal([], names.grep(/Regexp|inspect|to_s|name/))
+  end
+
+  def test_rule_errors
+    # A module's name comes from inspect, and a class whose rules
+    # raise is excluded instead of the error escaping the event hook
+    RubyProf.exclude_classes = [/^NotAClass/]
+    broken = Module.new do
+      def self.inspect
+        raise 'broken inspect'
+      end
+
+      def self.run
+        FilterApp::Worker.new.run
+      end
+    end
+    result = RubyProf.profile do
+      broken.run
+    end
+    names = method_names(result)
+
+    assert(names.include?('FilterApp::Worker#step'))
+    assert_equal([], names.grep(/inspect/))
+    assert_nil($!)
+  end
+
+  def test_exclude_threads
+    thread = Thread.new do
+      Thread.stop
+      FilterApp::Worker.new.run
+    end
+    sleep(0.01) until thread.status == 'sleep'
+
+    RubyProf.exclude_threads = [thread]
+    result = RubyProf.profile do
+      thread.run
+      thread.join
+    end
+
+    assert_equal(1, result.threads.length)
+    assert(!result.threads.has_key?(thread.object_id))
+  end
+end
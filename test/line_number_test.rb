@@ -66,4 +66,31 @@ class LineNumbersTest < Test::Unit::TestCase
     assert_equal('Kernel#sleep', method.full_name)
     assert_equal(0, method.line)
   end
+
+  def test_without_line_events
+    numbers = LineNumbers.new
+    RubyProf.trace_lines = false
+
+    result = RubyProf.profile do
+      numbers.method2
+      numbers.method3
+    end
+
+    methods = result.threads.values.first.inject({}) do |hash, method|
+      hash[method.full_name] = method
+      hash
+    end
+
+    # Call sites are looked up when methods are called
+    method = methods['Kernel#sleep']
+    assert_equal(0, method.line)
+    assert_equal('LineNumbers#method3', method.parents.first.target.full_name)
+    assert_equal(18, method.parents.first.line)
+
+    method = methods['LineNumbers#method1']
+    assert_equal('LineNumbers#method2', method.parents.first.target.full_name)
+    assert_equal(14, method.parents.first.line) if RUBY_VERSION < "1.9"
+  ensure
+    RubyProf.trace_lines = true
+  end
 end
\ No newline at end of file
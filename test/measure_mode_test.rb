@@ -4,6 +4,7 @@ require 'test/unit'
 require 'ruby-prof'
 require 'test_helper'
 require 'prime'
+require 'stringio'
 
 
 # --  Tests ----
@@ -57,6 +58,107 @@ class MeasureModeTest < Test::Unit::TestCase
         end
       end
     end
+
+    def test_cpu_frequency
+      assert(RubyProf.cpu_frequency > 0)
+      assert([true, false].include?(RubyProf.cpu_clock_invariant?))
+
+      error = RubyProf.cpu_frequency_error
+      assert(error.nil? || (error >= 0 && error < 0.01))
+    end
+  end
+
+  if RubyProf::MONOTONIC_TIME
+    def test_monotonic_time
+      RubyProf::measure_mode = RubyProf::MONOTONIC_TIME
+      assert_equal(RubyProf::MONOTONIC_TIME, RubyProf::measure_mode)
+      result = RubyProf.profile do
+        sleep(0.1)
+      end
+
+      methods = result.threads.values.first
+      assert_in_delta(0.1, methods.sort.last.total_time, 0.05)
+      methods.each do |method|
+        check_parent_times(method)
+        check_parent_calls(method)
+        check_child_times(method)
+      end
+    end
+  end
+
+  if RubyProf::THREAD_TIME
+    def test_thread_time
+      RubyProf::measure_mode = RubyProf::THREAD_TIME
+      assert_equal(RubyProf::THREAD_TIME, RubyProf::measure_mode)
+      result = RubyProf.profile do
+        run_primes
+        sleep(0.1)
+      end
+
+      methods = result.threads.values.first
+      sleep_method = methods.detect { |method| method.full_name == 'Kernel#sleep' }
+      assert(sleep_method.total_time < 0.05)
+      methods.each do |method|
+        check_parent_times(method)
+        check_parent_calls(method)
+        check_child_times(method)
+      end
+    end
+  end
+
+  if RubyProf::TASK_CLOCK
+    def test_perf_events
+      modes = [RubyProf::TASK_CLOCK, RubyProf::PAGE_FAULTS, RubyProf::CONTEXT_SWITCHES,
+               RubyProf::INSTRUCTIONS, RubyProf::CPU_CYCLES, RubyProf::CACHE_MISSES,
+               RubyProf::BRANCH_MISSES]
+
+      modes.each do |mode|
+        unless RubyProf.perf_event_supported?(mode)
+          assert_raise(RuntimeError) do
+            RubyProf::measure_mode = mode
+          end
+          next
+        end
+
+        RubyProf::measure_mode = mode
+        assert_equal(mode, RubyProf::measure_mode)
+        result = RubyProf.profile do
+          run_primes
+        end
+
+        result.threads.values.each do |methods|
+          methods.each do |method|
+            check_parent_times(method)
+            check_parent_calls(method)
+            check_child_times(method)
+          end
+        end
+      end
+    end
+  end
+
+  if RubyProf::TASK_CLOCK && File.directory?('/proc/self/fd')
+    def test_perf_event_counters_closed
+      return unless RubyProf.perf_event_supported?(RubyProf::TASK_CLOCK)
+
+      RubyProf::measure_mode = RubyProf::TASK_CLOCK
+      open_fds = Dir['/proc/self/fd/*'].length
+      2.times do
+        result = RubyProf.profile do
+          3.times { Thread.new { run_primes }.join }
+        end
+
+        # Each thread counted its own events, and their counters are
+        # closed when profiling stops
+        assert_equal(4, result.threads.length)
+        result.threads.values.each do |methods|
+          assert(methods.max.total_time > 0)
+        end
+        assert(Dir['/proc/self/fd/*'].length < open_fds)
+      end
+    ensure
+      RubyProf::measure_mode = RubyProf::PROCESS_TIME
+    end
   end
 
   if RubyProf::ALLOCATIONS
@@ -83,6 +185,76 @@ class MeasureModeTest < Test::Unit::TestCase
     end
   end
 
+  def test_measure_modes
+    RubyProf::measure_modes = [RubyProf::WALL_TIME, RubyProf::PROCESS_TIME]
+    assert_equal([RubyProf::WALL_TIME, RubyProf::PROCESS_TIME], RubyProf::measure_modes)
+    assert_equal(RubyProf::WALL_TIME, RubyProf::measure_mode)
+
+    result = RubyProf.profile do
+      sleep(0.1)
+      20000.times { |i| i.to_s }
+    end
+
+    assert_equal([RubyProf::WALL_TIME, RubyProf::PROCESS_TIME], result.measure_modes)
+    assert_equal(RubyProf::WALL_TIME, result.measure_mode)
+
+    methods = result.threads.values.first
+    sleep_method = methods.detect { |method| method.full_name == 'Kernel#sleep' }
+    assert_in_delta(0.1, sleep_method.total_time, 0.05)
+
+    # Sleeping doesn't use any process time
+    result.measure_mode = RubyProf::PROCESS_TIME
+    assert_equal(RubyProf::PROCESS_TIME, result.measure_mode)
+    assert(sleep_method.total_time < 0.05)
+
+    [RubyProf::WALL_TIME, RubyProf::PROCESS_TIME].each do |mode|
+      result.measure_mode = mode
+      methods.each do |method|
+        check_parent_times(method)
+        check_parent_calls(method)
+        check_child_times(method)
+      end
+    end
+
+    assert_raise(ArgumentError) do
+      result.measure_mode = 7777
+    end
+
+    # Printing another measure mode leaves the result's selection alone
+    result.measure_mode = RubyProf::WALL_TIME
+    RubyProf::FlatPrinter.new(result).print(StringIO.new, :measure_mode => RubyProf::PROCESS_TIME)
+    assert_equal(RubyProf::WALL_TIME, result.measure_mode)
+    assert_in_delta(0.1, sleep_method.total_time, 0.05)
+
+    # Setting measure_mode records a single measurement again
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+    assert_equal([RubyProf::PROCESS_TIME], RubyProf::measure_modes)
+  end
+
+  def test_invalid_measure_modes
+    assert_raise(ArgumentError) do
+      RubyProf::measure_modes = []
+    end
+    assert_raise(ArgumentError) do
+      RubyProf::measure_modes = [RubyProf::WALL_TIME, RubyProf::WALL_TIME]
+    end
+    assert_raise(ArgumentError) do
+      RubyProf::measure_modes = [RubyProf::WALL_TIME] * (RubyProf::MAX_MEASURE_MODES + 1)
+    end
+
+    # An invalid list leaves the measure modes unchanged
+    RubyProf::measure_modes = [RubyProf::WALL_TIME, RubyProf::PROCESS_TIME]
+    assert_raise(ArgumentError) do
+      RubyProf::measure_modes = [RubyProf::PROCESS_TIME, 7777]
+    end
+    assert_raise(ArgumentError) do
+      RubyProf::measure_modes = [RubyProf::PROCESS_TIME, RubyProf::WALL_TIME, RubyProf::WALL_TIME]
+    end
+    assert_equal([RubyProf::WALL_TIME, RubyProf::PROCESS_TIME], RubyProf::measure_modes)
+  ensure
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+  end
+
   def test_invalid
     assert_raise(ArgumentError) do
       RubyProf::measure_mode = 7777
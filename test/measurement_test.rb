@@ -28,6 +28,26 @@ class MeasurementTest < Test::Unit::TestCase
     assert u >= t, [t, u].inspect
   end
 
+  if RubyProf::MONOTONIC_TIME
+    def test_monotonic_time
+      t = RubyProf.measure_monotonic_time
+      assert_kind_of Float, t
+
+      u = RubyProf.measure_monotonic_time
+      assert u >= t, [t, u].inspect
+    end
+  end
+
+  if RubyProf::THREAD_TIME
+    def test_thread_time
+      t = RubyProf.measure_thread_time
+      assert_kind_of Float, t
+
+      u = RubyProf.measure_thread_time
+      assert u > t, [t, u].inspect
+    end
+  end
+
   if RubyProf::CPU_TIME
     def test_cpu_time
       RubyProf.cpu_frequency = 2.33e9
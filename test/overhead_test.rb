@@ -0,0 +1,81 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+class OverheadWork
+  def run(n)
+    i = 0
+    while i < n
+      tiny
+      i += 1
+    end
+  end
+
+  def tiny
+  end
+end
+
+# --  Tests ----
+class OverheadTest < Test::Unit::TestCase
+  def setup
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def teardown
+    RubyProf.compensate_overhead = false
+    RubyProf::measure_mode = RubyProf::PROCESS_TIME
+  end
+
+  def profile
+    work = OverheadWork.new
+    RubyProf.profile do
+      work.run(20000)
+    end
+  end
+
+  def test_compensate_overhead
+    assert(!RubyProf.compensate_overhead?)
+    RubyProf.compensate_overhead = true
+    assert(RubyProf.compensate_overhead?)
+
+    RubyProf.start
+    assert_raise(RuntimeError) do
+      RubyProf.compensate_overhead = false
+    end
+  ensure
+    RubyProf.stop
+  end
+
+  def test_raw_times
+    result = profile
+    assert_equal(0, result.event_overhead)
+
+    result.threads.values.first.each do |method|
+      assert_equal(method.total_time, method.raw_total_time)
+      assert_equal(method.self_time, method.raw_self_time)
+    end
+  end
+
+  def test_compensated_times
+    RubyProf.compensate_overhead = true
+    result = profile
+    assert(result.event_overhead > 0)
+
+    methods = result.threads.values.first
+    methods.each do |method|
+      assert(method.total_time <= method.raw_total_time, method.full_name)
+      assert(method.self_time <= method.raw_self_time, method.full_name)
+      assert(method.self_time >= 0, method.full_name)
+
+      check_parent_times(method)
+      check_parent_calls(method)
+      check_child_times(method)
+    end
+
+    # run makes many calls, so it gets most of the overhead
+    run = methods.detect {|method| method.full_name == 'OverheadWork#run'}
+    assert(run.self_time < run.raw_self_time)
+  end
+end
@@ -25,6 +25,20 @@ def sub_cycle(n)
   cycle(n)
 end
 
+def nap(n)
+  sleep(0.1)
+  n -= 1
+  return if n == 0
+  nap(n)
+end
+
+# Stops profiling partway back up the recursion
+def nap_and_stop(n)
+  sleep(0.1)
+  nap_and_stop(n - 1) if n > 1
+  $nap_result = RubyProf.stop if n == 3
+end
+
 def factorial(n)
   if n < 2 then
     n
@@ -141,4 +155,87 @@ class RecursiveTest < Test::Unit::TestCase
       end
     end
   end   
+
+  def test_collapse_recursion
+    RubyProf.recursion_limit = 0
+    result = RubyProf.profile do
+      nap(3)
+    end
+
+    methods = result.threads.values.first
+    methods.each do |method|
+      # Recursive calls merged into the method add no total time
+      recursive = method.parents.any? { |call_info| call_info.target == method }
+      check_parent_times(method) unless recursive
+      check_parent_calls(method)
+      check_child_times(method)
+    end
+
+    assert_equal([], methods.map { |method| method.full_name }.grep(/-\d+$/))
+
+    method = methods.detect { |m| m.full_name == 'Object#nap' }
+    assert_in_delta(0.3, method.total_time, 0.02)
+    assert_in_delta(0, method.self_time, 0.02)
+    assert_in_delta(0.3, method.children_time, 0.02)
+    assert_equal(3, method.called)
+    assert_equal(2, method.parents.length)
+
+    method = methods.detect { |m| m.full_name == 'Kernel#sleep' }
+    assert_in_delta(0.3, method.total_time, 0.02)
+    assert_equal(3, method.called)
+    assert_equal(1, method.parents.length)
+  ensure
+    RubyProf.recursion_limit = nil
+  end
+
+  def test_collapsed_children_time
+    RubyProf.recursion_limit = 0
+    RubyProf.start
+    nap_and_stop(5)
+
+    # The outermost calls never returned, so only the collapsed ones
+    # were counted and the method has no total time
+    methods = $nap_result.threads.values.first
+    method = methods.detect { |m| m.full_name == 'Object#nap_and_stop' }
+    assert_equal(0, method.total_time)
+    assert_equal(0, method.children_time)
+  ensure
+    RubyProf.recursion_limit = nil
+  end
+
+  def test_recursion_limit
+    assert_nil(RubyProf.recursion_limit)
+    RubyProf.recursion_limit = 5
+    assert_equal(5, RubyProf.recursion_limit)
+
+    result = RubyProf.profile do
+      factorial(650)
+    end
+
+    methods = result.threads.values.first
+    methods.each do |method|
+      # Recursive calls merged into the method add no total time
+      recursive = method.parents.any? { |call_info| call_info.target == method }
+      check_parent_times(method) unless recursive
+      check_parent_calls(method)
+      check_child_times(method)
+    end
+
+    names = methods.map { |method| method.full_name }.grep(/factorial/).sort
+    assert_equal(['Object#factorial', 'Object#factorial-1', 'Object#factorial-2',
+                  'Object#factorial-3', 'Object#factorial-4', 'Object#factorial-5'], names)
+
+    method = methods.detect { |m| m.full_name == 'Object#factorial-5' }
+    assert_equal(645, method.called)
+    assert_equal(2, method.parents.length)
+  ensure
+    RubyProf.recursion_limit = nil
+  end
+
+  def test_invalid_recursion_limit
+    assert_raise(ArgumentError) do
+      RubyProf.recursion_limit = -1
+    end
+    assert_nil(RubyProf.recursion_limit)
+  end
 end
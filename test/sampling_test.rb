@@ -0,0 +1,85 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+class SamplingWork
+  def run(seconds)
+    start = Process.times.utime
+    while Process.times.utime - start < seconds
+      busy
+    end
+  end
+
+  def busy
+    i = 0
+    10000.times do
+      i += 1
+    end
+  end
+end
+
+# --  Tests ----
+# Sampling is only available on some platforms
+if RubyProf.respond_to?(:sampling=)
+  class SamplingTest < Test::Unit::TestCase
+    def teardown
+      RubyProf.sampling = false
+      RubyProf.sample_interval = 1000
+    end
+
+    def test_sampling
+      assert(!RubyProf.sampling?)
+      RubyProf.sampling = true
+      assert(RubyProf.sampling?)
+    end
+
+    def test_sample_interval
+      assert_equal(1000, RubyProf.sample_interval)
+      RubyProf.sample_interval = 500
+      assert_equal(500, RubyProf.sample_interval)
+
+      assert_raise(ArgumentError) do
+        RubyProf.sample_interval = 0
+      end
+    end
+
+    def test_set_while_running
+      RubyProf.start
+      assert_raise(RuntimeError) do
+        RubyProf.sampling = true
+      end
+      assert_raise(RuntimeError) do
+        RubyProf.sample_interval = 100
+      end
+    ensure
+      RubyProf.stop
+    end
+
+    def test_samples
+      RubyProf.sampling = true
+      work = SamplingWork.new
+      result = RubyProf.profile do
+        work.run(0.2)
+      end
+
+      methods = result.threads.values.first.sort.reverse
+      names = methods.map {|method| method.full_name}
+      assert(names.include?('SamplingWork#run'))
+      assert(names.include?('SamplingWork#busy'))
+      assert(names.include?('Integer#times'))
+
+      # Nearly all samples land in busy
+      run = methods.detect {|method| method.full_name == 'SamplingWork#run'}
+      busy = methods.detect {|method| method.full_name == 'SamplingWork#busy'}
+      assert(busy.total_time > 0)
+      assert(busy.total_time > run.self_time)
+      assert(run.total_time >= busy.total_time)
+
+      assert_equal('SamplingWork#run', busy.parents.first.target.full_name)
+      assert_equal('Integer#times', busy.children.first.target.full_name)
+      assert_equal(__FILE__, busy.source_file)
+    end
+  end
+end
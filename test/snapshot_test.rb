@@ -0,0 +1,90 @@
+#!/usr/bin/env ruby
+
+require 'test/unit'
+require 'ruby-prof'
+require 'test_helper'
+
+# Need to use wall time for this test due to the sleep calls
+RubyProf::measure_mode = RubyProf::WALL_TIME
+
+class SnapshotTest < Test::Unit::TestCase
+  def setup
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def work(count)
+    count.times { Array.new }
+  end
+
+  def find(result, name)
+    result.threads.values.flatten.find { |method| method.full_name == name }
+  end
+
+  def nap_and_snapshot
+    work(2)
+    sleep(0.1)
+    RubyProf.snapshot
+  end
+
+  def test_running_methods
+    snapshot = nil
+    result = RubyProf.profile do
+      snapshot = nap_and_snapshot
+      work(3)
+    end
+
+    # The method was still running, so it is cut off at the snapshot
+    method = find(snapshot, 'SnapshotTest#nap_and_snapshot')
+    assert_equal(1, method.called)
+    assert_in_delta(0.1, method.total_time, 0.03)
+    assert_equal(1, find(snapshot, 'SnapshotTest#work').called)
+    assert_equal(2, find(snapshot, '<Class::Array>#new').called)
+
+    # Profiling went on
+    assert(!RubyProf.running?)
+    assert_equal(2, find(result, 'SnapshotTest#work').called)
+    assert_equal(5, find(result, '<Class::Array>#new').called)
+  end
+
+  def test_reset
+    snapshots = []
+    result = RubyProf.profile do
+      work(2)
+      snapshots << RubyProf.snapshot(true)
+      work(3)
+      snapshots << RubyProf.snapshot(true)
+      sleep(0.1)
+      snapshots << RubyProf.snapshot(true)
+      work(4)
+    end
+    snapshots << result
+
+    assert_equal([2, 3, nil, 4], snapshots.map { |snapshot| (method = find(snapshot, '<Class::Array>#new')) && method.called })
+    sleep_time = find(snapshots[2], 'Kernel#sleep').total_time
+    assert_in_delta(0.1, sleep_time, 0.03)
+    # The final result still lists methods from before the last reset,
+    # but without any calls
+    method = find(snapshots[3], 'Kernel#sleep')
+    assert(method.nil? || method.called == 0)
+  end
+
+  def test_threads
+    snapshot = nil
+    result = RubyProf.profile do
+      thread = Thread.new { work(2); sleep(0.1) }
+      sleep(0.05)
+      snapshot = RubyProf.snapshot
+      thread.join
+    end
+
+    # The thread is waiting in sleep, which is cut off at the snapshot
+    assert_equal(2, snapshot.threads.length)
+    assert_equal(1, find(snapshot, 'SnapshotTest#work').called)
+    assert_equal(1, find(snapshot, 'Kernel#sleep').called)
+    assert_equal(1, find(result, 'SnapshotTest#work').called)
+  end
+
+  def test_not_running
+    assert_raise(RuntimeError) { RubyProf.snapshot }
+  end
+end
@@ -1,16 +1,25 @@
 # file ts_dbaccess.rb
 require 'test/unit'
 require 'basic_test'
+require 'columns_test'
+require 'continuous_test'
+require 'deferred_test'
+require 'dump_test'
 require 'exceptions_test'
+require 'fiber_test'
+require 'filter_test'
 require 'duplicate_names_test'
 require 'line_number_test'
 require 'measure_mode_test'
 require 'module_test'
 require 'no_method_class_test'
+require 'overhead_test'
 require 'prime_test'
 require 'printers_test'
 require 'recursive_test'
+require 'sampling_test'
 require 'singleton_test'
+require 'snapshot_test'
 require 'thread_test'
 require 'timing_test'
 
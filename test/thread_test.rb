@@ -132,4 +132,22 @@ class ThreadTest < Test::Unit::TestCase
       end
     end
   end
+
+  def test_threads_in_consecutive_profiles
+    # Threads remember their profiling data, which must not
+    # carry over to the next profile.
+    2.times do
+      result = RubyProf.profile do
+        threads = (1..3).map { Thread.new { sleep(0.01) } }
+        threads.each { |thread| thread.join }
+      end
+
+      assert_equal(4, result.threads.length)
+      methods = result.threads.values.detect do |methods|
+        methods.any? { |method| method.full_name == 'Thread#join' }
+      end
+      join = methods.detect { |method| method.full_name == 'Thread#join' }
+      assert_equal(3, join.called)
+    end
+  end
 end